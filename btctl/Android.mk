@@ -2,9 +2,20 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := btctl.c util.c rl_helper.c
-LOCAL_SHARED_LIBRARIES := libhardware
+LOCAL_SRC_FILES := btctl.c util.c rl_helper.c record.c
+LOCAL_SHARED_LIBRARIES := libhardware libble
 LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := btctl
 
 include $(BUILD_EXECUTABLE)
+
+# Host build against the fake Bluetooth HAL
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_HEADERS)
+LOCAL_SRC_FILES := btctl.c util.c rl_helper.c record.c
+LOCAL_SHARED_LIBRARIES := libfakehal libble
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := btctl
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -22,9 +22,12 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <hardware/bluetooth.h>
@@ -32,36 +35,25 @@
 #include <hardware/bt_gatt_client.h>
 #include <hardware/hardware.h>
 
+#include <libble/ble.h>
+
 #include "util.h"
+#include "record.h"
 #include "rl_helper.h"
 
 #define VERSION "0.5"
 
 #define MAX_LINE_SIZE 64
 #define MAX_SVCS_SIZE 128
+#define SVCS_BUF_SIZE 8
 #define MAX_CHARS_SIZE 8
-#define MAX_CONNECTIONS 10
+#define CONN_TABLE_MIN_SIZE 16
 #define PENDING_CONN_ID  0
 #define INVALID_CONN_ID -1
-
-/* AD types */
-#define AD_FLAGS              0x01
-#define AD_UUID16_SOME        0x02
-#define AD_UUID16_ALL         0x03
-#define AD_UUID128_SOME       0x06
-#define AD_UUID128_ALL        0x07
-#define AD_NAME_SHORT         0x08
-#define AD_NAME_COMPLETE      0x09
-#define AD_TX_POWER           0x0a
-#define AD_SLAVE_CONN_INT     0x12
-#define AD_SOLICIT_UUID16     0x14
-#define AD_SOLICIT_UUID128    0x15
-#define AD_SERVICE_DATA       0x16
-#define AD_PUBLIC_ADDRESS     0x17
-#define AD_RANDOM_ADDRESS     0x18
-#define AD_GAP_APPEARANCE     0x19
-#define AD_ADV_INTERVAL       0x1a
-#define AD_MANUFACTURER_DATA  0xff
+#define WAIT_TIMEOUT 30 /* seconds */
+#define MAX_SCRIPT_LINE 512
+#define INPUT_CHUNK_SIZE 4096
+#define HISTORY_FILE ".btctl_history"
 
 typedef enum {
     NORMAL_PSTATE,
@@ -90,11 +82,14 @@ typedef struct connection {
      * for btgatt_srvc_id_t. But its value is replaced each time. So one option
      * is to store these values and show a simpler ID to user.
      *
-     * This static list limits the number of services that we can store, but it
-     * is simpler than using linked list.
+     * The list is only allocated once services are found, and grows up to
+     * MAX_SVCS_SIZE entries, which is simpler than using linked list.
      */
-    service_info_t svcs[MAX_SVCS_SIZE];
+    service_info_t *svcs;
     int svcs_size;
+    int svcs_buf_size;
+
+    struct connection *next; /* Next connection in the same bucket */
 } connection_t;
 
 /* Data that have to be acessable by the callbacks */
@@ -113,9 +108,47 @@ struct userdata {
     prompt_state_t prompt_state;
     bt_bdaddr_t r_bd_addr; /* remote address when pairing */
 
-    connection_t conns[MAX_CONNECTIONS];
+    /* Connections by conn_id, chained through the connections themselves.
+     * The one being established has no conn_id yet and is kept apart. */
+    connection_t **conns;
+    unsigned int conns_size; /* Always a power of two */
+    unsigned int conn_count;
+    connection_t *pending_conn;
+    /* Guards the connections and their lists, used both by the commands and
+     * by the HAL callbacks, which run on the stack thread. Recursive, as a
+     * callback may come from within a HAL call. */
+    pthread_mutex_t conns_lock;
+
+    bool failed; /* A wait timed out, a script exits with an error */
 } u;
 
+/* Operations a script can wait for */
+typedef enum {
+    WAIT_ENABLED,
+    WAIT_CONNECTED,
+    WAIT_DISCOVERED,
+    WAIT_READ,
+    WAIT_OPS
+} wait_op_t;
+
+static const char *wait_op_names[] = { "enabled", "connected", "discovered",
+                                       "read", NULL };
+
+/* Operations started by commands and finished by callbacks. The wait command
+ * blocks until all the operations of a kind started so far are finished, so
+ * it doesn't matter whether the callback comes before or after it. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int started[WAIT_OPS];
+    unsigned int finished[WAIT_OPS];
+    /* Operations a wait gave up on, whose callbacks may still come */
+    unsigned int abandoned[WAIT_OPS];
+} waits = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
 /* Arbitrary UUID used to identify this application with the GATT library. The
  * Android JAVA framework
  * (frameworks/base/core/java/android/bluetooth/BluetoothAdapter.java,
@@ -153,35 +186,180 @@ void change_prompt_state(prompt_state_t new_state) {
             break;
     }
     rl_set_prompt(prompt_line);
+    /* Answers to the pairing prompts, like PIN codes, aren't commands */
+    rl_set_history(new_state == NORMAL_PSTATE);
     u.prompt_state = new_state;
 }
 
+static unsigned int conn_hash(int conn_id, unsigned int size) {
+    /* Bluedroid builds conn_ids as (link << 8 | client_if), Fibonacci hashing
+     * spreads them over the whole table */
+    return (unsigned int) (((uint64_t) conn_id * 0x9e3779b97f4a7c15ULL) >> 32) &
+           (size - 1);
+}
+
 static connection_t *get_connection(int conn_id)
 {
-    int i;
+    connection_t *conn;
+
+    if (conn_id == PENDING_CONN_ID)
+        return u.pending_conn;
 
-    if (conn_id <= INVALID_CONN_ID)
+    if (conn_id <= INVALID_CONN_ID || !u.conns)
         return NULL;
 
-    for (i = 0; i < MAX_CONNECTIONS; i++)
-        if (u.conns[i].conn_id == conn_id)
-            return &u.conns[i];
+    conn = u.conns[conn_hash(conn_id, u.conns_size)];
+    for (; conn; conn = conn->next)
+        if (conn->conn_id == conn_id)
+            break;
 
-    return NULL;
+    return conn;
 }
 
-/* clear any cache list of connected device */
-static void clear_list_cache(int conn_id) {
-    connection_t *conn;
-    uint8_t i;
+static void wait_op_start(wait_op_t op) {
 
-    conn = get_connection(conn_id);
-    if (conn == NULL)
+    pthread_mutex_lock(&waits.lock);
+    waits.started[op]++;
+    pthread_mutex_unlock(&waits.lock);
+}
+
+/* For operations that failed to start */
+static void wait_op_cancel(wait_op_t op) {
+
+    pthread_mutex_lock(&waits.lock);
+    waits.started[op]--;
+    pthread_mutex_unlock(&waits.lock);
+}
+
+static void wait_op_finish(wait_op_t op) {
+
+    pthread_mutex_lock(&waits.lock);
+    /* The callbacks of operations a wait gave up on come first, they don't
+     * count for the ones started afterwards */
+    if (waits.abandoned[op] > 0)
+        waits.abandoned[op]--;
+    else if (waits.finished[op] < waits.started[op])
+        waits.finished[op]++;
+    pthread_cond_broadcast(&waits.cond);
+    pthread_mutex_unlock(&waits.lock);
+}
+
+/* Adds an established connection to the table, doubling it when full */
+static int add_connection(connection_t *conn) {
+    connection_t **conns, *c, *next;
+    unsigned int i, h, size;
+
+    if (u.conn_count >= u.conns_size) {
+        size = u.conns_size ? u.conns_size * 2 : CONN_TABLE_MIN_SIZE;
+        conns = calloc(size, sizeof(connection_t *));
+        if (!conns)
+            return -1;
+
+        for (i = 0; i < u.conns_size; i++)
+            for (c = u.conns[i]; c; c = next) {
+                next = c->next;
+                h = conn_hash(c->conn_id, size);
+                c->next = conns[h];
+                conns[h] = c;
+            }
+
+        free(u.conns);
+        u.conns = conns;
+        u.conns_size = size;
+    }
+
+    h = conn_hash(conn->conn_id, u.conns_size);
+    conn->next = u.conns[h];
+    u.conns[h] = conn;
+    u.conn_count++;
+
+    return 0;
+}
+
+static void remove_connection(connection_t *conn) {
+    connection_t **p;
+
+    if (!u.conns)
         return;
 
-    for (i = 0; i < conn->svcs_size; i++)
-        conn->svcs[i].char_count = 0;
+    p = &u.conns[conn_hash(conn->conn_id, u.conns_size)];
+    for (; *p; p = &(*p)->next)
+        if (*p == conn) {
+            *p = conn->next;
+            u.conn_count--;
+            return;
+        }
+}
+
+/* Frees the descriptor lists of all characteristics of a service */
+static void clear_chars(service_info_t *svc) {
+    uint8_t i;
+
+    for (i = 0; i < svc->char_count; i++) {
+        free(svc->chars_buf[i].descrs);
+        svc->chars_buf[i].descrs = NULL;
+        svc->chars_buf[i].descr_count = 0;
+    }
+    svc->char_count = 0;
+}
+
+/* clear any cache list of connected device */
+static void clear_list_cache(connection_t *conn) {
+    int i;
+
+    for (i = 0; i < conn->svcs_size; i++) {
+        clear_chars(&conn->svcs[i]);
+        free(conn->svcs[i].chars_buf);
+    }
+
+    free(conn->svcs);
+    conn->svcs = NULL;
     conn->svcs_size = 0;
+    conn->svcs_buf_size = 0;
+}
+
+static void free_connection(connection_t *conn) {
+    clear_list_cache(conn);
+    free(conn);
+}
+
+/* Memory held by a connection and its services, characteristics and
+ * descriptors lists */
+static size_t connection_footprint(connection_t *conn) {
+    size_t size;
+    int i, j;
+
+    size = sizeof(connection_t);
+    size += conn->svcs_buf_size * sizeof(service_info_t);
+
+    for (i = 0; i < conn->svcs_size; i++) {
+        service_info_t *svc = &conn->svcs[i];
+
+        size += svc->chars_buf_size * sizeof(char_info_t);
+        for (j = 0; j < svc->char_count; j++)
+            size += svc->chars_buf[j].descr_count * sizeof(bt_uuid_t);
+    }
+
+    return size;
+}
+
+static void free_all_connections(void) {
+    connection_t *conn, *next;
+    unsigned int i;
+
+    for (i = 0; i < u.conns_size; i++)
+        for (conn = u.conns[i]; conn; conn = next) {
+            next = conn->next;
+            free_connection(conn);
+        }
+
+    if (u.pending_conn)
+        free_connection(u.pending_conn);
+
+    free(u.conns);
+    u.conns = NULL;
+    u.conns_size = u.conn_count = 0;
+    u.pending_conn = NULL;
 }
 
 static int find_svc(connection_t *conn, btgatt_srvc_id_t *svc) {
@@ -247,9 +425,11 @@ static void adapter_state_change_cb(bt_state_t state) {
         * there is callback for gattiface->init().
         */
         bt_status_t status = u.gattiface->client->register_client(&app_uuid);
-        if (status != BT_STATUS_SUCCESS)
+        if (status != BT_STATUS_SUCCESS) {
             rl_printf("Failed to register as a GATT client, status: %d\n",
                       status);
+            wait_op_finish(WAIT_ENABLED);
+        }
     }
 }
 
@@ -268,9 +448,14 @@ static void cmd_enable(char *args) {
         return;
     }
 
+    /* Finished once registered as a GATT client */
+    wait_op_start(WAIT_ENABLED);
+
     status = u.btiface->enable();
-    if (status != BT_STATUS_SUCCESS)
+    if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to enable Bluetooth\n");
+        wait_op_cancel(WAIT_ENABLED);
+    }
 }
 
 /* Disables the Bluetooth adapter */
@@ -355,6 +540,7 @@ static void adapter_properties_cb(bt_status_t status, int num_properties,
 static void device_found_cb(int num_properties, bt_property_t *properties) {
     char addr_str[BT_ADDRESS_STR_LEN];
 
+    rl_event_begin();
     rl_printf("\nDevice found\n");
 
     while (num_properties--) {
@@ -412,6 +598,7 @@ static void device_found_cb(int num_properties, bt_property_t *properties) {
                 break;
         }
     }
+    rl_event_end();
 }
 
 static void discovery_state_changed_cb(bt_discovery_state_t state) {
@@ -462,15 +649,13 @@ static void cmd_discovery(char *args) {
         rl_printf("Invalid argument \"%s\"\n", arg);
 }
 
-static void parse_ad_data(uint8_t *data, uint8_t length) {
-    uint8_t i = 0;
-    uint8_t ad_type = data[i++];
-
-    switch (ad_type) {
-        uint8_t j;
+static void parse_ad_data(const ble_ad_t *ad) {
+    const uint8_t *data = ad->data;
+    int j, count;
 
-        case AD_FLAGS: {
-            uint8_t mask = data[i];
+    switch (ad->type) {
+        case BLE_AD_FLAGS: {
+            uint8_t flags, mask;
             static const struct {
                 uint8_t bit;
                 const char *str;
@@ -483,10 +668,14 @@ static void parse_ad_data(uint8_t *data, uint8_t length) {
                 {0xFF, NULL}
             };
 
+            if (ble_ad_get_flags(ad, &flags) < 0)
+                goto invalid;
+
             rl_printf("    Flags\n");
 
+            mask = flags;
             for (j = 0; eir_flags_table[j].str; j++) {
-                if (data[i] & (1 << eir_flags_table[j].bit)) {
+                if (flags & (1 << eir_flags_table[j].bit)) {
                     rl_printf("      %s\n", eir_flags_table[j].str);
                     mask &= ~(1 << eir_flags_table[j].bit);
                 }
@@ -497,157 +686,241 @@ static void parse_ad_data(uint8_t *data, uint8_t length) {
 
             break;
         }
-        case AD_UUID16_ALL:
-        case AD_UUID16_SOME:
-        case AD_SOLICIT_UUID16: {
-            uint8_t count = (length - 1) / sizeof(uint16_t);
+        case BLE_AD_UUID16_ALL:
+        case BLE_AD_UUID16_SOME:
+        case BLE_AD_SOLICIT_UUID16:
+        case BLE_AD_UUID32_ALL:
+        case BLE_AD_UUID32_SOME:
+        case BLE_AD_SOLICIT_UUID32:
+        case BLE_AD_UUID128_ALL:
+        case BLE_AD_UUID128_SOME:
+        case BLE_AD_SOLICIT_UUID128: {
             const char *msg = NULL;
+            uint8_t uuid[16];
 
-            switch (ad_type) {
-                case AD_UUID16_ALL:
+            switch (ad->type) {
+                case BLE_AD_UUID16_ALL:
                     msg = "    Complete list of 16-bit Service UUIDs: ";
                     break;
-                case AD_UUID16_SOME:
+                case BLE_AD_UUID16_SOME:
                     msg = "    Incomplete list of 16-bit Service UUIDs: ";
                     break;
-                case AD_SOLICIT_UUID16:
+                case BLE_AD_SOLICIT_UUID16:
                     msg = "    List of 16-bit Service Solicitation UUIDs: ";
                     break;
-            }
-
-            rl_printf("%s%u entr%s\n", msg, count, count == 1 ? "y" : "ies");
-
-            for (j = 0; j < count; j++)
-                rl_printf("      0x%02X%02X\n", data[i+j*sizeof(uint16_t)+1],
-                          data[i+j*sizeof(uint16_t)]);
-
-            break;
-        }
-        case AD_UUID128_ALL:
-        case AD_UUID128_SOME:
-        case AD_SOLICIT_UUID128: {
-            uint8_t count = (length - 1) / 16;
-            const char *msg = NULL;
-
-            switch (ad_type) {
-                case AD_UUID128_ALL:
+                case BLE_AD_UUID32_ALL:
+                    msg = "    Complete list of 32-bit Service UUIDs: ";
+                    break;
+                case BLE_AD_UUID32_SOME:
+                    msg = "    Incomplete list of 32-bit Service UUIDs: ";
+                    break;
+                case BLE_AD_SOLICIT_UUID32:
+                    msg = "    List of 32-bit Service Solicitation UUIDs: ";
+                    break;
+                case BLE_AD_UUID128_ALL:
                     msg = "    Complete list of 128-bit Service UUIDs: ";
                     break;
-                case AD_UUID128_SOME:
+                case BLE_AD_UUID128_SOME:
                     msg = "    Incomplete list of 128-bit Service UUIDs: ";
                     break;
-                case AD_SOLICIT_UUID128:
+                case BLE_AD_SOLICIT_UUID128:
                     msg = "    List of 128-bit Service Solicitation UUIDs: ";
                     break;
             }
 
+            count = ble_ad_uuid_count(ad);
             rl_printf("%s%u entr%s\n", msg, count, count == 1 ? "y" : "ies");
 
-            for (j = 0; j < count; j++)
-                rl_printf("      %02X %02X %02X %02X %02X %02X %02X %02X %02X "
-                          "%02X %02X %02X %02X %02X %02X %02X\n",
-                          data[i+j*16+15], data[i+j*16+14], data[i+j*16+13],
-                          data[i+j*16+12], data[i+j*16+11], data[i+j*16+10],
-                          data[i+j*16+9], data[i+j*16+8], data[i+j*16+7],
-                          data[i+j*16+6], data[i+j*16+5], data[i+j*16+4],
-                          data[i+j*16+3], data[i+j*16+2], data[i+j*16+1],
-                          data[i+j*16]);
+            for (j = 0; j < count; j++) {
+                ble_ad_get_uuid(ad, j, uuid);
+
+                switch (ad->type) {
+                    case BLE_AD_UUID16_ALL:
+                    case BLE_AD_UUID16_SOME:
+                    case BLE_AD_SOLICIT_UUID16:
+                        rl_printf("      0x%02X%02X\n", uuid[13], uuid[12]);
+                        break;
+                    case BLE_AD_UUID32_ALL:
+                    case BLE_AD_UUID32_SOME:
+                    case BLE_AD_SOLICIT_UUID32:
+                        rl_printf("      0x%02X%02X%02X%02X\n", uuid[15],
+                                  uuid[14], uuid[13], uuid[12]);
+                        break;
+                    default:
+                        rl_printf("      %02X %02X %02X %02X %02X %02X %02X "
+                                  "%02X %02X %02X %02X %02X %02X %02X %02X "
+                                  "%02X\n", uuid[15], uuid[14], uuid[13],
+                                  uuid[12], uuid[11], uuid[10], uuid[9],
+                                  uuid[8], uuid[7], uuid[6], uuid[5], uuid[4],
+                                  uuid[3], uuid[2], uuid[1], uuid[0]);
+                        break;
+                }
+            }
 
             break;
         }
-        case AD_NAME_SHORT:
-        case AD_NAME_COMPLETE: {
-            char name[length];
+        case BLE_AD_NAME_SHORT:
+        case BLE_AD_NAME_COMPLETE: {
+            const char *name;
+            int len;
 
-            memset(name, 0, sizeof(name));
-            memcpy(name, &data[i], length-1);
+            ble_ad_get_name(ad, &name, &len);
 
-            if (ad_type == AD_NAME_SHORT)
+            if (ad->type == BLE_AD_NAME_SHORT)
                 rl_printf("    Shortened Local Name\n");
             else
                 rl_printf("    Complete Local Name\n");
 
-            rl_printf("      %s\n", name);
+            rl_printf("      %.*s\n", len, name);
 
             break;
         }
-        case AD_TX_POWER:
+        case BLE_AD_TX_POWER: {
+            int8_t tx_power;
+
+            if (ble_ad_get_tx_power(ad, &tx_power) < 0)
+                goto invalid;
+
             rl_printf("    TX Power Level\n");
-            rl_printf("      %d\n", (int8_t) data[i]);
+            rl_printf("      %d\n", tx_power);
             break;
-        case AD_SLAVE_CONN_INT: {
+        }
+        case BLE_AD_SLAVE_CONN_INT: {
             uint16_t min, max;
 
+            if (ad->len < 4)
+                goto invalid;
+
             rl_printf("    Slave Connection Interval\n");
 
-            min = data[i] + (data[i+1] << 4);
+            min = data[0] + (data[1] << 8);
             if (min >= 0x0006 && min <= 0x0c80)
                 rl_printf("      Minimum = %.2f\n", (float) min * 1.25);
 
-            max = data[i+2] + (data[i+3] << 4);
+            max = data[2] + (data[3] << 8);
             if (max >= 0x0006 && max <= 0x0c80)
                 rl_printf("      Maximum = %.2f\n", (float) max * 1.25);
 
             break;
         }
-        case AD_SERVICE_DATA:
+        case BLE_AD_SERVICE_DATA:
             rl_printf("    Service Data\n");
             break;
-        case AD_PUBLIC_ADDRESS:
-        case AD_RANDOM_ADDRESS:
-            if (ad_type == AD_PUBLIC_ADDRESS)
+        case BLE_AD_PUBLIC_ADDRESS:
+        case BLE_AD_RANDOM_ADDRESS:
+            if (ad->len < 6)
+                goto invalid;
+
+            if (ad->type == BLE_AD_PUBLIC_ADDRESS)
                 rl_printf("    Public Target Address\n");
             else
                 rl_printf("    Random Target Address\n");
 
-            rl_printf("      %02X:%02X:%02X:%02X:%02X:%02X\n", data[i+5],
-                      data[i+4], data[i+3], data[i+2], data[i+1], data[i]);
+            rl_printf("      %02X:%02X:%02X:%02X:%02X:%02X\n", data[5],
+                      data[4], data[3], data[2], data[1], data[0]);
             break;
-        case AD_GAP_APPEARANCE:
+        case BLE_AD_GAP_APPEARANCE:
+            if (ad->len < 2)
+                goto invalid;
+
             rl_printf("    Appearance\n");
-            rl_printf("      0x%02X%02X\n", data[i+1], data[i]);
+            rl_printf("      0x%02X%02X\n", data[1], data[0]);
             break;
-        case AD_ADV_INTERVAL: {
+        case BLE_AD_ADV_INTERVAL: {
             uint16_t adv_interval;
 
+            if (ad->len < 2)
+                goto invalid;
+
             rl_printf("    Advertising Interval\n");
 
-            adv_interval = data[i] + (data[i+1] << 4);
+            adv_interval = data[0] + (data[1] << 8);
             rl_printf("      %.2f\n", (float) adv_interval * 0.625);
 
             break;
         }
-        case AD_MANUFACTURER_DATA:
+        case BLE_AD_MANUFACTURER_DATA: {
+            const uint8_t *mdata;
+            uint16_t company_id;
+            int len;
+
+            if (ble_ad_get_manufacturer_data(ad, &company_id, &mdata,
+                                             &len) < 0)
+                goto invalid;
+
             rl_printf("    Manufacturer-specific data\n");
-            rl_printf("      Company ID: 0x%02X%02X\n", data[i+1], data[i]);
+            rl_printf("      Company ID: 0x%04X\n", company_id);
             rl_printf("      Data:");
-            for (j = i+2; j < i+length; j++)
-                rl_printf(" %02X", data[j]);
+            for (j = 0; j < len; j++)
+                rl_printf(" %02X", mdata[j]);
             rl_printf("\n");
             break;
+        }
         default:
-            rl_printf("    Invalid data type 0x%02X\n", ad_type);
+            rl_printf("    Invalid data type 0x%02X\n", ad->type);
             break;
     }
+
+    return;
+
+invalid:
+    rl_printf("    Malformed data of type 0x%02X\n", ad->type);
+}
+
+/* Scan report with the local name and the advertising data up to its last AD
+ * structure */
+static void scan_record(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    const char *name = NULL;
+    int name_len = 0, len = 0;
+    ble_ad_iter_t it;
+    ble_ad_t ad;
+    record_t r;
+    int ret;
+
+    ble_ad_iter_init(&it, adv_data, BLE_ADV_DATA_LEN);
+    while ((ret = ble_ad_next(&it, &ad)) > 0) {
+        if (ad.type == BLE_AD_NAME_COMPLETE ||
+            (ad.type == BLE_AD_NAME_SHORT && name == NULL))
+            ble_ad_get_name(&ad, &name, &name_len);
+        len = ad.data + ad.len - adv_data;
+    }
+
+    if (ret < 0)
+        len = BLE_ADV_DATA_LEN;
+
+    record_begin(&r, "scan");
+    record_add_addr(&r, "addr", bda->address);
+    record_add_int(&r, "rssi", rssi);
+    record_add_str(&r, "name", name, name_len);
+    record_add_hex(&r, "adv", adv_data, len);
+    record_end(&r);
 }
 
 static void scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
     char addr_str[BT_ADDRESS_STR_LEN];
-    uint8_t i = 0;
+    ble_ad_iter_t it;
+    ble_ad_t ad;
+    int ret;
+
+    if (record_format() != FORMAT_TEXT) {
+        scan_record(bda, rssi, adv_data);
+        return;
+    }
 
+    /* Render the whole report at once, not a prompt redraw per line */
+    rl_event_begin();
     rl_printf("\nBLE device found\n");
     rl_printf("  Address: %s\n", ba2str(bda->address, addr_str));
     rl_printf("  RSSI: %d\n", rssi);
 
     rl_printf("  Advertising Data:\n");
-    while (i < 31 && adv_data[i] != 0) {
-        uint8_t length, ad_type, j;
+    ble_ad_iter_init(&it, adv_data, BLE_ADV_DATA_LEN);
+    while ((ret = ble_ad_next(&it, &ad)) > 0)
+        parse_ad_data(&ad);
 
-        length = adv_data[i++];
-        parse_ad_data(&adv_data[i], length);
-
-        i += length;
-    }
+    if (ret < 0)
+        rl_printf("    Truncated data\n");
+    rl_event_end();
 }
 
 static void cmd_scan(char *args) {
@@ -707,29 +980,57 @@ static void cmd_scan(char *args) {
         rl_printf("Invalid argument \"%s\"\n", arg);
 }
 
+static void connection_record(const char *event, int conn_id, int status,
+                              bt_bdaddr_t *bda) {
+    record_t r;
+
+    record_begin(&r, event);
+    record_add_int(&r, "conn_id", conn_id);
+    record_add_int(&r, "status", status);
+    record_add_addr(&r, "addr", bda->address);
+    record_end(&r);
+}
+
 static void connect_cb(int conn_id, int status, int client_if,
                        bt_bdaddr_t *bda) {
     char addr_str[BT_ADDRESS_STR_LEN];
     connection_t *conn;
 
-    /* Get the space reserved on buffer (conn_id is zero) */
-    conn = get_connection(PENDING_CONN_ID);
+    if (record_format() != FORMAT_TEXT)
+        connection_record("connect", conn_id, status, bda);
+
+    pthread_mutex_lock(&u.conns_lock);
+
+    /* Get the connection requested by cmd_connect() */
+    conn = u.pending_conn;
     if (conn == NULL) {
-        rl_printf("No space reserved on buffer\n");
+        pthread_mutex_unlock(&u.conns_lock);
+        rl_printf("No pending connection\n");
         return;
     }
+    u.pending_conn = NULL;
 
     if (status != 0) {
-        rl_printf("Failed to connect to device %s, status: %i\n",
-                  ba2str(bda->address, addr_str), status);
-        conn->conn_id = INVALID_CONN_ID;
-        return;
+        if (record_format() == FORMAT_TEXT)
+            rl_printf("Failed to connect to device %s, status: %i\n",
+                      ba2str(bda->address, addr_str), status);
+        free_connection(conn);
+        goto done;
     }
 
-    rl_printf("Connected to device %s, conn_id: %d, client_if: %d\n",
-              ba2str(bda->address, addr_str), conn_id, client_if);
+    if (record_format() == FORMAT_TEXT)
+        rl_printf("Connected to device %s, conn_id: %d, client_if: %d\n",
+                  ba2str(bda->address, addr_str), conn_id, client_if);
 
     conn->conn_id = conn_id;
+    if (add_connection(conn) < 0) {
+        rl_printf("Unable to track connection %d: out of memory\n", conn_id);
+        free_connection(conn);
+    }
+
+done:
+    pthread_mutex_unlock(&u.conns_lock);
+    wait_op_finish(WAIT_CONNECTED);
 }
 
 static void disconnect_cb(int conn_id, int status, int client_if,
@@ -737,15 +1038,20 @@ static void disconnect_cb(int conn_id, int status, int client_if,
     char addr_str[BT_ADDRESS_STR_LEN];
     connection_t *conn;
 
-    rl_printf("Disconnected from device %s, conn_id: %d, client_if: %d, "
-              "status: %d\n", ba2str(bda->address, addr_str), conn_id,
-              client_if, status);
+    if (record_format() != FORMAT_TEXT)
+        connection_record("disconnect", conn_id, status, bda);
+    else
+        rl_printf("Disconnected from device %s, conn_id: %d, client_if: %d, "
+                  "status: %d\n", ba2str(bda->address, addr_str), conn_id,
+                  client_if, status);
 
+    pthread_mutex_lock(&u.conns_lock);
     conn = get_connection(conn_id);
-    if (conn != NULL) {
-        conn->conn_id = INVALID_CONN_ID;
-        clear_list_cache(conn_id);
+    if (conn != NULL && conn_id != PENDING_CONN_ID) {
+        remove_connection(conn);
+        free_connection(conn);
     }
+    pthread_mutex_unlock(&u.conns_lock);
 }
 
 static void cmd_disconnect(char *args) {
@@ -774,10 +1080,11 @@ static void cmd_disconnect(char *args) {
     if (id == PENDING_CONN_ID) {
         char addr_str[BT_ADDRESS_STR_LEN];
 
-        conn->conn_id = INVALID_CONN_ID;
+        u.pending_conn = NULL;
         rl_printf("Cancel pending connection: %s\n",
                   ba2str(conn->remote_addr.address, addr_str));
-        clear_list_cache(id);
+        free_connection(conn);
+        wait_op_finish(WAIT_CONNECTED);
     }
 }
 
@@ -827,7 +1134,7 @@ static void cmd_connect(char *args) {
     bt_status_t status;
     connection_t *conn = NULL;
     char arg[MAX_LINE_SIZE];
-    int ret, i;
+    int ret;
 
     if (u.gattiface == NULL) {
         rl_printf("Unable to BLE connect: GATT interface not available\n");
@@ -845,23 +1152,14 @@ static void cmd_connect(char *args) {
     }
 
     /* Check if there is a pending connect (conn_id is zero) */
-    conn = get_connection(PENDING_CONN_ID);
-    if (conn != NULL) {
+    if (u.pending_conn != NULL) {
         rl_printf("Unable to connect: previous connecting on going\n");
         return;
     }
 
-    /* Check if there is space available and save the index */
-    for (i = 0; i < MAX_CONNECTIONS; i++)
-        if (u.conns[i].conn_id == INVALID_CONN_ID) {
-            conn = &u.conns[i];
-            break;
-        }
-
-    /* No space available on buffer */
+    conn = calloc(1, sizeof(connection_t));
     if (conn == NULL) {
-        rl_printf("Unable to connect: maximum number of connections "
-                  "exceeded\n");
+        rl_printf("Unable to connect: out of memory\n");
         return;
     }
 
@@ -870,20 +1168,29 @@ static void cmd_connect(char *args) {
     ret = str2ba(arg, &conn->remote_addr);
     if (ret != 0) {
         rl_printf("Unable to connect: Invalid bluetooth address: %s\n", arg);
+        free_connection(conn);
         return;
     }
 
     rl_printf("Connecting to: %s\n", arg);
 
+    /* Set before the call, the stack may answer before it returns */
+    conn->conn_id = PENDING_CONN_ID;
+    u.pending_conn = conn;
+
+    wait_op_start(WAIT_CONNECTED);
+
     status = u.gattiface->client->connect(u.client_if, &conn->remote_addr,
                                           true);
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to connect, status: %d\n", status);
+        if (u.pending_conn == conn) {
+            u.pending_conn = NULL;
+            free_connection(conn);
+        }
+        wait_op_cancel(WAIT_CONNECTED);
         return;
     }
-
-    /* Lock the space on buffer */
-    conn->conn_id = PENDING_CONN_ID;
 }
 
 static void bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
@@ -995,23 +1302,66 @@ static void cmd_pair(char *args) {
 void search_complete_cb(int conn_id, int status) {
 
     rl_printf("Search complete, status: %u\n", status);
+    wait_op_finish(WAIT_DISCOVERED);
 }
 
 /* called for each search result */
 void search_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
     char uuid_str[UUID128_STR_LEN] = {0};
-    connection_t *conn = get_connection(conn_id);
+    connection_t *conn;
 
-    if (conn->svcs_size < MAX_SVCS_SIZE) {
+    pthread_mutex_lock(&u.conns_lock);
+
+    conn = get_connection(conn_id);
+    if (conn == NULL) {
+        rl_printf("%s: Invalid connection ID\n", __func__);
+        goto done;
+    }
+
+    if (conn->svcs_size == conn->svcs_buf_size &&
+        conn->svcs_buf_size < MAX_SVCS_SIZE) {
+        service_info_t *svcs;
+        int size;
+
+        size = conn->svcs_buf_size ? conn->svcs_buf_size * 2 : SVCS_BUF_SIZE;
+        if (size > MAX_SVCS_SIZE)
+            size = MAX_SVCS_SIZE;
+
+        svcs = realloc(conn->svcs, size * sizeof(service_info_t));
+        if (svcs != NULL) {
+            memset(&svcs[conn->svcs_buf_size], 0,
+                   (size - conn->svcs_buf_size) * sizeof(service_info_t));
+            conn->svcs = svcs;
+            conn->svcs_buf_size = size;
+        }
+    }
+
+    if (conn->svcs_size < conn->svcs_buf_size) {
         /* srvc_id value is replaced each time, so we need to copy it */
         memcpy(&conn->svcs[conn->svcs_size].svc_id, srvc_id,
                sizeof(btgatt_srvc_id_t));
         conn->svcs_size++;
     }
 
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "service");
+        record_add_int(&r, "conn_id", conn_id);
+        record_add_int(&r, "id", conn->svcs_size - 1);
+        record_add_uuid(&r, "uuid", &srvc_id->id.uuid);
+        record_add_int(&r, "inst", srvc_id->id.inst_id);
+        record_add_bool(&r, "primary", srvc_id->is_primary);
+        record_end(&r);
+        goto done;
+    }
+
     rl_printf("ID:%i %s UUID: %s instance:%i\n", conn->svcs_size - 1,
               srvc_id->is_primary ? "Primary" : "Secondary",
               uuid2str(&srvc_id->id.uuid, uuid_str), srvc_id->id.inst_id);
+
+done:
+    pthread_mutex_unlock(&u.conns_lock);
 }
 
 static void cmd_search_svc(char *args) {
@@ -1040,7 +1390,7 @@ static void cmd_search_svc(char *args) {
         return;
     }
 
-    clear_list_cache(conn_id);
+    clear_list_cache(conn);
 
     /* Get UUID argument (if exists) */
     line_get_str(&args, arg);
@@ -1051,12 +1401,16 @@ static void cmd_search_svc(char *args) {
                 return;
             }
 
+            wait_op_start(WAIT_DISCOVERED);
             status = u.gattiface->client->search_service(conn_id, &uuid);
-    } else
+    } else {
+            wait_op_start(WAIT_DISCOVERED);
             status = u.gattiface->client->search_service(conn_id, NULL);
+    }
 
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to search services\n");
+        wait_op_cancel(WAIT_DISCOVERED);
         return;
     }
 }
@@ -1138,31 +1492,45 @@ void get_characteristic_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id,
     if (status != 0) {
         if (status == 0x85) { /* it's not really an error, just finished */
             rl_printf("List characteristics finished\n");
-            return;
+            goto done;
         }
 
         rl_printf("List characteristics finished, status: %i %s\n", status,
                   atterror2str(status));
-        return;
+        goto done;
     }
 
+    pthread_mutex_lock(&u.conns_lock);
+
     conn = get_connection(conn_id);
     if (conn == NULL) {
         rl_printf("%s: Invalid connection ID\n", __func__);
-        return;
+        goto unlock;
     }
 
     svc_id = find_svc(conn, srvc_id);
 
     if (svc_id < 0) {
         rl_printf("Received invalid characteristic (service inexistent)\n");
-        return;
+        goto unlock;
     }
     svc_info = &conn->svcs[svc_id];
 
-    rl_printf("ID:%i UUID: %s instance:%i properties:0x%x\n",
-              svc_info->char_count, uuid2str(&char_id->uuid, uuid_str),
-              char_id->inst_id, char_prop);
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "char");
+        record_add_int(&r, "conn_id", conn_id);
+        record_add_int(&r, "service_id", svc_id);
+        record_add_int(&r, "id", svc_info->char_count);
+        record_add_uuid(&r, "uuid", &char_id->uuid);
+        record_add_int(&r, "inst", char_id->inst_id);
+        record_add_int(&r, "properties", char_prop);
+        record_end(&r);
+    } else
+        rl_printf("ID:%i UUID: %s instance:%i properties:0x%x\n",
+                  svc_info->char_count, uuid2str(&char_id->uuid, uuid_str),
+                  char_id->inst_id, char_prop);
 
     if (svc_info->char_count == svc_info->chars_buf_size) {
         int i;
@@ -1189,8 +1557,16 @@ void get_characteristic_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id,
                                                   char_id);
     if (ret != BT_STATUS_SUCCESS) {
         rl_printf("Failed to list characteristics\n");
-        return;
+        goto unlock;
     }
+
+    pthread_mutex_unlock(&u.conns_lock);
+    return; /* listing goes on with the next one */
+
+unlock:
+    pthread_mutex_unlock(&u.conns_lock);
+done:
+    wait_op_finish(WAIT_DISCOVERED);
 }
 
 /* search all characteristics of specific service */
@@ -1240,28 +1616,56 @@ static void cmd_chars(char *args) {
             svc->chars_buf[i].descr_count = 0;
         }
     } else if (svc->char_count > 0)
-        svc->char_count = 0;
+        clear_chars(svc);
 
     /* get first characteristic of service */
+    wait_op_start(WAIT_DISCOVERED);
     status = u.gattiface->client->get_characteristic(conn->conn_id,
                                                      &svc->svc_id,
                                                      NULL);
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to list characteristics\n");
+        wait_op_cancel(WAIT_DISCOVERED);
         return;
     }
 }
 
+/* Record of an operation on a characteristic or, when descr_id is not NULL,
+ * on one of its descriptors. The value is only added if not NULL */
+static void attr_record(const char *event, int conn_id, int status,
+                        btgatt_srvc_id_t *srvc_id, btgatt_char_id_t *char_id,
+                        bt_uuid_t *descr_id, const uint8_t *value, int len) {
+    record_t r;
+
+    record_begin(&r, event);
+    record_add_int(&r, "conn_id", conn_id);
+    record_add_int(&r, "status", status);
+    record_add_uuid(&r, "service", &srvc_id->id.uuid);
+    record_add_uuid(&r, "char", &char_id->uuid);
+    if (descr_id)
+        record_add_uuid(&r, "desc", descr_id);
+    if (value)
+        record_add_hex(&r, "value", value, status == 0 ? len : 0);
+    record_end(&r);
+}
+
 void read_characteristic_cb(int conn_id, int status,
                             btgatt_read_params_t *p_data) {
     char uuid_str[UUID128_STR_LEN] = {0};
     char value_hexstr[BTGATT_MAX_ATTR_LEN * 3 + 1] = {0};
     int i;
 
+    if (record_format() != FORMAT_TEXT) {
+        attr_record("read", conn_id, status, &p_data->srvc_id,
+                    &p_data->char_id, NULL, p_data->value.value,
+                    p_data->value.len);
+        goto done;
+    }
+
     if (status != 0) {
         rl_printf("Read characteristic error, status:%i %s\n", status,
                   atterror2str(status));
-        return;
+        goto done;
     }
 
     for (i = 0; i < p_data->value.len; i++)
@@ -1274,6 +1678,9 @@ void read_characteristic_cb(int conn_id, int status,
               uuid_str));
     rl_printf("  value_type:%i status:%i value(hex): %s\n", p_data->value_type,
               p_data->status, value_hexstr);
+
+done:
+    wait_op_finish(WAIT_READ);
 }
 
 static void cmd_read_char(char *args) {
@@ -1321,12 +1728,14 @@ static void cmd_read_char(char *args) {
     }
 
     char_info = &svc_info->chars_buf[char_id];
+    wait_op_start(WAIT_READ);
     status = u.gattiface->client->read_characteristic(conn->conn_id,
                                                       &svc_info->svc_id,
                                                       &char_info->char_id,
                                                       auth);
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to read characteristic\n");
+        wait_op_cancel(WAIT_READ);
         return;
     }
 }
@@ -1335,6 +1744,12 @@ void write_characteristic_cb(int conn_id, int status,
                              btgatt_write_params_t *p_data) {
     char uuid_str[UUID128_STR_LEN] = {0};
 
+    if (record_format() != FORMAT_TEXT) {
+        attr_record("write", conn_id, status, &p_data->srvc_id,
+                    &p_data->char_id, NULL, NULL, 0);
+        return;
+    }
+
     if (status != 0) {
         rl_printf("Write characteristic error, status:%i %s\n", status,
                   atterror2str(status));
@@ -1487,40 +1902,53 @@ void get_descriptor_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id,
     if (status != 0) {
         if (status == 0x85) { /* it's not really an error, just finished */
             rl_printf("List characteristics descriptors finished\n");
-            return;
+            goto done;
         }
 
         rl_printf("List characteristic descriptors finished, status: %i %s\n",
                   status, atterror2str(status));
-        return;
+        goto done;
     }
 
+    pthread_mutex_lock(&u.conns_lock);
+
     conn = get_connection(conn_id);
     if (conn == NULL) {
         rl_printf("%s: Invalid connection ID\n", __func__);
-        return;
+        goto unlock;
     }
 
     svc_id = find_svc(conn, srvc_id);
     if (svc_id < 0) {
         rl_printf("Received invalid descriptor (service inexistent)\n");
-        return;
+        goto unlock;
     }
     svc_info = &conn->svcs[svc_id];
 
     ch_id = find_char(svc_info, char_id);
     if (ch_id < 0) {
         rl_printf("Received invalid descriptor (characteristic inexistent)\n");
-        return;
+        goto unlock;
     }
     char_info = &svc_info->chars_buf[ch_id];
 
-    rl_printf("ID:%i UUID: %s\n", char_info->descr_count,
-              uuid2str(descr_id, uuid_str));
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "desc");
+        record_add_int(&r, "conn_id", conn_id);
+        record_add_int(&r, "service_id", svc_id);
+        record_add_int(&r, "char_id", ch_id);
+        record_add_int(&r, "id", char_info->descr_count);
+        record_add_uuid(&r, "uuid", descr_id);
+        record_end(&r);
+    } else
+        rl_printf("ID:%i UUID: %s\n", char_info->descr_count,
+                  uuid2str(descr_id, uuid_str));
 
     if (char_info->descr_count == 255) {
         rl_printf("Max descriptors overflow error\n");
-        return;
+        goto unlock;
     }
 
     char_info->descr_count++;
@@ -1536,8 +1964,16 @@ void get_descriptor_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id,
                                               descr_id);
     if (ret != BT_STATUS_SUCCESS) {
         rl_printf("Failed to list descriptors\n");
-        return;
+        goto unlock;
     }
+
+    pthread_mutex_unlock(&u.conns_lock);
+    return; /* listing goes on with the next one */
+
+unlock:
+    pthread_mutex_unlock(&u.conns_lock);
+done:
+    wait_op_finish(WAIT_DISCOVERED);
 }
 
 static void cmd_char_desc(char *args) {
@@ -1583,13 +2019,17 @@ static void cmd_char_desc(char *args) {
     }
 
     char_info = &svc_info->chars_buf[char_id];
+    free(char_info->descrs);
+    char_info->descrs = NULL;
     char_info->descr_count = 0;
     /* get first descriptor */
+    wait_op_start(WAIT_DISCOVERED);
     status = u.gattiface->client->get_descriptor(conn->conn_id,
                                                  &svc_info->svc_id,
                                                  &char_info->char_id, NULL);
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to list characteristic descriptors\n");
+        wait_op_cancel(WAIT_DISCOVERED);
         return;
     }
 }
@@ -1598,6 +2038,12 @@ void write_descriptor_cb(int conn_id, int status,
                          btgatt_write_params_t *p_data) {
     char uuid_str[UUID128_STR_LEN] = {0};
 
+    if (record_format() != FORMAT_TEXT) {
+        attr_record("write-desc", conn_id, status, &p_data->srvc_id,
+                    &p_data->char_id, &p_data->descr_id, NULL, 0);
+        return;
+    }
+
     if (status != 0) {
         rl_printf("Write descriptor error, status:%i %s\n", status,
                   atterror2str(status));
@@ -1743,10 +2189,17 @@ void read_descriptor_cb(int conn_id, int status, btgatt_read_params_t *p_data) {
     char value_hexstr[BTGATT_MAX_ATTR_LEN * 3 + 1] = {0};
     int i;
 
+    if (record_format() != FORMAT_TEXT) {
+        attr_record("read-desc", conn_id, status, &p_data->srvc_id,
+                    &p_data->char_id, &p_data->descr_id, p_data->value.value,
+                    p_data->value.len);
+        goto done;
+    }
+
     if (status != 0) {
         rl_printf("Read descriptor error, status:%i %s\n", status,
                   atterror2str(status));
-        return;
+        goto done;
     }
 
     for (i = 0; i < p_data->value.len; i++)
@@ -1761,6 +2214,9 @@ void read_descriptor_cb(int conn_id, int status, btgatt_read_params_t *p_data) {
               uuid_str));
     rl_printf("  value_type:%i status:%i value(hex): %s\n", p_data->value_type,
               p_data->status, value_hexstr);
+
+done:
+    wait_op_finish(WAIT_READ);
 }
 
 static void cmd_read_desc(char *args) {
@@ -1815,12 +2271,14 @@ static void cmd_read_desc(char *args) {
     }
     descr_uuid = &char_info->descrs[desc_id];
 
+    wait_op_start(WAIT_READ);
     status = u.gattiface->client->read_descriptor(conn->conn_id,
                                                   &svc_info->svc_id,
                                                   &char_info->char_id,
                                                   descr_uuid, auth);
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to read descriptor\n");
+        wait_op_cancel(WAIT_READ);
         return;
     }
 }
@@ -1830,6 +2288,19 @@ void register_for_notification_cb(int conn_id, int registered, int status,
                                   btgatt_char_id_t *char_id) {
     char uuid_str[UUID128_STR_LEN] = {0};
 
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "register");
+        record_add_int(&r, "conn_id", conn_id);
+        record_add_int(&r, "status", status);
+        record_add_bool(&r, "registered", registered);
+        record_add_uuid(&r, "service", &srvc_id->id.uuid);
+        record_add_uuid(&r, "char", &char_id->uuid);
+        record_end(&r);
+        return;
+    }
+
     if (status != 0) {
         rl_printf("Un/register for characteristic notification status: %i %s\n",
                   status, atterror2str(status));
@@ -1851,13 +2322,29 @@ void notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
     int i;
     connection_t *conn;
 
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "notify");
+        record_add_int(&r, "conn_id", conn_id);
+        record_add_addr(&r, "addr", p_data->bda.address);
+        record_add_uuid(&r, "service", &p_data->srvc_id.id.uuid);
+        record_add_uuid(&r, "char", &p_data->char_id.uuid);
+        record_add_bool(&r, "notify", p_data->is_notify);
+        record_add_hex(&r, "value", p_data->value, p_data->len);
+        record_end(&r);
+        return;
+    }
+
     for (i = 0; i < p_data->len; i++)
         sprintf(&value_hexstr[i * 3], "%02hhx ", p_data->value[i]);
 
+    pthread_mutex_lock(&u.conns_lock);
     conn = get_connection(conn_id);
     rl_printf("Notify Characteristic from address: %s connection ID: %i\n",
               conn ? ba2str(conn->remote_addr.address, addr_str) : "Unknown",
               conn_id);
+    pthread_mutex_unlock(&u.conns_lock);
     rl_printf("  Service UUID:        %s\n", uuid2str(&p_data->srvc_id.id.uuid,
               uuid_str));
     rl_printf("  Characteristic UUID: %s\n", uuid2str(&p_data->char_id.uuid,
@@ -1976,6 +2463,17 @@ void read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
                          int status) {
     char addr_str[BT_ADDRESS_STR_LEN];
 
+    if (record_format() != FORMAT_TEXT) {
+        record_t r;
+
+        record_begin(&r, "rssi");
+        record_add_addr(&r, "addr", bda->address);
+        record_add_int(&r, "status", status);
+        record_add_int(&r, "rssi", rssi);
+        record_end(&r);
+        return;
+    }
+
     if (status != 0) {
         rl_printf("Read RSSI error, status:%i %s\n", status,
                   atterror2str(status));
@@ -2017,24 +2515,85 @@ static void cmd_rssi(char *args) {
     }
 }
 
+static size_t print_connection(connection_t *conn) {
+    char addr_str[BT_ADDRESS_STR_LEN];
+    size_t size = connection_footprint(conn);
+
+    rl_printf("Connection ID: %i  Address: %s  Memory: %zu bytes%s\n",
+              conn->conn_id, ba2str(conn->remote_addr.address, addr_str), size,
+              conn->conn_id == PENDING_CONN_ID ? " (pending)" : "");
+
+    return size;
+}
+
 static void cmd_conns(char *args) {
-    int i, c = 0;
+    connection_t *conn;
+    unsigned int i;
+    size_t total;
 
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-        connection_t *conn = &u.conns[i];
-        char addr_str[BT_ADDRESS_STR_LEN];
+    if (u.pending_conn == NULL && u.conn_count == 0) {
+        rl_printf("No connections active\n");
+        return;
+    }
 
-        if (conn->conn_id <= INVALID_CONN_ID)
-            continue;
+    total = u.conns_size * sizeof(connection_t *);
+
+    if (u.pending_conn != NULL)
+        total += print_connection(u.pending_conn);
+
+    for (i = 0; i < u.conns_size; i++)
+        for (conn = u.conns[i]; conn; conn = conn->next)
+            total += print_connection(conn);
+
+    rl_printf("Total memory: %zu bytes\n", total);
+}
 
-        rl_printf("Connection ID: %i  Address: %s%s\n", conn->conn_id,
-                  ba2str(conn->remote_addr.address, addr_str),
-                  conn->conn_id == PENDING_CONN_ID ? " (pending)" : "");
-        c++;
+/* Returns -1 if the operations didn't finish in timeout seconds */
+static int wait_ops(wait_op_t op, int timeout) {
+    struct timespec deadline;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&waits.lock);
+    while (waits.finished[op] < waits.started[op] && ret != ETIMEDOUT)
+        ret = pthread_cond_timedwait(&waits.cond, &waits.lock, &deadline);
+
+    /* Give up on what timed out, or every later wait would time out too */
+    if (ret == ETIMEDOUT) {
+        waits.abandoned[op] += waits.started[op] - waits.finished[op];
+        waits.finished[op] = waits.started[op];
     }
+    pthread_mutex_unlock(&waits.lock);
 
-    if (c == 0)
-        rl_printf("No connections active\n");
+    if (ret == ETIMEDOUT) {
+        rl_printf("Timed out waiting for %s\n", wait_op_names[op]);
+        u.failed = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cmd_wait(char *args) {
+    char arg[MAX_LINE_SIZE];
+    int op, timeout = WAIT_TIMEOUT;
+
+    line_get_str(&args, arg);
+    op = str_in_list(wait_op_names, arg);
+    if (op < 0 || (*args && (sscanf(args, " %i ", &timeout) != 1 ||
+                             timeout <= 0))) {
+        rl_printf("Usage: wait <enabled|connected|discovered|read> "
+                  "[timeout]\n");
+        rl_printf("Blocks until the enable, connections, searches "
+                  "(search-svc, characteristics, char-desc) or reads started "
+                  "so far are finished, or for timeout seconds (default %d)\n",
+                  WAIT_TIMEOUT);
+        return;
+    }
+
+    wait_ops(op, timeout);
 }
 
 /* List of available user commands */
@@ -2064,6 +2623,8 @@ static const cmd_t cmd_list[] = {
                      "notification/indicaton", cmd_unreg_notification },
     { "rssi", "        Request RSSI for connected device", cmd_rssi },
     { "connections", " Display active connections", cmd_conns },
+    { "wait", "        Wait for enable, connections, searches or reads to "
+                   "finish", cmd_wait },
     { NULL, NULL, NULL }
 };
 
@@ -2093,7 +2654,15 @@ static void cmd_process(char *line) {
 
     for (i = 0; cmd_list[i].name != NULL; i++)
         if (strcmp(cmd, cmd_list[i].name) == 0) {
+            /* wait blocks until callbacks come, it can't keep them out */
+            if (cmd_list[i].handler == cmd_wait) {
+                cmd_wait(line);
+                return;
+            }
+
+            pthread_mutex_lock(&u.conns_lock);
             cmd_list[i].handler(line);
+            pthread_mutex_unlock(&u.conns_lock);
             return;
         }
 
@@ -2106,6 +2675,7 @@ static void register_client_cb(int status, int client_if,
 
     if (status != BT_STATUS_SUCCESS) {
         rl_printf("Failed to register client, status: %d\n", status);
+        wait_op_finish(WAIT_ENABLED);
         return;
     }
 
@@ -2113,6 +2683,7 @@ static void register_client_cb(int status, int client_if,
 
     u.client_if = client_if;
     u.client_registered = true;
+    wait_op_finish(WAIT_ENABLED);
 }
 
 /* GATT client callbacks */
@@ -2169,6 +2740,9 @@ static void thread_event_cb(bt_cb_thread_evt event) {
                 u.gattiface_initialized = 1;
         } else
             rl_printf("Failed to get Bluetooth GATT Interface\n");
+
+        /* Started by main(), commands can be run from now on */
+        wait_op_finish(WAIT_ENABLED);
     } else
         u.btiface_initialized = 0;
 }
@@ -2192,7 +2766,7 @@ static bt_callbacks_t btcbs = {
 
 /* Initialize the Bluetooth stack */
 static void bt_init() {
-    int status, i;
+    int status;
     hw_module_t *module;
     hw_device_t *hwdev;
     bluetooth_device_t *btdev;
@@ -2201,9 +2775,6 @@ static void bt_init() {
     u.quit = 0;
     u.adapter_state = BT_STATE_OFF; /* The adapter is OFF in the beginning */
 
-    for (i = 0; i < MAX_CONNECTIONS; i++)
-        u.conns[i].conn_id = INVALID_CONN_ID;
-
     /* Get the Bluetooth module from libhardware */
     status = hw_get_module(BT_STACK_MODULE_ID, (hw_module_t const**) &module);
     if (status < 0) {
@@ -2253,43 +2824,145 @@ const char *tab_completer_cb(char *line, int pos) {
     return NULL;
 }
 
+static void usage(const char *name) {
+
+    fprintf(stderr, "Usage: %s [--format=jsonl|csv] [-f script]\n"
+            "  --format  print events as one record per line, for other "
+            "programs\n"
+            "  -f        run the commands of script, as when stdin is not a "
+            "terminal\n", name);
+}
+
+/* Lines entered on previous runs, for up/down keys */
+static void history_init() {
+    static char path[PATH_MAX];
+    const char *home = getenv("HOME");
+
+#ifdef __ANDROID__
+    /* adb shell does not always set it */
+    if (!home)
+        home = "/data/local/tmp";
+#endif
+
+    if (!home)
+        return;
+
+    snprintf(path, sizeof(path), "%s/" HISTORY_FILE, home);
+    rl_set_history_file(path);
+}
+
+/* Runs commands back to back, the script uses wait instead of sleeping */
+static void run_script(FILE *script) {
+    char line[MAX_SCRIPT_LINE];
+
+    /* The interface has to be ready for the first command */
+    if (wait_ops(WAIT_ENABLED, WAIT_TIMEOUT) < 0)
+        return;
+
+    while (!u.quit && fgets(line, sizeof(line), script)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        if (line[0])
+            cmd_process(line);
+    }
+}
+
 int main(int argc, char *argv[]) {
+    pthread_mutexattr_t attr;
+    FILE *script = NULL;
+    bool interactive;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--format=", 9) == 0 &&
+            record_set_format(argv[i] + 9) == 0)
+            continue;
+
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc && !script) {
+            script = fopen(argv[++i], "r");
+            if (!script)
+                err(1, "Failed to open %s", argv[i]);
+            continue;
+        }
 
+        usage(argv[0]);
+        return 1;
+    }
+
+    interactive = !script && isatty(STDIN_FILENO) &&
+                  record_format() == FORMAT_TEXT;
+    if (!script)
+        script = stdin;
+
+#ifdef __ANDROID__
     /* check if I am root */
     if (getuid() != 0) {
         printf("This software requires root access\n");
         return 1;
     }
+#endif
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&u.conns_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 
-    rl_init(cmd_process);
+    /* Records own stdout, messages for humans go to stderr */
+    if (record_format() != FORMAT_TEXT)
+        rl_init_plain(STDERR_FILENO);
+    else if (!interactive)
+        rl_init_plain(STDOUT_FILENO);
+    else {
+        rl_init(cmd_process);
+        history_init();
+    }
     change_prompt_state(NORMAL_PSTATE);
     rl_set_tab_completer(tab_completer_cb);
 
     rl_printf("Android Bluetooth control tool version " VERSION "\n");
 
+    /* Finished when the interface is ready, see thread_event_cb() */
+    wait_op_start(WAIT_ENABLED);
     bt_init();
 
-    while (!u.quit) {
-        int c = getchar();
+    if (!interactive)
+        run_script(script);
+
+    while (interactive && !u.quit) {
+        /* whatever is available at once, so pastes are handled in a batch */
+        char buf[INPUT_CHUNK_SIZE];
+        ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+        int i = 0, n;
+
+        if (len < 0 && errno == EINTR)
+            continue;
 
-        if (c == EOF) {
+        if (len <= 0) {
             rl_printf("error reading input, exiting...\n");
             u.quit = true;
             break;
         }
 
-        /* if we are in consent bonding process, we need only a char */
-        if (u.prompt_state == SSP_CONSENT_PSTATE) {
-            c = toupper(c);
-            if (c == 'Y' || c == 'N') {
-                bt_status_t status;
-                printf("%c\n", c); /* user feedback */
-                do_ssp_reply(&u.r_bd_addr, BT_SSP_VARIANT_CONSENT,
-                             c == 'Y' ? true : false, 0);
+        /* a line at a time, as each one may quit or ask for consent */
+        while (i < len && !u.quit) {
+            /* if we are in consent bonding process, we need only a char */
+            if (u.prompt_state == SSP_CONSENT_PSTATE) {
+                int c = toupper(buf[i++]);
+                if (c == 'Y' || c == 'N') {
+                    printf("%c\n", c); /* user feedback */
+                    do_ssp_reply(&u.r_bd_addr, BT_SSP_VARIANT_CONSENT,
+                                 c == 'Y' ? true : false, 0);
+                }
+                change_prompt_state(NORMAL_PSTATE);
+                continue;
+            }
+
+            n = rl_feed_chunk(buf + i, len - i);
+            if (n < 0) {
+                u.quit = true; /* user pressed ctrl-d */
+                break;
             }
-            change_prompt_state(NORMAL_PSTATE);
-        } else if (!rl_feed(c))
-            break; /* user pressed ctrl-d */
+            i += n;
+        }
     }
 
     /* Disable adapter on exit */
@@ -2302,6 +2975,11 @@ int main(int argc, char *argv[]) {
     while (u.btiface_initialized)
         usleep(10000);
 
+    free_all_connections();
+
+    if (script != stdin)
+        fclose(script);
+
     rl_quit();
-    return 0;
+    return u.failed ? 1 : 0;
 }
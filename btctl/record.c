@@ -0,0 +1,271 @@
+/*
+ *  Android Bluetooth Control tool -- output records
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record.h"
+
+static record_format_t format = FORMAT_TEXT;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+int record_set_format(const char *name) {
+
+    if (strcmp(name, "jsonl") == 0)
+        format = FORMAT_JSONL;
+    else if (strcmp(name, "csv") == 0)
+        format = FORMAT_CSV;
+    else
+        return -1;
+
+    return 0;
+}
+
+record_format_t record_format() {
+
+    return format;
+}
+
+/* Returns room for n more bytes, or NULL once the record has overflowed */
+static char *reserve(record_t *r, size_t n) {
+    char *p;
+
+    if (r->len + n > RECORD_MAX_SIZE) {
+        r->len = RECORD_MAX_SIZE + 1; /* dropped by record_end() */
+        return NULL;
+    }
+
+    p = r->buf + r->len;
+    r->len += n;
+
+    return p;
+}
+
+static void append(record_t *r, const char *str, size_t n) {
+    char *p;
+
+    /* str may be NULL for an empty field, eg a device without a name */
+    if (!n)
+        return;
+
+    p = reserve(r, n);
+    if (p)
+        memcpy(p, str, n);
+}
+
+/* Starts a new field: the separator, plus the key on JSON */
+static void add_key(record_t *r, const char *key) {
+
+    if (format == FORMAT_CSV) {
+        append(r, ",", 1);
+        return;
+    }
+
+    append(r, ",\"", 2);
+    append(r, key, strlen(key));
+    append(r, "\":", 2);
+}
+
+void record_begin(record_t *r, const char *event) {
+
+    r->len = 0;
+
+    if (format == FORMAT_JSONL)
+        append(r, "{\"event\":\"", 10);
+    append(r, event, strlen(event));
+    if (format == FORMAT_JSONL)
+        append(r, "\"", 1);
+}
+
+/* Whether a string has to be escaped (JSON) or quoted (CSV) */
+static int needs_escape(const char *str, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c == '"' || c < 0x20)
+            return 1;
+        if (format == FORMAT_CSV ? c == ',' : c == '\\')
+            return 1;
+    }
+
+    return 0;
+}
+
+void record_add_str(record_t *r, const char *key, const char *str, int len) {
+    int i;
+    char *p;
+
+    add_key(r, key);
+
+    if (format == FORMAT_CSV) {
+        if (!needs_escape(str, len)) {
+            append(r, str, len);
+            return;
+        }
+
+        append(r, "\"", 1);
+        for (i = 0; i < len; i++) {
+            if (str[i] == '"')
+                append(r, "\"", 1);
+            append(r, &str[i], 1);
+        }
+        append(r, "\"", 1);
+        return;
+    }
+
+    append(r, "\"", 1);
+    if (!needs_escape(str, len)) {
+        append(r, str, len);
+        append(r, "\"", 1);
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c == '"' || c == '\\') {
+            p = reserve(r, 2);
+            if (!p)
+                return;
+            p[0] = '\\';
+            p[1] = c;
+        } else if (c < 0x20) {
+            p = reserve(r, 6);
+            if (!p)
+                return;
+            memcpy(p, "\\u00", 4);
+            p[4] = hex_digits[c >> 4];
+            p[5] = hex_digits[c & 0xf];
+        } else
+            append(r, (const char *) &c, 1);
+    }
+    append(r, "\"", 1);
+}
+
+void record_add_int(record_t *r, const char *key, int value) {
+    char digits[12];
+    unsigned int v;
+    int n = sizeof(digits);
+
+    add_key(r, key);
+
+    v = value < 0 ? -(unsigned int) value : (unsigned int) value;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (value < 0)
+        digits[--n] = '-';
+
+    append(r, digits + n, sizeof(digits) - n);
+}
+
+void record_add_bool(record_t *r, const char *key, int value) {
+
+    add_key(r, key);
+
+    if (format == FORMAT_CSV)
+        append(r, value ? "1" : "0", 1);
+    else if (value)
+        append(r, "true", 4);
+    else
+        append(r, "false", 5);
+}
+
+void record_add_hex(record_t *r, const char *key, const uint8_t *data,
+                    int len) {
+    char *p;
+    int i;
+
+    add_key(r, key);
+
+    p = reserve(r, len * 2 + (format == FORMAT_JSONL ? 2 : 0));
+    if (!p)
+        return;
+
+    if (format == FORMAT_JSONL)
+        *p++ = '"';
+    for (i = 0; i < len; i++) {
+        *p++ = hex_digits[data[i] >> 4];
+        *p++ = hex_digits[data[i] & 0xf];
+    }
+    if (format == FORMAT_JSONL)
+        *p = '"';
+}
+
+void record_add_addr(record_t *r, const char *key, const uint8_t *addr) {
+    static const char upper[] = "0123456789ABCDEF";
+    char str[17], *p = str;
+    int i;
+
+    /* same format as ba2str(): 00:11:22:33:44:55 */
+    for (i = 0; i < 6; i++) {
+        if (i)
+            *p++ = ':';
+        *p++ = upper[addr[i] >> 4];
+        *p++ = upper[addr[i] & 0xf];
+    }
+
+    record_add_str(r, key, str, p - str);
+}
+
+void record_add_uuid(record_t *r, const char *key, const bt_uuid_t *uuid) {
+    char str[36], *p = str;
+    int i;
+
+    /* same format as uuid2str(): 11223344-5566-7788-9900-112233445566 */
+    for (i = 15; i >= 0; i--) {
+        if (i == 11 || i == 9 || i == 7 || i == 5)
+            *p++ = '-';
+        *p++ = hex_digits[uuid->uu[i] >> 4];
+        *p++ = hex_digits[uuid->uu[i] & 0xf];
+    }
+
+    record_add_str(r, key, str, p - str);
+}
+
+void record_end(record_t *r) {
+    size_t done = 0;
+
+    if (format == FORMAT_JSONL)
+        append(r, "}\n", 2);
+    else
+        append(r, "\n", 1);
+
+    if (r->len > RECORD_MAX_SIZE)
+        return;
+
+    while (done < r->len) {
+        ssize_t ret = write(STDOUT_FILENO, r->buf + done, r->len - done);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        done += ret;
+    }
+}
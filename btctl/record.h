@@ -0,0 +1,60 @@
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+/*
+ *  Android Bluetooth Control tool -- output records
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <hardware/bluetooth.h>
+
+/* Big enough for the hex of a whole attribute value plus the other fields */
+#define RECORD_MAX_SIZE 2048
+
+typedef enum {
+    FORMAT_TEXT = 0, /* human-oriented output, through rl_printf() */
+    FORMAT_JSONL, /* one JSON object per line */
+    FORMAT_CSV, /* event name, then the values in a fixed order per event */
+} record_format_t;
+
+/* One event, built in place and written with a single write() */
+typedef struct {
+    char buf[RECORD_MAX_SIZE];
+    size_t len;
+} record_t;
+
+/* Accepts "jsonl" or "csv". Returns -1 on unknown formats */
+int record_set_format(const char *name);
+record_format_t record_format();
+
+void record_begin(record_t *r, const char *event);
+/* Strings are escaped (JSON) or quoted (CSV) only when needed */
+void record_add_str(record_t *r, const char *key, const char *str, int len);
+void record_add_int(record_t *r, const char *key, int value);
+void record_add_bool(record_t *r, const char *key, int value);
+void record_add_hex(record_t *r, const char *key, const uint8_t *data,
+                    int len);
+void record_add_addr(record_t *r, const char *key, const uint8_t *addr);
+void record_add_uuid(record_t *r, const char *key, const bt_uuid_t *uuid);
+/* Writes the record to stdout. Records that did not fit are dropped */
+void record_end(record_t *r);
+
+#endif /* __RECORD_H__ */
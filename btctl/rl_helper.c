@@ -20,16 +20,24 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <unistd.h>
 #include "rl_helper.h"
 
 #define MAX_LINE_BUFFER 512
 #define MAX_SEQ 5
+#define TERMINAL_COLS 80
+#define MIN_EVENT_BUFFER 1024
+#define HISTORY_SIZE 256 /* older lines are dropped */
 
 #define MIN(a, b) \
     ({ \
@@ -62,9 +70,33 @@ size_t pos = 0;
 char seq[MAX_SEQ]; /* sequence buffer (escape codes) */
 size_t seq_pos = 0;
 const char *prompt = "> ";
-char **history = NULL; /* pointer to history buffer */
-int hs_len = 0; /* how much pointers we have in history buffer */
+char *history[HISTORY_SIZE]; /* ring of entered lines, oldest at hs_first */
+int hs_first = 0; /* ring index of the oldest line */
+int hs_len = 0; /* how much lines we have in history buffer */
 int hs_cur = 0; /* current position of up/down keys navigation */
+static const char *hs_file = NULL; /* where history is saved by rl_quit() */
+static bool hs_enabled = true; /* lines entered are kept in history */
+static size_t viewport_pos = 0; /* first char of lnbuf shown on screen */
+static bool plain = false; /* no terminal handling, echo or prompt */
+static int out_fd = STDOUT_FILENO;
+
+/* The part of lnbuf on screen after the prompt, and the cursor within it, so
+ * edits only redraw what changed */
+static char shown[TERMINAL_COLS];
+static size_t shown_len = 0;
+static size_t shown_cursor = 0;
+static bool shown_valid = false;
+static bool redraw_pending = false; /* line edited since last drawn */
+static bool line_entered = false; /* a line was sent to line_cb */
+
+/* Output of the event being printed, written at once by rl_event_end(). The
+ * lock is recursive and held from rl_event_begin() to rl_event_end(), so
+ * events from different threads are not interleaved. */
+static pthread_mutex_t event_lock;
+static int event_depth = 0;
+static char *event_buf = NULL;
+static size_t event_len = 0;
+static size_t event_size = 0;
 
 typedef struct {
     char sequence[MAX_SEQ];
@@ -122,26 +154,172 @@ void rl_clear_line() {
     printf("\x1b[2K\r");
 }
 
-void rl_reprint_prompt() {
-    static size_t viewport_pos = 0;
-    size_t terminal_cols = 80;
-    size_t len = strlen(lnbuf);
-    size_t viewport_size = terminal_cols - strlen(prompt) - 1;
-    size_t viewport_end;
+/* makes room for at least len more bytes in the event buffer */
+static int event_reserve(size_t len) {
+    size_t size = event_size ? event_size : MIN_EVENT_BUFFER;
+    char *buf;
+
+    if (event_len + len < event_size)
+        return 0;
+
+    while (size <= event_len + len)
+        size *= 2;
+
+    buf = realloc(event_buf, size);
+    if (!buf)
+        return -1;
+
+    event_buf = buf;
+    event_size = size;
+
+    return 0;
+}
 
-    rl_clear_line();
+static void event_append(const char *str, size_t len) {
+
+    if (event_reserve(len) < 0)
+        return;
+
+    memcpy(event_buf + event_len, str, len);
+    event_len += len;
+}
+
+/* scrolls the viewport to the cursor, returns the length of the visible part
+ * of the line */
+static size_t viewport_update() {
+    size_t len = strlen(lnbuf);
+    size_t viewport_size = TERMINAL_COLS - strlen(prompt) - 1;
 
     if (pos < viewport_pos) /* cursor before viewport */
         viewport_pos = pos;
     if (pos > viewport_pos + viewport_size) /* cursor after viewport */
         viewport_pos = pos - viewport_size;
 
-    printf("%s%.*s", prompt, MIN(viewport_size, len), lnbuf + viewport_pos);
+    return MIN(viewport_pos + viewport_size, len) - viewport_pos;
+}
+
+/* appends cursor moves within the visible line, from column from to to */
+static void event_append_move(const char *line, size_t from, size_t to) {
+
+    if (to >= from) {
+        event_append(line + from, to - from); /* rewrite what is there */
+        return;
+    }
+
+    if (event_reserve(from - to) < 0)
+        return;
+    while (from-- != to)
+        event_buf[event_len++] = '\b'; /* backspace */
+}
+
+static void shown_update(size_t len) {
+
+    memcpy(shown, lnbuf + viewport_pos, len);
+    shown_len = len;
+    shown_cursor = pos - viewport_pos;
+    shown_valid = true;
+}
+
+/* appends the prompt and the visible part of the line being edited */
+static void event_append_prompt() {
+    size_t len = viewport_update();
+
+    event_append(prompt, strlen(prompt));
+    event_append(lnbuf + viewport_pos, len);
+    event_append_move(lnbuf + viewport_pos, len, pos - viewport_pos);
 
-    viewport_end = MIN(viewport_pos + viewport_size, len);
-    while (viewport_end-- != pos)
-        putchar('\b'); /* backspace */
+    shown_update(len);
+}
+
+static void event_write() {
+    size_t done = 0;
+
+    /* a single write for the whole event, after anything still buffered */
     fflush(stdout);
+    while (done < event_len) {
+        ssize_t ret = write(out_fd, event_buf + done, event_len - done);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        done += ret;
+    }
+}
+
+void rl_event_begin() {
+
+    pthread_mutex_lock(&event_lock);
+
+    if (event_depth++ == 0) {
+        event_len = 0;
+        /* so rl_printf() always has a buffer to print to */
+        event_reserve(1);
+        if (!plain)
+            event_append("\x1b[2K\r", 5); /* clear current line */
+    }
+}
+
+void rl_event_end() {
+
+    if (--event_depth > 0) {
+        pthread_mutex_unlock(&event_lock);
+        return;
+    }
+
+    if (!plain)
+        event_append_prompt();
+
+    event_write();
+
+    pthread_mutex_unlock(&event_lock);
+}
+
+void rl_reprint_prompt() {
+
+    rl_event_begin();
+    rl_event_end();
+}
+
+/* brings the edited line on screen up to date, rewriting it only from the
+ * first changed char */
+static void rl_redraw() {
+    const char *line;
+    size_t len, cursor, diff = 0;
+
+    redraw_pending = false;
+
+    pthread_mutex_lock(&event_lock);
+
+    if (!shown_valid) {
+        pthread_mutex_unlock(&event_lock);
+        rl_reprint_prompt();
+        return;
+    }
+
+    len = viewport_update();
+    line = lnbuf + viewport_pos;
+    cursor = pos - viewport_pos;
+
+    while (diff < len && diff < shown_len && line[diff] == shown[diff])
+        diff++;
+
+    event_len = 0;
+    if (diff == len && len == shown_len)
+        event_append_move(line, shown_cursor, cursor); /* only moved */
+    else {
+        event_append_move(line, shown_cursor, MIN(shown_cursor, diff));
+        event_append_move(line, MIN(shown_cursor, diff), len);
+        if (len < shown_len)
+            event_append("\x1b[K", 3); /* clear to end of line */
+        event_append_move(line, len, cursor);
+    }
+
+    shown_update(len);
+    event_write();
+
+    pthread_mutex_unlock(&event_lock);
 }
 
 void restore_tc_setts() {
@@ -149,9 +327,20 @@ void restore_tc_setts() {
     tcsetattr(0, TCSANOW, &saved_term_setts); /* restore settings */
 }
 
+static void rl_init_event_lock() {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&event_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
 void rl_init(line_process_callback cb) {
     struct termios settings;
 
+    rl_init_event_lock();
+
     /* disable echo */
     tcgetattr(0, &saved_term_setts); /* read settings from stdin (0) */
     atexit(restore_tc_setts);
@@ -163,6 +352,14 @@ void rl_init(line_process_callback cb) {
     line_cb = cb;
 }
 
+void rl_init_plain(int fd) {
+
+    rl_init_event_lock();
+
+    plain = true;
+    out_fd = fd;
+}
+
 void rl_set_prompt(const char *str) {
 
     prompt = str;
@@ -174,10 +371,109 @@ void rl_set_tab_completer(tab_completer_callback cb) {
     tab_completer_cb = cb;
 }
 
+/* the n-th line of history, from the oldest */
+static char *history_get(int n) {
+
+    return history[(hs_first + n) % HISTORY_SIZE];
+}
+
+/* adds a line to history, unless it repeats the last one */
+static void history_add(const char *line) {
+    int last = (hs_first + hs_len) % HISTORY_SIZE;
+
+    if (hs_len > 0 && strcmp(history_get(hs_len - 1), line) == 0)
+        return;
+
+    if (hs_len == HISTORY_SIZE) {
+        /* full, the new line takes the place of the oldest */
+        free(history[hs_first]);
+        hs_first = (hs_first + 1) % HISTORY_SIZE;
+        hs_len--;
+    }
+
+    history[last] = strdup(line);
+    if (history[last])
+        hs_len++;
+}
+
+static void history_save() {
+    FILE *f;
+    int fd, i;
+
+    /* only readable by the user, as fopen() would leave it to the umask */
+    fd = open(hs_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+
+    fchmod(fd, 0600); /* in case it was created with other permissions */
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        return;
+    }
+
+    for (i = 0; i < hs_len; i++)
+        fprintf(f, "%s\n", history_get(i));
+
+    fclose(f);
+}
+
+void rl_set_history_file(const char *path) {
+    char line[MAX_LINE_BUFFER];
+    FILE *f;
+
+    hs_file = path;
+
+    f = fopen(path, "r");
+    if (!f)
+        return;
+
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+
+        if (line[len] == '\0' && !feof(f)) {
+            int c;
+
+            /* too long to be edited, skip the rest of it */
+            while ((c = fgetc(f)) != EOF && c != '\n');
+            continue;
+        }
+
+        line[len] = '\0';
+        if (len > 0)
+            history_add(line);
+    }
+
+    fclose(f);
+    hs_cur = hs_len;
+}
+
+void rl_set_history(bool enabled) {
+
+    hs_enabled = enabled;
+}
+
 void rl_quit() {
 
     rl_clear();
-    rl_clear_line();
+    if (!plain)
+        rl_clear_line();
+    fflush(stdout);
+
+    if (hs_file)
+        history_save();
+    while (hs_len > 0) {
+        free(history[hs_first]);
+        hs_first = (hs_first + 1) % HISTORY_SIZE;
+        hs_len--;
+    }
+
+    /* a late callback may still be printing */
+    pthread_mutex_lock(&event_lock);
+    free(event_buf);
+    event_buf = NULL;
+    event_len = event_size = 0;
+    pthread_mutex_unlock(&event_lock);
 }
 
 /* returns 1 if char was consumed, 0 otherwise */
@@ -211,7 +507,8 @@ int rl_parse_seq(int *c) {
     }
 }
 
-bool rl_feed(int c) {
+/* edits the line, leaving the redraw to the caller */
+static bool rl_feed_char(int c) {
 
     if (rl_parse_seq(&c))
         return true;
@@ -230,24 +527,30 @@ bool rl_feed(int c) {
                             sizeof(lnbuf) - pos - len);
                     strncpy(lnbuf + pos, str, len);
                     pos += len;
-                    rl_reprint_prompt();
+                    redraw_pending = true;
                 }
             }
             break;
         case '\r':
         case '\n':
+            /* the line is left on screen as typed */
+            if (redraw_pending)
+                rl_redraw();
+            putchar('\n');
+            shown_valid = false;
+
             if (strlen(lnbuf) > 0) {
-                char *dup = strdup(lnbuf);
-                /* alloc space in history buffer to new string pointer */
-                hs_len++;
-                history = realloc(history, hs_len * sizeof(history[0]));
-                history[hs_len - 1] = strdup(lnbuf);
-                putchar('\n');
-                line_cb(dup); /* send a copy, so we can change it */
-                free(dup);
-            } else
-                /* don't parse empty lines */
-                putchar('\n');
+                char line[MAX_LINE_BUFFER];
+
+                strcpy(line, lnbuf);
+                if (hs_enabled)
+                    history_add(line);
+                /* cleared first, so output of the command does not redraw
+                 * it */
+                rl_clear();
+                line_cb(line); /* send a copy, so we can change it */
+                line_entered = true;
+            } /* don't parse empty lines */
 
             hs_cur = hs_len;
             rl_clear();
@@ -259,81 +562,126 @@ bool rl_feed(int c) {
             if (pos > 0) {
                 memmove(lnbuf + pos - 1, lnbuf + pos, sizeof(lnbuf) - pos);
                 pos--;
-                rl_reprint_prompt();
+                redraw_pending = true;
             }
             break;
         case K_UP:
             if (hs_cur > 0) {
                 /* we have more history commands up */
                 hs_cur--;
-                strcpy(lnbuf, history[hs_cur]);
-                pos = strlen(history[hs_cur]);
-                rl_reprint_prompt();
+                strcpy(lnbuf, history_get(hs_cur));
+                pos = strlen(lnbuf);
+                redraw_pending = true;
             }
             break;
         case K_DOWN:
             if (hs_cur < hs_len - 1) {
                 /* we have more history commands down */
                 hs_cur++;
-                strcpy(lnbuf, history[hs_cur]);
-                pos = strlen(history[hs_cur]);
-                rl_reprint_prompt();
+                strcpy(lnbuf, history_get(hs_cur));
+                pos = strlen(lnbuf);
+                redraw_pending = true;
             } else if (hs_cur == hs_len - 1) {
                 /* we don't have more commands down, let's clear the prompt */
                 hs_cur++;
                 rl_clear();
-                rl_reprint_prompt();
+                redraw_pending = true;
             }
             break;
         case K_RIGHT:
             if (pos < strlen(lnbuf)) {
                 pos++;
-                rl_reprint_prompt();
+                redraw_pending = true;
             }
             break;
         case K_LEFT:
             if (pos > 0) {
                 pos--;
-                rl_reprint_prompt();
+                redraw_pending = true;
             }
             break;
         case K_END:
             pos = strlen(lnbuf);
-            rl_reprint_prompt();
+            redraw_pending = true;
             break;
         case K_HOME:
             pos = 0;
-            rl_reprint_prompt();
+            redraw_pending = true;
             break;
         case K_DELETE:
             memmove(lnbuf + pos, lnbuf + pos + 1, sizeof(lnbuf) - pos - 1);
-            rl_reprint_prompt();
+            redraw_pending = true;
             break;
         default:
             if (isprint(c)) {
-                if (pos < (sizeof(lnbuf) - 1)) {
+                if (strlen(lnbuf) < (sizeof(lnbuf) - 1)) {
                     /* shift everything to right and insert char at pos */
                     memmove(lnbuf + pos + 1, lnbuf + pos,
                             sizeof(lnbuf) - pos - 1);
                     lnbuf[pos++] = c;
-                    rl_reprint_prompt();
+                    redraw_pending = true;
                 }
-            } else
+            } else {
                 printf(" %x ", c);
+                shown_valid = false;
+            }
             break;
     }
 
     return true;
 }
 
+bool rl_feed(int c) {
+    bool ret = rl_feed_char(c);
+
+    if (redraw_pending)
+        rl_redraw();
+
+    return ret;
+}
+
+int rl_feed_chunk(const char *buf, int len) {
+    int i;
+    bool ret = true;
+
+    /* the line may change what the next chars mean, eg quit */
+    line_entered = false;
+    for (i = 0; i < len && ret && !line_entered; i++)
+        ret = rl_feed_char((unsigned char) buf[i]);
+
+    /* one redraw for everything typed or pasted at once */
+    if (redraw_pending)
+        rl_redraw();
+
+    return ret ? i : -1;
+}
+
 void rl_printf(const char *fmt, ...) {
     va_list ap;
+    int len;
 
-    va_start(ap, fmt);
+    rl_event_begin();
 
-    rl_clear_line();
-    vprintf(fmt, ap);
+    /* out of memory, the line is lost */
+    if (!event_buf) {
+        rl_event_end();
+        return;
+    }
+
+    /* first try with the space left, most lines fit */
+    va_start(ap, fmt);
+    len = vsnprintf(event_buf + event_len, event_size - event_len, fmt, ap);
     va_end(ap);
 
-    rl_reprint_prompt();
+    if (len > 0 && (size_t) len >= event_size - event_len &&
+        event_reserve(len) == 0) {
+        va_start(ap, fmt);
+        vsnprintf(event_buf + event_len, event_size - event_len, fmt, ap);
+        va_end(ap);
+    }
+
+    if (len > 0 && event_len + len < event_size)
+        event_len += len;
+
+    rl_event_end();
 }
@@ -7,15 +7,33 @@ typedef const char *(*tab_completer_callback)(char *line, int tab_pos);
 
 /* initializes buffers and set line process callback */
 void rl_init(line_process_callback cb);
+/* for non interactive use, instead of rl_init(): the terminal is left alone,
+ * no prompt is drawn and output is written as is to fd. Input lines are not
+ * read through rl_feed() */
+void rl_init_plain(int fd);
 /* configure prompt string, (eg "> ") */
 void rl_set_prompt(const char *str);
 /* tab completer */
 void rl_set_tab_completer(tab_completer_callback cb);
+/* loads the lines entered on previous runs from path, the history is saved
+ * back there by rl_quit() */
+void rl_set_history_file(const char *path);
+/* whether the lines entered are kept in history, eg not while a PIN code is
+ * being entered */
+void rl_set_history(bool enabled);
 /* close resources */
 void rl_quit();
 /* add char to line buffer, returns false on ctrl-d */
 bool rl_feed(int c);
+/* same as rl_feed() for each char of buf, redrawing the line only once at the
+ * end. Stops after a line is entered, returning the number of chars used, or
+ * at ctrl-c/ctrl-d, returning -1 */
+int rl_feed_chunk(const char *buf, int len);
 /* printf version */
 void rl_printf(const char *fmt, ...);
+/* buffer rl_printf() output until rl_event_end(), which writes it with a
+ * single line clear and prompt redraw (calls can be nested) */
+void rl_event_begin();
+void rl_event_end();
 
 #endif // __RL_HELPER_H__
@@ -0,0 +1,12 @@
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_COPY_HEADERS := fakehal.h
+LOCAL_COPY_HEADERS_TO := fakehal
+LOCAL_SRC_FILES := fakehal.c
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := libfakehal
+
+include $(BUILD_HOST_SHARED_LIBRARY)
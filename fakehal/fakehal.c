@@ -0,0 +1,1765 @@
+/*
+ *  Fake Bluetooth HAL -- libhardware stand-in for host builds
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hardware/bluetooth.h>
+#include <hardware/bt_gatt.h>
+#include <hardware/bt_gatt_client.h>
+#include <hardware/hardware.h>
+
+#include "fakehal.h"
+
+/* Bluedroid delivers up to 62 bytes of advertising + scan response data */
+#define MAX_ADV_LEN 62
+
+/* Status reported by Bluedroid when an attribute list is exhausted */
+#define GATT_ERROR 0x85
+/* Status of an operation issued while another one is pending */
+#define GATT_BUSY 0x84
+
+typedef struct fake_value {
+    uint8_t value[BTGATT_MAX_ATTR_LEN];
+    uint16_t len;
+} fake_value_t;
+
+typedef struct fake_desc {
+    bt_uuid_t uuid;
+    fake_value_t v;
+} fake_desc_t;
+
+typedef struct fake_char {
+    btgatt_char_id_t id;
+    int props;
+    fake_value_t v;
+    fake_desc_t *descs;
+    int desc_count;
+} fake_char_t;
+
+typedef struct fake_srvc {
+    btgatt_srvc_id_t id;
+    fake_char_t *chars;
+    int char_count;
+    int last_char; /* Last characteristic found, checked first */
+} fake_srvc_t;
+
+/* A remote device and its GATT database */
+typedef struct fake_device fake_device_t;
+struct fake_device {
+    bt_bdaddr_t bda;
+    int rssi;
+    uint8_t adv[MAX_ADV_LEN];
+    int conn_id;
+
+    fake_srvc_t *srvcs;
+    int srvc_count;
+
+    /* Pending prepared write, committed by execute_write(). Each part is
+     * stored at its offset, as the remote device would */
+    fake_value_t prep;
+    fake_char_t *prep_char;
+
+    uint8_t op_pending; /* A read or write hasn't been answered yet */
+
+    fake_device_t *next;
+    fake_device_t *bda_next; /* Same address hash bucket */
+    fake_device_t *conn_next; /* Same conn_id hash bucket */
+};
+
+/* Lookup buckets, so large device populations don't slow down callbacks */
+#define DEVICE_BUCKETS 16384
+
+typedef enum {
+    EV_THREAD_START,
+    EV_THREAD_EXIT,
+    EV_ADAPTER_STATE,
+    EV_DISCOVERY_STATE,
+    EV_BOND_STATE,
+    EV_REGISTER_CLIENT,
+    EV_ADV_ROUND,
+    EV_SCAN_RESULT,
+    EV_CONNECT,
+    EV_DISCONNECT,
+    EV_SEARCH_RESULT,
+    EV_SEARCH_COMPLETE,
+    EV_GET_INCLUDED,
+    EV_GET_CHAR,
+    EV_GET_DESC,
+    EV_REGISTER_NOTIF,
+    EV_NOTIFY,
+    EV_READ_CHAR,
+    EV_WRITE_CHAR,
+    EV_READ_DESC,
+    EV_WRITE_DESC,
+    EV_EXECUTE_WRITE,
+    EV_READ_RSSI
+} fake_event_type_t;
+
+/* A callback waiting to be delivered. All the data pointed by the callback
+ * parameters lives inside the event, so it doesn't depend on the caller. */
+typedef struct fake_event fake_event_t;
+struct fake_event {
+    fake_event_type_t type;
+    struct timespec due;
+
+    int id; /* conn_id or client_if */
+    int status;
+    int arg; /* state, rssi, properties or registered flag */
+    bt_bdaddr_t bda;
+    btgatt_srvc_id_t srvc_id;
+    btgatt_srvc_id_t incl_srvc_id;
+    btgatt_char_id_t char_id;
+    bt_uuid_t uuid;
+    uint8_t adv[MAX_ADV_LEN];
+    union {
+        btgatt_read_params_t read;
+        btgatt_write_params_t write;
+        btgatt_notify_params_t notify;
+    } p;
+    uint8_t ends_op; /* Answers the pending operation of the connection */
+
+    fake_event_t *next;
+};
+
+static struct fakedata {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signaled when an event is queued */
+    pthread_cond_t idle; /* signaled when an event has been delivered */
+
+    bt_callbacks_t *btcbs;
+    const btgatt_callbacks_t *gattcbs;
+    uint8_t thread_running;
+    uint8_t script_loaded;
+
+    fake_event_t *head;
+    fake_event_t *tail;
+    int pending; /* queued or being delivered, periodic rounds excluded */
+
+    unsigned int latency;
+    unsigned int adv_interval;
+    uint8_t inline_dispatch;
+
+    uint8_t scanning;
+    int client_if;
+    int next_conn_id;
+    fake_device_t *devices;
+    fake_device_t *devices_by_bda[DEVICE_BUCKETS];
+    fake_device_t *devices_by_conn_id[DEVICE_BUCKETS];
+} fake = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .next_conn_id = 1,
+};
+
+/* Events triggered while delivering inline callbacks */
+static __thread fake_event_t *inline_head, *inline_tail;
+static __thread uint8_t inline_draining;
+
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+
+static void fake_init_once(void) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fake.cond, &attr);
+    pthread_cond_init(&fake.idle, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec;
+    return a->tv_nsec < b->tv_nsec;
+}
+
+static void ts_add_usec(struct timespec *ts, unsigned long usec) {
+    ts->tv_sec += usec / 1000000;
+    ts->tv_nsec += (usec % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static fake_event_t *new_event(fake_event_type_t type, int id) {
+    fake_event_t *ev = calloc(1, sizeof(fake_event_t));
+
+    if (ev) {
+        ev->type = type;
+        ev->id = id;
+    }
+
+    return ev;
+}
+
+/* Called with the lock held */
+static void queue_event(fake_event_t *ev, unsigned long delay) {
+    fake_event_t *prev;
+
+    pthread_once(&fake_once, fake_init_once);
+
+    clock_gettime(CLOCK_MONOTONIC, &ev->due);
+    ts_add_usec(&ev->due, delay);
+
+    if (ev->type != EV_ADV_ROUND)
+        fake.pending++;
+
+    /* Keep the queue ordered by due time, FIFO for equal times */
+    if (!fake.tail || !ts_before(&ev->due, &fake.tail->due)) {
+        ev->next = NULL;
+        if (fake.tail)
+            fake.tail->next = ev;
+        else
+            fake.head = ev;
+        fake.tail = ev;
+    } else if (ts_before(&ev->due, &fake.head->due)) {
+        ev->next = fake.head;
+        fake.head = ev;
+    } else {
+        for (prev = fake.head; !ts_before(&ev->due, &prev->next->due);
+             prev = prev->next);
+        ev->next = prev->next;
+        prev->next = ev;
+    }
+
+    pthread_cond_signal(&fake.cond);
+}
+
+static void dispatch(fake_event_t *ev);
+
+/* Hand an event over to the btif thread, or deliver it right away */
+static void post(fake_event_t *ev) {
+    if (!ev)
+        return;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!fake.inline_dispatch || ev->type == EV_THREAD_START ||
+        ev->type == EV_THREAD_EXIT) {
+        queue_event(ev, fake.latency);
+        pthread_mutex_unlock(&fake.lock);
+        return;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    /* Callbacks frequently trigger new operations (e.g. the next
+     * characteristic), so events are drained iteratively, not recursively */
+    ev->next = NULL;
+    if (inline_tail)
+        inline_tail->next = ev;
+    else
+        inline_head = ev;
+    inline_tail = ev;
+
+    if (inline_draining)
+        return;
+
+    inline_draining = 1;
+    while ((ev = inline_head)) {
+        inline_head = ev->next;
+        if (!inline_head)
+            inline_tail = NULL;
+
+        dispatch(ev);
+        free(ev);
+    }
+    inline_draining = 0;
+}
+
+static void advertise_all(void) {
+    fake_event_t *reports = NULL, *ev;
+    fake_device_t *dev;
+
+    pthread_mutex_lock(&fake.lock);
+    for (dev = fake.devices; dev; dev = dev->next) {
+        ev = new_event(EV_SCAN_RESULT, 0);
+        if (!ev)
+            break;
+        ev->bda = dev->bda;
+        ev->arg = dev->rssi;
+        memcpy(ev->adv, dev->adv, sizeof(ev->adv));
+        ev->next = reports;
+        reports = ev;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    while ((ev = reports)) {
+        reports = ev->next;
+        dispatch(ev);
+        free(ev);
+    }
+}
+
+static void end_op(int conn_id);
+
+static void dispatch(fake_event_t *ev) {
+    bt_callbacks_t *btcbs = fake.btcbs;
+    const btgatt_client_callbacks_t *c = NULL;
+
+    if (fake.gattcbs)
+        c = fake.gattcbs->client;
+
+    /* The next operation may be issued from the callback */
+    if (ev->ends_op)
+        end_op(ev->id);
+
+    switch (ev->type) {
+        case EV_THREAD_START:
+            if (btcbs && btcbs->thread_evt_cb)
+                btcbs->thread_evt_cb(ASSOCIATE_JVM);
+            break;
+        case EV_THREAD_EXIT:
+            if (btcbs && btcbs->thread_evt_cb)
+                btcbs->thread_evt_cb(DISASSOCIATE_JVM);
+            break;
+        case EV_ADAPTER_STATE:
+            if (btcbs && btcbs->adapter_state_changed_cb)
+                btcbs->adapter_state_changed_cb(ev->arg);
+            break;
+        case EV_DISCOVERY_STATE:
+            if (btcbs && btcbs->discovery_state_changed_cb)
+                btcbs->discovery_state_changed_cb(ev->arg);
+            break;
+        case EV_BOND_STATE:
+            if (btcbs && btcbs->bond_state_changed_cb)
+                btcbs->bond_state_changed_cb(ev->status, &ev->bda, ev->arg);
+            break;
+        case EV_REGISTER_CLIENT:
+            if (c && c->register_client_cb)
+                c->register_client_cb(ev->status, ev->id, &ev->uuid);
+            break;
+        case EV_ADV_ROUND:
+            if (!fake.scanning)
+                break;
+
+            advertise_all();
+
+            pthread_mutex_lock(&fake.lock);
+            if (fake.scanning && fake.adv_interval) {
+                fake_event_t *next = new_event(EV_ADV_ROUND, 0);
+                if (next)
+                    queue_event(next, fake.adv_interval * 1000UL);
+            }
+            pthread_mutex_unlock(&fake.lock);
+            break;
+        case EV_SCAN_RESULT:
+            if (fake.scanning && c && c->scan_result_cb)
+                c->scan_result_cb(&ev->bda, ev->arg, ev->adv);
+            break;
+        case EV_CONNECT:
+            if (c && c->open_cb)
+                c->open_cb(ev->id, ev->status, ev->arg, &ev->bda);
+            break;
+        case EV_DISCONNECT:
+            if (c && c->close_cb)
+                c->close_cb(ev->id, ev->status, ev->arg, &ev->bda);
+            break;
+        case EV_SEARCH_RESULT:
+            if (c && c->search_result_cb)
+                c->search_result_cb(ev->id, &ev->srvc_id);
+            break;
+        case EV_SEARCH_COMPLETE:
+            if (c && c->search_complete_cb)
+                c->search_complete_cb(ev->id, ev->status);
+            break;
+        case EV_GET_INCLUDED:
+            if (c && c->get_included_service_cb)
+                c->get_included_service_cb(ev->id, ev->status, &ev->srvc_id,
+                                           &ev->incl_srvc_id);
+            break;
+        case EV_GET_CHAR:
+            if (c && c->get_characteristic_cb)
+                c->get_characteristic_cb(ev->id, ev->status, &ev->srvc_id,
+                                         &ev->char_id, ev->arg);
+            break;
+        case EV_GET_DESC:
+            if (c && c->get_descriptor_cb)
+                c->get_descriptor_cb(ev->id, ev->status, &ev->srvc_id,
+                                     &ev->char_id, &ev->uuid);
+            break;
+        case EV_REGISTER_NOTIF:
+            if (c && c->register_for_notification_cb)
+                c->register_for_notification_cb(ev->id, ev->arg, ev->status,
+                                                &ev->srvc_id, &ev->char_id);
+            break;
+        case EV_NOTIFY:
+            if (c && c->notify_cb)
+                c->notify_cb(ev->id, &ev->p.notify);
+            break;
+        case EV_READ_CHAR:
+            if (c && c->read_characteristic_cb)
+                c->read_characteristic_cb(ev->id, ev->status, &ev->p.read);
+            break;
+        case EV_WRITE_CHAR:
+            if (c && c->write_characteristic_cb)
+                c->write_characteristic_cb(ev->id, ev->status, &ev->p.write);
+            break;
+        case EV_READ_DESC:
+            if (c && c->read_descriptor_cb)
+                c->read_descriptor_cb(ev->id, ev->status, &ev->p.read);
+            break;
+        case EV_WRITE_DESC:
+            if (c && c->write_descriptor_cb)
+                c->write_descriptor_cb(ev->id, ev->status, &ev->p.write);
+            break;
+        case EV_EXECUTE_WRITE:
+            if (c && c->execute_write_cb)
+                c->execute_write_cb(ev->id, ev->status);
+            break;
+        case EV_READ_RSSI:
+            if (c && c->read_remote_rssi_cb)
+                c->read_remote_rssi_cb(ev->id, &ev->bda, ev->arg, ev->status);
+            break;
+    }
+}
+
+/* Stand-in for Bluedroid's btif thread: delivers queued callbacks in order */
+static void *btif_thread(void *arg) {
+    fake_event_t *ev;
+    int done = 0;
+
+    while (!done) {
+        struct timespec now;
+
+        pthread_mutex_lock(&fake.lock);
+        for (;;) {
+            ev = fake.head;
+            if (!ev) {
+                pthread_cond_wait(&fake.cond, &fake.lock);
+                continue;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!ts_before(&now, &ev->due))
+                break;
+
+            pthread_cond_timedwait(&fake.cond, &fake.lock, &ev->due);
+        }
+
+        fake.head = ev->next;
+        if (!fake.head)
+            fake.tail = NULL;
+        pthread_mutex_unlock(&fake.lock);
+
+        dispatch(ev);
+
+        pthread_mutex_lock(&fake.lock);
+        if (ev->type != EV_ADV_ROUND)
+            fake.pending--;
+        if (ev->type == EV_THREAD_EXIT) {
+            fake.thread_running = 0;
+            fake.gattcbs = NULL;
+            done = 1;
+        }
+        pthread_cond_broadcast(&fake.idle);
+        pthread_mutex_unlock(&fake.lock);
+
+        free(ev);
+    }
+
+    return NULL;
+}
+
+static unsigned int bda_bucket(const uint8_t *address) {
+    unsigned int h = 0;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        h = h * 31 + address[i];
+
+    return h % DEVICE_BUCKETS;
+}
+
+/* Called with the lock held */
+static fake_device_t *find_device(const uint8_t *address) {
+    fake_device_t *dev;
+
+    dev = fake.devices_by_bda[bda_bucket(address)];
+    for (; dev; dev = dev->bda_next)
+        if (!memcmp(dev->bda.address, address, sizeof(dev->bda.address)))
+            break;
+
+    return dev;
+}
+
+/* Called with the lock held */
+static fake_device_t *find_device_by_conn_id(int conn_id) {
+    fake_device_t *dev;
+
+    if (conn_id <= 0)
+        return NULL;
+
+    dev = fake.devices_by_conn_id[conn_id % DEVICE_BUCKETS];
+    for (; dev; dev = dev->conn_next)
+        if (dev->conn_id == conn_id)
+            break;
+
+    return dev;
+}
+
+/* Called with the lock held */
+static void set_conn_id(fake_device_t *dev, int conn_id) {
+    fake_device_t **p;
+
+    if (dev->conn_id) {
+        p = &fake.devices_by_conn_id[dev->conn_id % DEVICE_BUCKETS];
+        for (; *p; p = &(*p)->conn_next)
+            if (*p == dev) {
+                *p = dev->conn_next;
+                break;
+            }
+    }
+
+    dev->conn_id = conn_id;
+    if (conn_id) {
+        p = &fake.devices_by_conn_id[conn_id % DEVICE_BUCKETS];
+        dev->conn_next = *p;
+        *p = dev;
+    }
+}
+
+static fake_srvc_t *find_srvc(fake_device_t *dev, btgatt_srvc_id_t *srvc_id) {
+    int i;
+
+    for (i = 0; i < dev->srvc_count; i++)
+        if (!memcmp(&dev->srvcs[i].id, srvc_id, sizeof(btgatt_srvc_id_t)))
+            return &dev->srvcs[i];
+
+    return NULL;
+}
+
+static int find_char(fake_srvc_t *srvc, btgatt_char_id_t *char_id) {
+    int i;
+
+    /* Hot characteristics are accessed over and over, don't let the fake
+     * stack dominate the client benchmarks */
+    i = srvc->last_char;
+    if (i < srvc->char_count &&
+        !memcmp(&srvc->chars[i].id, char_id, sizeof(btgatt_char_id_t)))
+        return i;
+
+    for (i = 0; i < srvc->char_count; i++)
+        if (!memcmp(&srvc->chars[i].id, char_id, sizeof(btgatt_char_id_t))) {
+            srvc->last_char = i;
+            return i;
+        }
+
+    return -1;
+}
+
+static int find_desc(fake_char_t *ch, bt_uuid_t *uuid) {
+    int i;
+
+    for (i = 0; i < ch->desc_count; i++)
+        if (!memcmp(&ch->descs[i].uuid, uuid, sizeof(bt_uuid_t)))
+            return i;
+
+    return -1;
+}
+
+/* Like Bluedroid, handle a single read or write per connection at a time and
+ * fail the ones issued meanwhile. Called with the lock held, returns -1 and
+ * sets the event status if another operation is pending. */
+static int begin_op(int conn_id, fake_event_t *ev) {
+    fake_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return 0;
+
+    if (dev->op_pending) {
+        ev->status = GATT_BUSY;
+        return -1;
+    }
+
+    dev->op_pending = 1;
+    ev->ends_op = 1;
+
+    return 0;
+}
+
+static void end_op(int conn_id) {
+    fake_device_t *dev;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        dev->op_pending = 0;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+static fake_char_t *lookup_char(int conn_id, btgatt_srvc_id_t *srvc_id,
+                                btgatt_char_id_t *char_id,
+                                fake_device_t **devp) {
+    fake_device_t *dev;
+    fake_srvc_t *srvc;
+    int i;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return NULL;
+
+    if (devp)
+        *devp = dev;
+
+    srvc = find_srvc(dev, srvc_id);
+    if (!srvc)
+        return NULL;
+
+    i = find_char(srvc, char_id);
+    if (i < 0)
+        return NULL;
+
+    return &srvc->chars[i];
+}
+
+/*
+ * bt_interface_t
+ */
+
+static int fake_init(bt_callbacks_t *callbacks) {
+    pthread_t thread;
+    const char *script;
+
+    pthread_once(&fake_once, fake_init_once);
+
+    /* A previous instance may still be shutting down */
+    pthread_mutex_lock(&fake.lock);
+    while (fake.thread_running)
+        pthread_cond_wait(&fake.idle, &fake.lock);
+
+    fake.btcbs = callbacks;
+    fake.gattcbs = NULL;
+    fake.scanning = 0;
+    fake.thread_running = 1;
+    queue_event(new_event(EV_THREAD_START, 0), 0);
+    pthread_mutex_unlock(&fake.lock);
+
+    script = getenv("FAKEHAL_SCRIPT");
+    if (script && !fake.script_loaded && fakehal_load_script(script) < 0)
+        fprintf(stderr, "fakehal: failed to load %s\n", script);
+
+    if (pthread_create(&thread, NULL, btif_thread, NULL)) {
+        fake.thread_running = 0;
+        return BT_STATUS_FAIL;
+    }
+    pthread_detach(thread);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_adapter_state(bt_state_t state) {
+    fake_event_t *ev = new_event(EV_ADAPTER_STATE, 0);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->arg = state;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_enable(void) {
+    return fake_adapter_state(BT_STATE_ON);
+}
+
+static int fake_disable(void) {
+    fake.scanning = 0;
+    return fake_adapter_state(BT_STATE_OFF);
+}
+
+static void fake_cleanup(void) {
+    fake.scanning = 0;
+    post(new_event(EV_THREAD_EXIT, 0));
+}
+
+static int fake_discovery(bt_discovery_state_t state) {
+    fake_event_t *ev = new_event(EV_DISCOVERY_STATE, 0);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->arg = state;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_start_discovery(void) {
+    return fake_discovery(BT_DISCOVERY_STARTED);
+}
+
+static int fake_cancel_discovery(void) {
+    return fake_discovery(BT_DISCOVERY_STOPPED);
+}
+
+static int fake_bond(const bt_bdaddr_t *bd_addr, bt_bond_state_t state) {
+    fake_event_t *ev = new_event(EV_BOND_STATE, 0);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->bda = *bd_addr;
+    ev->status = BT_STATUS_SUCCESS;
+    ev->arg = state;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_create_bond(const bt_bdaddr_t *bd_addr) {
+    int s = fake_bond(bd_addr, BT_BOND_STATE_BONDING);
+
+    if (s != BT_STATUS_SUCCESS)
+        return s;
+
+    return fake_bond(bd_addr, BT_BOND_STATE_BONDED);
+}
+
+static int fake_remove_bond(const bt_bdaddr_t *bd_addr) {
+    return fake_bond(bd_addr, BT_BOND_STATE_NONE);
+}
+
+static int fake_pin_reply(const bt_bdaddr_t *bd_addr, uint8_t accept,
+                          uint8_t pin_len, bt_pin_code_t *pin_code) {
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_ssp_reply(const bt_bdaddr_t *bd_addr, bt_ssp_variant_t variant,
+                          uint8_t accept, uint32_t passkey) {
+    return BT_STATUS_SUCCESS;
+}
+
+static const void *fake_get_profile_interface(const char *profile_id);
+
+static const bt_interface_t fake_btiface = {
+    .size = sizeof(bt_interface_t),
+    .init = fake_init,
+    .enable = fake_enable,
+    .disable = fake_disable,
+    .cleanup = fake_cleanup,
+    .start_discovery = fake_start_discovery,
+    .cancel_discovery = fake_cancel_discovery,
+    .create_bond = fake_create_bond,
+    .remove_bond = fake_remove_bond,
+    .cancel_bond = fake_remove_bond,
+    .pin_reply = fake_pin_reply,
+    .ssp_reply = fake_ssp_reply,
+    .get_profile_interface = fake_get_profile_interface,
+};
+
+/*
+ * btgatt_client_interface_t
+ */
+
+static bt_status_t fake_register_client(bt_uuid_t *uuid) {
+    fake_event_t *ev;
+
+    pthread_mutex_lock(&fake.lock);
+    ev = new_event(EV_REGISTER_CLIENT, ++fake.client_if);
+    pthread_mutex_unlock(&fake.lock);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->status = BT_STATUS_SUCCESS;
+    ev->uuid = *uuid;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_unregister_client(int client_if) {
+    fake.scanning = 0;
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_scan(int client_if, bool start) {
+    pthread_mutex_lock(&fake.lock);
+    if (start && !fake.scanning && fake.adv_interval) {
+        fake_event_t *ev = new_event(EV_ADV_ROUND, 0);
+        if (ev)
+            queue_event(ev, fake.latency);
+    }
+    fake.scanning = start;
+    pthread_mutex_unlock(&fake.lock);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_connect(int client_if, const bt_bdaddr_t *bd_addr,
+                                bool is_direct) {
+    fake_device_t *dev;
+    fake_event_t *ev = new_event(EV_CONNECT, 0);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->bda = *bd_addr;
+    ev->arg = client_if;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(bd_addr->address);
+    if (dev) {
+        if (!dev->conn_id)
+            set_conn_id(dev, fake.next_conn_id++);
+        ev->id = dev->conn_id;
+    } else
+        ev->status = GATT_ERROR;
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_disconnect(int client_if, const bt_bdaddr_t *bd_addr,
+                                   int conn_id) {
+    fake_device_t *dev;
+    fake_event_t *ev;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(bd_addr->address);
+    if (!dev || !dev->conn_id) {
+        pthread_mutex_unlock(&fake.lock);
+        return BT_STATUS_FAIL;
+    }
+
+    ev = new_event(EV_DISCONNECT, dev->conn_id);
+    set_conn_id(dev, 0);
+    pthread_mutex_unlock(&fake.lock);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->bda = *bd_addr;
+    ev->arg = client_if;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_refresh(int client_if, const bt_bdaddr_t *bd_addr) {
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_search_service(int conn_id, bt_uuid_t *filter_uuid) {
+    fake_event_t *results = NULL, **last = &results, *ev;
+    fake_device_t *dev;
+    int i;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev) {
+        pthread_mutex_unlock(&fake.lock);
+        return BT_STATUS_FAIL;
+    }
+
+    for (i = 0; i < dev->srvc_count; i++) {
+        if (filter_uuid && memcmp(&dev->srvcs[i].id.id.uuid, filter_uuid,
+                                  sizeof(bt_uuid_t)))
+            continue;
+
+        ev = new_event(EV_SEARCH_RESULT, conn_id);
+        if (!ev)
+            break;
+        ev->srvc_id = dev->srvcs[i].id;
+        *last = ev;
+        last = &ev->next;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    while ((ev = results)) {
+        results = ev->next;
+        post(ev);
+    }
+    post(new_event(EV_SEARCH_COMPLETE, conn_id));
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_get_included_service(int conn_id,
+                                             btgatt_srvc_id_t *srvc_id,
+                                             btgatt_srvc_id_t *start_incl) {
+    fake_event_t *ev = new_event(EV_GET_INCLUDED, conn_id);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    /* Included services are not modelled */
+    ev->status = GATT_ERROR;
+    ev->srvc_id = *srvc_id;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_get_characteristic(int conn_id,
+                                           btgatt_srvc_id_t *srvc_id,
+                                           btgatt_char_id_t *start_char_id) {
+    fake_device_t *dev;
+    fake_srvc_t *srvc;
+    fake_event_t *ev;
+    int i = 0;
+
+    ev = new_event(EV_GET_CHAR, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->srvc_id = *srvc_id;
+    ev->status = GATT_ERROR;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device_by_conn_id(conn_id);
+    srvc = dev ? find_srvc(dev, srvc_id) : NULL;
+    if (srvc && start_char_id)
+        i = find_char(srvc, start_char_id) + 1;
+    if (srvc && (!start_char_id || i > 0) && i < srvc->char_count) {
+        ev->status = 0;
+        ev->char_id = srvc->chars[i].id;
+        ev->arg = srvc->chars[i].props;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_get_descriptor(int conn_id, btgatt_srvc_id_t *srvc_id,
+                                       btgatt_char_id_t *char_id,
+                                       bt_uuid_t *start_descr_id) {
+    fake_char_t *ch;
+    fake_event_t *ev;
+    int i = 0;
+
+    ev = new_event(EV_GET_DESC, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->srvc_id = *srvc_id;
+    ev->char_id = *char_id;
+    ev->status = GATT_ERROR;
+
+    pthread_mutex_lock(&fake.lock);
+    ch = lookup_char(conn_id, srvc_id, char_id, NULL);
+    if (ch && start_descr_id)
+        i = find_desc(ch, start_descr_id) + 1;
+    if (ch && (!start_descr_id || i > 0) && i < ch->desc_count) {
+        ev->status = 0;
+        ev->uuid = ch->descs[i].uuid;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_read_characteristic(int conn_id,
+                                            btgatt_srvc_id_t *srvc_id,
+                                            btgatt_char_id_t *char_id,
+                                            int auth_req) {
+    fake_char_t *ch;
+    fake_event_t *ev;
+
+    ev = new_event(EV_READ_CHAR, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->p.read.srvc_id = *srvc_id;
+    ev->p.read.char_id = *char_id;
+
+    pthread_mutex_lock(&fake.lock);
+    if (begin_op(conn_id, ev) == 0) {
+        ch = lookup_char(conn_id, srvc_id, char_id, NULL);
+        if (ch) {
+            memcpy(&ev->p.read.value, &ch->v, sizeof(fake_value_t));
+            ev->status = 0;
+        } else
+            ev->status = GATT_ERROR;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    ev->p.read.status = ev->status;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static void store_value(fake_value_t *v, int len, const char *p_value) {
+    if (len < 0)
+        len = 0;
+    if (len > BTGATT_MAX_ATTR_LEN)
+        len = BTGATT_MAX_ATTR_LEN;
+
+    memcpy(v->value, p_value, len);
+    v->len = len;
+}
+
+/* Stores a part of a prepared write at offset, returns an ATT error or 0 */
+static int store_prep(fake_device_t *dev, fake_char_t *ch, int offset,
+                      int len, const char *p_value) {
+    if (dev->prep_char != ch)
+        dev->prep.len = 0;
+    dev->prep_char = ch;
+
+    if (offset > dev->prep.len)
+        return 0x07; /* Invalid Offset */
+    if (len > BTGATT_MAX_ATTR_LEN - offset)
+        return 0x09; /* Prepare Queue Full */
+
+    if (len > 0)
+        memcpy(dev->prep.value + offset, p_value, len);
+    if (offset + len > dev->prep.len)
+        dev->prep.len = offset + len;
+
+    return 0;
+}
+
+static bt_status_t fake_write_characteristic(int conn_id,
+                                             btgatt_srvc_id_t *srvc_id,
+                                             btgatt_char_id_t *char_id,
+                                             int write_type, int len,
+                                             int auth_req, char *p_value) {
+    fake_device_t *dev = NULL;
+    fake_char_t *ch;
+    fake_event_t *ev;
+
+    ev = new_event(EV_WRITE_CHAR, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->p.write.srvc_id = *srvc_id;
+    ev->p.write.char_id = *char_id;
+
+    /* Write commands aren't answered by the device, several can be queued */
+    pthread_mutex_lock(&fake.lock);
+    if (write_type == 1 || begin_op(conn_id, ev) == 0) {
+        ch = lookup_char(conn_id, srvc_id, char_id, &dev);
+        if (!ch)
+            ev->status = GATT_ERROR;
+        else if (write_type == 3) /* Prepare write */
+            /* The HAL has no offset, Bluedroid sends them all at 0 */
+            ev->status = store_prep(dev, ch, 0, len, p_value);
+        else
+            store_value(&ch->v, len, p_value);
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    ev->p.write.status = ev->status;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_read_descriptor(int conn_id, btgatt_srvc_id_t *srvc_id,
+                                        btgatt_char_id_t *char_id,
+                                        bt_uuid_t *descr_id, int auth_req) {
+    fake_char_t *ch;
+    fake_event_t *ev;
+    int i = -1;
+
+    ev = new_event(EV_READ_DESC, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->p.read.srvc_id = *srvc_id;
+    ev->p.read.char_id = *char_id;
+    ev->p.read.descr_id = *descr_id;
+    ev->status = GATT_ERROR;
+
+    pthread_mutex_lock(&fake.lock);
+    if (begin_op(conn_id, ev) == 0) {
+        ch = lookup_char(conn_id, srvc_id, char_id, NULL);
+        if (ch)
+            i = find_desc(ch, descr_id);
+        if (i >= 0) {
+            memcpy(&ev->p.read.value, &ch->descs[i].v, sizeof(fake_value_t));
+            ev->status = 0;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    ev->p.read.status = ev->status;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_write_descriptor(int conn_id, btgatt_srvc_id_t *srvc_id,
+                                         btgatt_char_id_t *char_id,
+                                         bt_uuid_t *descr_id, int write_type,
+                                         int len, int auth_req, char *p_value) {
+    fake_char_t *ch;
+    fake_event_t *ev;
+    int i = -1;
+
+    ev = new_event(EV_WRITE_DESC, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->p.write.srvc_id = *srvc_id;
+    ev->p.write.char_id = *char_id;
+    ev->p.write.descr_id = *descr_id;
+    ev->status = GATT_ERROR;
+
+    pthread_mutex_lock(&fake.lock);
+    if (begin_op(conn_id, ev) == 0) {
+        ch = lookup_char(conn_id, srvc_id, char_id, NULL);
+        if (ch)
+            i = find_desc(ch, descr_id);
+        if (i >= 0) {
+            store_value(&ch->descs[i].v, len, p_value);
+            ev->status = 0;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    ev->p.write.status = ev->status;
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_execute_write(int conn_id, int execute) {
+    fake_device_t *dev;
+    fake_event_t *ev;
+
+    ev = new_event(EV_EXECUTE_WRITE, conn_id);
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    pthread_mutex_lock(&fake.lock);
+    if (begin_op(conn_id, ev) == 0) {
+        dev = find_device_by_conn_id(conn_id);
+        if (dev) {
+            if (execute && dev->prep_char)
+                memcpy(&dev->prep_char->v, &dev->prep, sizeof(fake_value_t));
+            dev->prep_char = NULL;
+            dev->prep.len = 0;
+        } else
+            ev->status = GATT_ERROR;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_notification(int registered, const bt_bdaddr_t *bd_addr,
+                                     btgatt_srvc_id_t *srvc_id,
+                                     btgatt_char_id_t *char_id) {
+    fake_device_t *dev;
+    fake_event_t *ev = new_event(EV_REGISTER_NOTIF, 0);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->arg = registered;
+    ev->srvc_id = *srvc_id;
+    ev->char_id = *char_id;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(bd_addr->address);
+    if (dev && dev->conn_id)
+        ev->id = dev->conn_id;
+    else
+        ev->status = GATT_ERROR;
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t fake_register_for_notification(int client_if,
+                                                  const bt_bdaddr_t *bd_addr,
+                                                  btgatt_srvc_id_t *srvc_id,
+                                                  btgatt_char_id_t *char_id) {
+    return fake_notification(1, bd_addr, srvc_id, char_id);
+}
+
+static bt_status_t fake_deregister_for_notification(int client_if,
+                                                    const bt_bdaddr_t *bd_addr,
+                                                    btgatt_srvc_id_t *srvc_id,
+                                                    btgatt_char_id_t *char_id) {
+    return fake_notification(0, bd_addr, srvc_id, char_id);
+}
+
+static bt_status_t fake_read_remote_rssi(int client_if,
+                                         const bt_bdaddr_t *bd_addr) {
+    fake_device_t *dev;
+    fake_event_t *ev = new_event(EV_READ_RSSI, client_if);
+
+    if (!ev)
+        return BT_STATUS_NOMEM;
+
+    ev->bda = *bd_addr;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(bd_addr->address);
+    if (dev && dev->conn_id)
+        ev->arg = dev->rssi;
+    else
+        ev->status = GATT_ERROR;
+    pthread_mutex_unlock(&fake.lock);
+
+    post(ev);
+
+    return BT_STATUS_SUCCESS;
+}
+
+static int fake_get_device_type(const bt_bdaddr_t *bd_addr) {
+    return BT_DEVICE_DEVTYPE_BLE;
+}
+
+static const btgatt_client_interface_t fake_gatt_client = {
+    .register_client = fake_register_client,
+    .unregister_client = fake_unregister_client,
+    .scan = fake_scan,
+    .connect = fake_connect,
+    .disconnect = fake_disconnect,
+    .refresh = fake_refresh,
+    .search_service = fake_search_service,
+    .get_included_service = fake_get_included_service,
+    .get_characteristic = fake_get_characteristic,
+    .get_descriptor = fake_get_descriptor,
+    .read_characteristic = fake_read_characteristic,
+    .write_characteristic = fake_write_characteristic,
+    .read_descriptor = fake_read_descriptor,
+    .write_descriptor = fake_write_descriptor,
+    .execute_write = fake_execute_write,
+    .register_for_notification = fake_register_for_notification,
+    .deregister_for_notification = fake_deregister_for_notification,
+    .read_remote_rssi = fake_read_remote_rssi,
+    .get_device_type = fake_get_device_type,
+};
+
+static bt_status_t fake_gatt_init(const btgatt_callbacks_t *callbacks) {
+    fake.gattcbs = callbacks;
+    return BT_STATUS_SUCCESS;
+}
+
+static void fake_gatt_cleanup(void) {
+    fake.gattcbs = NULL;
+}
+
+static const btgatt_interface_t fake_gattiface = {
+    .size = sizeof(btgatt_interface_t),
+    .init = fake_gatt_init,
+    .cleanup = fake_gatt_cleanup,
+    .client = &fake_gatt_client,
+    .server = NULL,
+};
+
+static const void *fake_get_profile_interface(const char *profile_id) {
+    if (!strcmp(profile_id, BT_PROFILE_GATT_ID))
+        return &fake_gattiface;
+
+    return NULL;
+}
+
+/*
+ * libhardware entry points
+ */
+
+static const bt_interface_t *fake_get_bluetooth_interface() {
+    return &fake_btiface;
+}
+
+static int fake_close(struct hw_device_t *device) {
+    return 0;
+}
+
+static int fake_open(const struct hw_module_t *module, const char *id,
+                     struct hw_device_t **device);
+
+static struct hw_module_methods_t fake_module_methods = {
+    .open = fake_open,
+};
+
+static struct hw_module_t fake_module = {
+    .tag = HARDWARE_MODULE_TAG,
+    .module_api_version = 1,
+    .hal_api_version = HARDWARE_HAL_API_VERSION,
+    .id = BT_STACK_MODULE_ID,
+    .name = "Fake Bluetooth stack",
+    .author = "abtctl",
+    .methods = &fake_module_methods,
+};
+
+static bluetooth_device_t fake_device = {
+    .common = {
+        .tag = HARDWARE_DEVICE_TAG,
+        .version = 0,
+        .module = &fake_module,
+        .close = fake_close,
+    },
+    .get_bluetooth_interface = fake_get_bluetooth_interface,
+};
+
+static int fake_open(const struct hw_module_t *module, const char *id,
+                     struct hw_device_t **device) {
+    if (strcmp(id, BT_STACK_MODULE_ID))
+        return -EINVAL;
+
+    *device = &fake_device.common;
+
+    return 0;
+}
+
+int hw_get_module(const char *id, const struct hw_module_t **module) {
+    if (strcmp(id, BT_STACK_MODULE_ID))
+        return -ENOENT;
+
+    *module = &fake_module;
+
+    return 0;
+}
+
+/*
+ * Scripting API
+ */
+
+static void free_devices(fake_device_t *dev) {
+    while (dev) {
+        fake_device_t *next = dev->next;
+        int i, j;
+
+        for (i = 0; i < dev->srvc_count; i++) {
+            for (j = 0; j < dev->srvcs[i].char_count; j++)
+                free(dev->srvcs[i].chars[j].descs);
+            free(dev->srvcs[i].chars);
+        }
+        free(dev->srvcs);
+        free(dev);
+
+        dev = next;
+    }
+}
+
+void fakehal_reset(void) {
+    fake_device_t *devices;
+
+    pthread_mutex_lock(&fake.lock);
+    devices = fake.devices;
+    fake.devices = NULL;
+    memset(fake.devices_by_bda, 0, sizeof(fake.devices_by_bda));
+    memset(fake.devices_by_conn_id, 0, sizeof(fake.devices_by_conn_id));
+    fake.latency = 0;
+    fake.adv_interval = 0;
+    fake.inline_dispatch = 0;
+    pthread_mutex_unlock(&fake.lock);
+
+    free_devices(devices);
+}
+
+void fakehal_set_latency(unsigned int usec) {
+    pthread_mutex_lock(&fake.lock);
+    fake.latency = usec;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void fakehal_set_adv_interval(unsigned int msec) {
+    pthread_mutex_lock(&fake.lock);
+    if (msec && !fake.adv_interval && fake.scanning) {
+        fake_event_t *ev = new_event(EV_ADV_ROUND, 0);
+        if (ev)
+            queue_event(ev, msec * 1000UL);
+    }
+    fake.adv_interval = msec;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void fakehal_set_inline(int enable) {
+    pthread_mutex_lock(&fake.lock);
+    fake.inline_dispatch = enable ? 1 : 0;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void fakehal_flush(void) {
+    pthread_once(&fake_once, fake_init_once);
+
+    pthread_mutex_lock(&fake.lock);
+    while (fake.pending > 0 && fake.thread_running)
+        pthread_cond_wait(&fake.idle, &fake.lock);
+    pthread_mutex_unlock(&fake.lock);
+}
+
+int fakehal_add_device(const uint8_t *address, int rssi,
+                       const uint8_t *adv_data, uint8_t adv_len) {
+    fake_device_t *dev;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (!dev) {
+        dev = calloc(1, sizeof(fake_device_t));
+        if (!dev) {
+            pthread_mutex_unlock(&fake.lock);
+            return -1;
+        }
+
+        memcpy(dev->bda.address, address, sizeof(dev->bda.address));
+        dev->next = fake.devices;
+        fake.devices = dev;
+        dev->bda_next = fake.devices_by_bda[bda_bucket(address)];
+        fake.devices_by_bda[bda_bucket(address)] = dev;
+    }
+
+    if (adv_len > MAX_ADV_LEN)
+        adv_len = MAX_ADV_LEN;
+
+    dev->rssi = rssi;
+    memset(dev->adv, 0, sizeof(dev->adv));
+    if (adv_data)
+        memcpy(dev->adv, adv_data, adv_len);
+    pthread_mutex_unlock(&fake.lock);
+
+    return 0;
+}
+
+int fakehal_add_service(const uint8_t *address, const uint8_t *uuid,
+                        int is_primary) {
+    fake_device_t *dev;
+    fake_srvc_t *srvcs, *srvc;
+    int i, id = -1;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (!dev)
+        goto done;
+
+    srvcs = realloc(dev->srvcs, (dev->srvc_count + 1) * sizeof(fake_srvc_t));
+    if (!srvcs)
+        goto done;
+    dev->srvcs = srvcs;
+
+    id = dev->srvc_count++;
+    srvc = &dev->srvcs[id];
+    memset(srvc, 0, sizeof(fake_srvc_t));
+    memcpy(srvc->id.id.uuid.uu, uuid, sizeof(srvc->id.id.uuid.uu));
+    srvc->id.is_primary = is_primary ? 1 : 0;
+
+    /* Services sharing an UUID are told apart by the instance ID */
+    for (i = 0; i < id; i++)
+        if (!memcmp(&dev->srvcs[i].id.id.uuid, &srvc->id.id.uuid,
+                    sizeof(bt_uuid_t)))
+            srvc->id.id.inst_id++;
+
+done:
+    pthread_mutex_unlock(&fake.lock);
+    return id;
+}
+
+int fakehal_add_characteristic(const uint8_t *address, int srvc,
+                               const uint8_t *uuid, int props) {
+    fake_device_t *dev;
+    fake_srvc_t *s;
+    fake_char_t *chars, *ch;
+    int i, id = -1;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (!dev || srvc < 0 || srvc >= dev->srvc_count)
+        goto done;
+
+    s = &dev->srvcs[srvc];
+    chars = realloc(s->chars, (s->char_count + 1) * sizeof(fake_char_t));
+    if (!chars)
+        goto done;
+    s->chars = chars;
+
+    id = s->char_count++;
+    ch = &s->chars[id];
+    memset(ch, 0, sizeof(fake_char_t));
+    memcpy(ch->id.uuid.uu, uuid, sizeof(ch->id.uuid.uu));
+    ch->props = props;
+
+    for (i = 0; i < id; i++)
+        if (!memcmp(&s->chars[i].id.uuid, &ch->id.uuid, sizeof(bt_uuid_t)))
+            ch->id.inst_id++;
+
+done:
+    pthread_mutex_unlock(&fake.lock);
+    return id;
+}
+
+int fakehal_add_descriptor(const uint8_t *address, int srvc, int chr,
+                           const uint8_t *uuid) {
+    fake_device_t *dev;
+    fake_char_t *ch;
+    fake_desc_t *descs;
+    int id = -1;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (!dev || srvc < 0 || srvc >= dev->srvc_count)
+        goto done;
+
+    if (chr < 0 || chr >= dev->srvcs[srvc].char_count)
+        goto done;
+
+    ch = &dev->srvcs[srvc].chars[chr];
+    descs = realloc(ch->descs, (ch->desc_count + 1) * sizeof(fake_desc_t));
+    if (!descs)
+        goto done;
+    ch->descs = descs;
+
+    id = ch->desc_count++;
+    memset(&ch->descs[id], 0, sizeof(fake_desc_t));
+    memcpy(ch->descs[id].uuid.uu, uuid, sizeof(ch->descs[id].uuid.uu));
+
+done:
+    pthread_mutex_unlock(&fake.lock);
+    return id;
+}
+
+int fakehal_set_char_value(const uint8_t *address, int srvc, int chr,
+                           const uint8_t *value, uint16_t len) {
+    fake_device_t *dev;
+    int ret = -1;
+
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (dev && srvc >= 0 && srvc < dev->srvc_count &&
+        chr >= 0 && chr < dev->srvcs[srvc].char_count) {
+        store_value(&dev->srvcs[srvc].chars[chr].v, len, (const char *) value);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return ret;
+}
+
+int fakehal_advertise(const uint8_t *address, int rssi,
+                      const uint8_t *adv_data, uint8_t adv_len) {
+    fake_event_t *ev;
+
+    if (!fake.scanning)
+        return -1;
+
+    ev = new_event(EV_SCAN_RESULT, 0);
+    if (!ev)
+        return -1;
+
+    if (adv_len > MAX_ADV_LEN)
+        adv_len = MAX_ADV_LEN;
+
+    memcpy(ev->bda.address, address, sizeof(ev->bda.address));
+    ev->arg = rssi;
+    if (adv_data)
+        memcpy(ev->adv, adv_data, adv_len);
+    post(ev);
+
+    return 0;
+}
+
+int fakehal_notify(const uint8_t *address, int srvc, int chr,
+                   const uint8_t *value, uint16_t len, int is_notify) {
+    fake_device_t *dev;
+    fake_event_t *ev;
+    btgatt_notify_params_t *n;
+
+    ev = new_event(EV_NOTIFY, 0);
+    if (!ev)
+        return -1;
+
+    if (len > BTGATT_MAX_ATTR_LEN)
+        len = BTGATT_MAX_ATTR_LEN;
+
+    n = &ev->p.notify;
+    pthread_mutex_lock(&fake.lock);
+    dev = find_device(address);
+    if (!dev || !dev->conn_id || srvc < 0 || srvc >= dev->srvc_count ||
+        chr < 0 || chr >= dev->srvcs[srvc].char_count) {
+        pthread_mutex_unlock(&fake.lock);
+        free(ev);
+        return -1;
+    }
+
+    ev->id = dev->conn_id;
+    n->bda = dev->bda;
+    n->srvc_id = dev->srvcs[srvc].id;
+    n->char_id = dev->srvcs[srvc].chars[chr].id;
+    pthread_mutex_unlock(&fake.lock);
+
+    memcpy(n->value, value, len);
+    n->len = len;
+    n->is_notify = is_notify ? 1 : 0;
+    post(ev);
+
+    return 0;
+}
+
+/*
+ * Script parsing
+ */
+
+static int parse_address(const char *str, uint8_t *address) {
+    unsigned int b[6];
+    int i;
+
+    if (sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3],
+               &b[4], &b[5]) != 6)
+        return -1;
+
+    for (i = 0; i < 6; i++)
+        address[i] = b[i];
+
+    return 0;
+}
+
+/* Accepts 0xXXXX or the full 128-bit textual form */
+static int parse_uuid(const char *str, uint8_t *uuid) {
+    static const uint8_t base[16] = { 0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00,
+                                      0x80, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00,
+                                      0x00, 0x00 };
+    unsigned int v;
+    int i, n = 15;
+
+    memcpy(uuid, base, 16);
+
+    if (strlen(str) == 6) {
+        if (sscanf(str, "0x%4x", &v) != 1)
+            return -1;
+        uuid[12] = v & 0xff;
+        uuid[13] = v >> 8;
+        return 0;
+    }
+
+    if (strlen(str) != 36)
+        return -1;
+
+    for (i = 0; i < 36; i++) {
+        if (str[i] == '-')
+            continue;
+        if (n < 0 || sscanf(&str[i], "%2x", &v) != 1)
+            return -1;
+        uuid[n--] = v;
+        i++;
+    }
+
+    return n == -1 ? 0 : -1;
+}
+
+/* Parses a sequence of space separated hex bytes */
+static int parse_bytes(char **saveptr, uint8_t *buf, int max) {
+    char *tok, *end;
+    int len = 0;
+
+    while ((tok = strtok_r(NULL, " \t", saveptr))) {
+        unsigned long v = strtoul(tok, &end, 16);
+
+        if (*end != '\0' || v > 0xff || len == max)
+            return -1;
+
+        buf[len++] = v;
+    }
+
+    return len;
+}
+
+int fakehal_load_script(const char *path) {
+    uint8_t address[6], uuid[16], value[BTGATT_MAX_ATTR_LEN];
+    int have_device = 0, srvc = -1, chr = -1;
+    char line[2048];
+    int lineno = 0, ret = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    fake.script_loaded = 1;
+
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        char *saveptr = NULL, *cmd, *arg, *arg2;
+        int len;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        cmd = strtok_r(line, " \t", &saveptr);
+        if (!cmd)
+            continue;
+
+        arg = strtok_r(NULL, " \t", &saveptr);
+        if (!arg) {
+            ret = -1;
+            break;
+        }
+
+        if (!strcmp(cmd, "latency"))
+            fakehal_set_latency(strtoul(arg, NULL, 0));
+        else if (!strcmp(cmd, "adv-interval"))
+            fakehal_set_adv_interval(strtoul(arg, NULL, 0));
+        else if (!strcmp(cmd, "device")) {
+            arg2 = strtok_r(NULL, " \t", &saveptr);
+            len = parse_bytes(&saveptr, value, MAX_ADV_LEN);
+            if (parse_address(arg, address) < 0 || !arg2 || len < 0 ||
+                fakehal_add_device(address, atoi(arg2), value, len) < 0)
+                ret = -1;
+            have_device = 1;
+            srvc = chr = -1;
+        } else if (!strcmp(cmd, "service")) {
+            arg2 = strtok_r(NULL, " \t", &saveptr);
+            if (!have_device || parse_uuid(arg, uuid) < 0)
+                ret = -1;
+            else
+                srvc = fakehal_add_service(address, uuid,
+                                           !arg2 || strcmp(arg2, "secondary"));
+            chr = -1;
+        } else if (!strcmp(cmd, "characteristic")) {
+            arg2 = strtok_r(NULL, " \t", &saveptr);
+            len = parse_bytes(&saveptr, value, sizeof(value));
+            if (srvc < 0 || parse_uuid(arg, uuid) < 0 || !arg2 || len < 0)
+                ret = -1;
+            else {
+                chr = fakehal_add_characteristic(address, srvc, uuid,
+                                                 strtoul(arg2, NULL, 0));
+                fakehal_set_char_value(address, srvc, chr, value, len);
+            }
+        } else if (!strcmp(cmd, "descriptor")) {
+            if (chr < 0 || parse_uuid(arg, uuid) < 0)
+                ret = -1;
+            else
+                fakehal_add_descriptor(address, srvc, chr, uuid);
+        } else
+            ret = -1;
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "fakehal: %s:%d: invalid line\n", path, lineno);
+
+    fclose(f);
+
+    return ret;
+}
@@ -0,0 +1,90 @@
+#ifndef __FAKEHAL_H__
+#define __FAKEHAL_H__
+
+/*
+ *  Fake Bluetooth HAL -- libhardware stand-in for host builds
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The fake HAL implements hw_get_module(BT_STACK_MODULE_ID) with a scriptable
+ * bt_interface_t / btgatt_interface_t pair. Every callback is delivered on a
+ * dedicated thread, standing in for Bluedroid's btif thread, after a
+ * configurable latency. Remote devices and their GATT databases are described
+ * either with the functions below or with a script file pointed by the
+ * FAKEHAL_SCRIPT environment variable (see README.txt for its format).
+ *
+ * All addresses are 6 element arrays with the most-significant byte on
+ * position 0 and all UUIDs are 16 element arrays in the bt_uuid_t byte order.
+ */
+
+#include <stdint.h>
+
+/* Forget all remote devices and restore the default settings */
+void fakehal_reset(void);
+
+/* Load devices and settings from a script file, returns 0 on success */
+int fakehal_load_script(const char *path);
+
+/* Delay applied to every callback, in microseconds */
+void fakehal_set_latency(unsigned int usec);
+
+/* Interval between advertising rounds while scanning, in milliseconds. Zero
+ * disables periodic advertising, reports are then only sent by
+ * fakehal_advertise(). */
+void fakehal_set_adv_interval(unsigned int msec);
+
+/* When enabled callbacks run synchronously on the thread that triggered them,
+ * ignoring the latency. Meant for benchmarks measuring callback cost. */
+void fakehal_set_inline(int enable);
+
+/* Block until every pending callback has been delivered */
+void fakehal_flush(void);
+
+/* Add a remote device, returns 0 on success */
+int fakehal_add_device(const uint8_t *address, int rssi,
+                       const uint8_t *adv_data, uint8_t adv_len);
+
+/* Add a service to a remote device, returns the service index */
+int fakehal_add_service(const uint8_t *address, const uint8_t *uuid,
+                        int is_primary);
+
+/* Add a characteristic to a service, returns the characteristic index */
+int fakehal_add_characteristic(const uint8_t *address, int srvc,
+                               const uint8_t *uuid, int props);
+
+/* Add a descriptor to a characteristic, returns the descriptor index */
+int fakehal_add_descriptor(const uint8_t *address, int srvc, int chr,
+                           const uint8_t *uuid);
+
+/* Set the value returned when a characteristic is read */
+int fakehal_set_char_value(const uint8_t *address, int srvc, int chr,
+                           const uint8_t *value, uint16_t len);
+
+/* Send one advertising report, the address doesn't have to be a known device.
+ * Reports are only delivered while the client is scanning. */
+int fakehal_advertise(const uint8_t *address, int rssi,
+                      const uint8_t *adv_data, uint8_t adv_len);
+
+/* Send a notification (is_notify 1) or indication (0) of a characteristic of a
+ * connected device */
+int fakehal_notify(const uint8_t *address, int srvc, int chr,
+                   const uint8_t *value, uint16_t len, int is_notify);
+
+#endif
@@ -4,9 +4,20 @@ include $(CLEAR_VARS)
 
 LOCAL_COPY_HEADERS := ble.h
 LOCAL_COPY_HEADERS_TO := libble
-LOCAL_SRC_FILES := ble.c
+LOCAL_SRC_FILES := ble.c ad.c
 LOCAL_SHARED_LIBRARIES := libhardware
 LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := libble
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Host build against the fake Bluetooth HAL
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := ble.c ad.c
+LOCAL_SHARED_LIBRARIES := libfakehal
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := libble
+
+include $(BUILD_HOST_SHARED_LIBRARY)
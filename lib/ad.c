@@ -0,0 +1,159 @@
+/*
+ *  Android BLE Library -- Advertising data parsing
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+
+#include "ble.h"
+
+/* Bytes 0-11 of UUIDs derived from the Bluetooth base UUID, little-endian.
+ * Also used by the scan filters of ble.c, but not exported. */
+__attribute__((visibility("hidden")))
+const uint8_t base_uuid[12] = { 0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00,
+                                0x00, 0x80, 0x00, 0x10, 0x00, 0x00 };
+
+void ble_ad_iter_init(ble_ad_iter_t *it, const uint8_t *adv_data, int len) {
+    it->adv_data = adv_data;
+    it->len = adv_data && len > 0 ? len : 0;
+    it->pos = 0;
+}
+
+int ble_ad_next(ble_ad_iter_t *it, ble_ad_t *ad) {
+    int len;
+
+    /* A zero length structure marks the end of the significant part */
+    if (it->pos >= it->len || it->adv_data[it->pos] == 0)
+        return 0;
+
+    len = it->adv_data[it->pos];
+    if (it->pos + 1 + len > it->len) {
+        /* Truncated structure, don't look any further */
+        it->pos = it->len;
+        return -1;
+    }
+
+    ad->type = it->adv_data[it->pos + 1];
+    ad->data = &it->adv_data[it->pos + 2];
+    ad->len = len - 1;
+
+    it->pos += len + 1;
+
+    return 1;
+}
+
+int ble_ad_find(const uint8_t *adv_data, int len, uint8_t type,
+                ble_ad_t *ad) {
+    ble_ad_iter_t it;
+
+    ble_ad_iter_init(&it, adv_data, len);
+    while (ble_ad_next(&it, ad) > 0)
+        if (ad->type == type)
+            return 0;
+
+    return -1;
+}
+
+int ble_ad_get_flags(const ble_ad_t *ad, uint8_t *flags) {
+    if (ad->type != BLE_AD_FLAGS || ad->len < 1)
+        return -1;
+
+    *flags = ad->data[0];
+
+    return 0;
+}
+
+int ble_ad_get_tx_power(const ble_ad_t *ad, int8_t *tx_power) {
+    if (ad->type != BLE_AD_TX_POWER || ad->len < 1)
+        return -1;
+
+    *tx_power = (int8_t) ad->data[0];
+
+    return 0;
+}
+
+int ble_ad_get_name(const ble_ad_t *ad, const char **name, int *len) {
+    if (ad->type != BLE_AD_NAME_SHORT && ad->type != BLE_AD_NAME_COMPLETE)
+        return -1;
+
+    *name = (const char *) ad->data;
+    *len = ad->len;
+
+    return 0;
+}
+
+/* Size of each UUID of a UUID list structure, 0 for other structures */
+static int uuid_size(const ble_ad_t *ad) {
+    switch (ad->type) {
+        case BLE_AD_UUID16_SOME:
+        case BLE_AD_UUID16_ALL:
+        case BLE_AD_SOLICIT_UUID16:
+            return 2;
+        case BLE_AD_UUID32_SOME:
+        case BLE_AD_UUID32_ALL:
+        case BLE_AD_SOLICIT_UUID32:
+            return 4;
+        case BLE_AD_UUID128_SOME:
+        case BLE_AD_UUID128_ALL:
+        case BLE_AD_SOLICIT_UUID128:
+            return 16;
+    }
+
+    return 0;
+}
+
+int ble_ad_uuid_count(const ble_ad_t *ad) {
+    int size = uuid_size(ad);
+
+    if (!size)
+        return -1;
+
+    return ad->len / size;
+}
+
+int ble_ad_get_uuid(const ble_ad_t *ad, int i, uint8_t *uuid) {
+    int size = uuid_size(ad);
+
+    if (!size || i < 0 || (i + 1) * size > ad->len)
+        return -1;
+
+    if (size == 16) {
+        memcpy(uuid, &ad->data[i * 16], 16);
+        return 0;
+    }
+
+    /* 16 and 32-bit UUIDs are shorthands for the base UUID */
+    memcpy(uuid, base_uuid, sizeof(base_uuid));
+    memset(&uuid[12], 0, 4);
+    memcpy(&uuid[12], &ad->data[i * size], size);
+
+    return 0;
+}
+
+int ble_ad_get_manufacturer_data(const ble_ad_t *ad, uint16_t *company_id,
+                                 const uint8_t **data, int *len) {
+    if (ad->type != BLE_AD_MANUFACTURER_DATA || ad->len < 2)
+        return -1;
+
+    *company_id = ad->data[0] | ad->data[1] << 8;
+    *data = &ad->data[2];
+    *len = ad->len - 2;
+
+    return 0;
+}
@@ -20,10 +20,20 @@
  *
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <hardware/bluetooth.h>
 #include <hardware/bt_gatt.h>
 #include <hardware/bt_gatt_client.h>
@@ -51,27 +61,165 @@ typedef enum {
     BLE_GATT_ELEM_DESCRIPTOR
 } gatt_elem_t;
 
+/* Open addressing hash of the positions of an attribute table, keyed on the
+ * raw bytes of its entries (all of them are byte arrays, without padding) */
+typedef struct ble_attr_index {
+    int *slots; /* Attribute id + 1, zero marks an empty slot */
+    int size; /* Always a power of two, at least twice the attribute count */
+} ble_attr_index_t;
+
+/* State of a ble_gatt_discover_all() run, which explores every service and
+ * then every characteristic it found, one at a time */
+typedef enum {
+    DISCOVER_SRVCS,
+    DISCOVER_CHARS,
+    DISCOVER_DESCS
+} discovery_stage_t;
+
+typedef struct ble_discovery {
+    ble_gatt_discovery_cb_t cb;
+    discovery_stage_t stage;
+    int pos; /* Position in srvcs or chars of the attribute being explored */
+    ble_gatt_db_srvc_t *srvcs;
+    int srvc_count;
+    int srvc_alloc;
+    ble_gatt_db_char_t *chars;
+    int char_count;
+    int char_alloc;
+    ble_gatt_db_desc_t *descs;
+    int desc_count;
+    int desc_alloc;
+} ble_discovery_t;
+
+/* Results of a ble_gatt_read_multiple() call. The values are packed in a
+ * single buffer, at the offsets of each result. */
+typedef struct gatt_read_multiple {
+    ble_gatt_read_multiple_cb_t cb;
+    int count;
+    int pending;
+    ble_gatt_read_result_t *results;
+    int *offsets;
+    uint8_t *values;
+    int values_len;
+    int values_size;
+} gatt_read_multiple_t;
+
+/* A ble_gatt_stream_char() transfer. Write commands are sent while there are
+ * credits, each answer returns one. Answers of characteristic writes come in
+ * the order the writes were sent, so the lengths of the stream chunks (0 for
+ * a write of the operation queue) are kept in a ring to tell them apart. A
+ * write that fails to be sent is taken off the ring right away. The stream is
+ * filled from the caller's thread and from the answers, so it's guarded by
+ * stream_lock. */
+typedef struct gatt_stream {
+    ble_gatt_stream_cb_t cb;
+    ble_gatt_stream_producer_t producer;
+    const char *value; /* Or NULL to read the data from producer */
+    int len;
+    int offset;
+    int char_id;
+    int credits;
+    int in_flight;
+    int *writes; /* Ring of writes in flight, grown when full */
+    int write_size;
+    int write_head;
+    int write_count;
+    uint64_t sent;
+    uint64_t start_us;
+    int status;
+    uint8_t eof;
+    uint8_t filling; /* Set while a caller sends chunks */
+    uint8_t disconnected;
+    char chunk[BLE_GATT_STREAM_CHUNK];
+} gatt_stream_t;
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A read, write or execute write request, kept until it's answered. The value
+ * to write is stored right after it. */
+typedef struct gatt_op gatt_op_t;
+struct gatt_op {
+    int operation;
+    int id;
+    int auth;
+    int len;
+    int size; /* Room for the value */
+    int retries;
+    char *value;
+    gatt_read_multiple_t *multi; /* Set for the reads of read_multiple */
+    int index; /* Position of the result in multi */
+    ble_gatt_write_long_cb_t long_write; /* Set for write_long_char */
+    gatt_op_t *next;
+};
+
 /* Internal representation of a BLE device */
 typedef struct ble_device ble_device_t;
 struct ble_device {
     bt_bdaddr_t bda;
-    int conn_id;
+    uint64_t bda_key;
+    int conn_id; /* Changed with devices_lock held for writing */
 
+    /* Recursive, the stack may answer from within a call made holding it */
+    pthread_mutex_t lock;
+
+    /* Attribute tables, grown geometrically as discovery results arrive */
     btgatt_srvc_id_t *srvcs;
-    uint8_t srvc_count;
+    int srvc_count;
+    int srvc_alloc;
     ble_gatt_char_t *chars;
-    uint8_t char_count;
+    int char_count;
+    int char_alloc;
     ble_gatt_desc_t *descs;
-    uint8_t desc_count;
+    int desc_count;
+    int desc_alloc;
+    ble_attr_index_t srvc_index;
+    ble_attr_index_t char_index;
+    ble_attr_index_t desc_index;
+
+    /* Per-characteristic notification handlers, indexed by char id */
+    ble_gatt_notification_cb_t *notif_handlers;
+    int notif_handler_count;
+
+    uint8_t cache_dirty; /* Attributes were discovered since last saved */
+
+    ble_discovery_t *discovery; /* Running ble_gatt_discover_all() */
+
+    /* Requested GATT operations, the head one is waiting for its answer */
+    gatt_op_t *op_head;
+    gatt_op_t *op_tail;
+    gatt_op_t *op_spare; /* Kept to avoid an allocation per operation */
+    uint8_t op_retrying; /* The head one waits to be sent again */
+
+    gatt_stream_t *stream; /* Running ble_gatt_stream_char() */
 
     uint8_t write_prepared;
     gatt_elem_t prep_write_type;
-    uint8_t prep_write_id;
+    int prep_write_id;
 
     ble_device_t *next;
+    ble_device_t *bda_next; /* Next device in the same address bucket */
+    ble_device_t *conn_next; /* Next device in the same conn_id bucket */
 };
 
-/* Data that have to be acessable by the callbacks */
+/* Hash table of devices, chained through the devices themselves */
+typedef struct ble_device_index {
+    ble_device_t **buckets;
+    unsigned int size; /* Always a power of two */
+    unsigned int count;
+} ble_device_index_t;
+
+#define DEVICE_INDEX_MIN_SIZE 16
+
+/* Initial capacity of the attribute tables of a device */
+#define ATTR_TABLE_MIN_SIZE 16
+
+/* Guards the device list and both indexes, which API calls search while the
+ * stack thread adds devices. Devices are only freed by ble_enable(), so the
+ * pointer found stays valid once the lock is released. */
+static pthread_rwlock_t devices_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Data that have to be acessable by the callbacks. client, adapter_state and
+ * scan_state are accessed with atomics, the devices are locked one by one. */
 static struct libdata {
     ble_cbs_t cbs;
 
@@ -83,870 +231,4467 @@ static struct libdata {
     uint8_t adapter_state;
     uint8_t scan_state;
     ble_device_t *devices;
+    ble_device_index_t devices_by_bda;
+    ble_device_index_t devices_by_conn_id;
 } data;
 
-/* Called every time an advertising report is seen */
-static void scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
-    if (data.cbs.scan_cb)
-        data.cbs.scan_cb(bda->address, rssi, adv_data);
+/* Packs a 48-bit Bluetooth address into an integer key */
+static uint64_t bda_key(const uint8_t *address) {
+    return (uint64_t) address[0] << 40 | (uint64_t) address[1] << 32 |
+           (uint64_t) address[2] << 24 | (uint64_t) address[3] << 16 |
+           (uint64_t) address[4] << 8 | (uint64_t) address[5];
 }
 
-static int ble_scan(uint8_t start) {
-    bt_status_t s;
+static unsigned int hash_key(uint64_t key, unsigned int size) {
+    /* Fibonacci hashing, spreads sequential keys over the whole table */
+    return (unsigned int) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
 
-    if (!data.client)
-        return -1;
+/* Hashes a short byte string (attribute ids, advertising data) 32 bits at a
+ * time */
+static unsigned int hash_bytes(const void *key, size_t len) {
+    const uint8_t *p = key;
+    uint32_t h = 2166136261U, w;
 
-    if (data.gattiface == NULL)
-        return -1;
+    for (; len >= 4; len -= 4, p += 4) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 0x9e3779b1U;
+        h ^= h >> 15;
+    }
 
-    if (!data.adapter_state)
-        return -1;
+    while (len--)
+        h = (h ^ *p++) * 16777619U;
 
-    if (data.scan_state == start)
-        return 1;
+    return h ^ (h >> 16);
+}
 
-    s = data.gattiface->client->scan(data.client, start);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+/* Scan reports waiting for batched delivery. Kept out of data because it
+ * outlives ble_enable() and is shared with the batch timer thread. */
+static struct scan_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t thread_running;
+    uint8_t thread_stop;
+
+    ble_scan_batch_cb_t cb;
+    ble_scan_report_t *reports; /* Preallocated, max_reports long */
+    ble_scan_report_t *spare; /* Same size, NULL while given to cb */
+    unsigned int generation; /* Changed each time the buffers are replaced */
+    int max_reports;
+    int count;
+    unsigned int max_delay_ms;
+    uint64_t deadline; /* When the oldest pending report must go out */
+
+    /* cb runs without the lock, one batch at a time */
+    pthread_cond_t delivered;
+    uint8_t delivering;
+    pthread_t deliverer;
+} batch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .delivered = PTHREAD_COND_INITIALIZER,
+};
 
-    data.scan_state = start;
+static uint64_t now_us(void) {
+    struct timespec ts;
 
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-int ble_start_scan() {
-    return ble_scan(1);
+static uint64_t now_ms(void) {
+    return now_us() / 1000;
 }
 
-int ble_stop_scan() {
-    return ble_scan(0);
+/* Realtime deadline ms milliseconds from now, as conditions use that clock */
+static void deadline_timespec(uint64_t ms, struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
 }
 
-static ble_device_t *find_device_by_address(const uint8_t *address) {
-    ble_device_t *dev;
+/* Called with batch.lock held, which is released while cb runs. The
+ * reports are handed over in their buffer and new ones go to the spare
+ * buffer meanwhile. */
+static void scan_batch_deliver() {
+    ble_scan_batch_cb_t cb;
+    ble_scan_report_t *reports;
+    unsigned int generation;
+    int count;
+
+    while (batch.delivering) {
+        /* Flushed from the callback, the reports wait for the next batch */
+        if (pthread_equal(batch.deliverer, pthread_self()))
+            return;
+        pthread_cond_wait(&batch.delivered, &batch.lock);
+    }
 
-    for (dev = data.devices; dev ; dev = dev->next)
-        if (!memcmp(dev->bda.address, address, sizeof(dev->bda.address)))
-            break;
+    cb = batch.cb;
+    reports = batch.reports;
+    count = batch.count;
+    generation = batch.generation;
+    batch.count = 0;
+    if (!count || !cb)
+        return;
 
-    return dev;
+    batch.reports = batch.spare;
+    batch.spare = NULL;
+    batch.delivering = 1;
+    batch.deliverer = pthread_self();
+    pthread_mutex_unlock(&batch.lock);
+
+    cb(reports, count);
+
+    pthread_mutex_lock(&batch.lock);
+    /* The callback may have replaced the buffers */
+    if (batch.generation == generation)
+        batch.spare = reports;
+    else
+        free(reports);
+    batch.delivering = 0;
+    pthread_cond_broadcast(&batch.delivered);
 }
 
-/* Called every time a device gets connected */
-static void connect_cb(int conn_id, int status, int client_if,
-                       bt_bdaddr_t *bda) {
-    ble_device_t *dev;
+/* Delivers batches whose oldest report reached max_delay_ms */
+static void *scan_batch_thread(void *arg) {
+    struct timespec ts;
+    uint64_t now;
+
+    pthread_mutex_lock(&batch.lock);
+    while (!batch.thread_stop) {
+        if (!batch.count) {
+            pthread_cond_wait(&batch.cond, &batch.lock);
+            continue;
+        }
+
+        now = now_ms();
+        if (now >= batch.deadline) {
+            scan_batch_deliver();
+            continue;
+        }
+
+        deadline_timespec(batch.deadline - now, &ts);
+        pthread_cond_timedwait(&batch.cond, &batch.lock, &ts);
+    }
+    pthread_mutex_unlock(&batch.lock);
 
-    dev = find_device_by_address(bda->address);
-    if (!dev)
-        return;
+    return NULL;
+}
 
-    dev->conn_id = conn_id;
+static void scan_batch_add(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    ble_scan_report_t *r;
 
-    if (data.cbs.connect_cb)
-        data.cbs.connect_cb(bda->address, conn_id, status);
-}
+    pthread_mutex_lock(&batch.lock);
+    if (batch.cb && batch.count == batch.max_reports)
+        scan_batch_deliver();
 
-int ble_connect(const uint8_t *address) {
-    ble_device_t *dev;
-    bt_status_t s;
+    /* Still full while the callback of this thread holds the other buffer */
+    if (!batch.cb || batch.count == batch.max_reports) {
+        pthread_mutex_unlock(&batch.lock);
+        return;
+    }
 
-    if (!data.client)
-        return -1;
+    r = &batch.reports[batch.count++];
+    memcpy(r->address, bda->address, sizeof(r->address));
+    r->rssi = rssi;
+    r->timestamp = now_ms();
+    memcpy(r->adv_data, adv_data, sizeof(r->adv_data));
 
-    if (!data.gattiface)
-        return -1;
+    if (batch.count == 1 && batch.max_delay_ms) {
+        batch.deadline = r->timestamp + batch.max_delay_ms;
+        pthread_cond_signal(&batch.cond);
+    }
 
-    if (!data.adapter_state)
-        return -1;
+    if (batch.count == batch.max_reports)
+        scan_batch_deliver();
+    pthread_mutex_unlock(&batch.lock);
+}
 
-    dev = find_device_by_address(address);
-    if (!dev) {
-        int i;
+int ble_set_scan_batching(int max_reports, unsigned int max_delay_ms,
+                          ble_scan_batch_cb_t cb) {
+    ble_scan_report_t *reports = NULL, *spare = NULL;
+    uint8_t stop_thread;
+
+    if (cb && max_reports <= 0)
+        return -1;
 
-        dev = calloc(1, sizeof(ble_device_t));
-        if (!dev)
+    if (cb) {
+        reports = malloc(max_reports * sizeof(ble_scan_report_t));
+        spare = malloc(max_reports * sizeof(ble_scan_report_t));
+        if (!reports || !spare) {
+            free(reports);
+            free(spare);
             return -1;
+        }
+    }
 
-        /* TODO: memcpy() */
-        for (i = 0; i < 6; i++)
-            dev->bda.address[i] = address[i];
+    pthread_mutex_lock(&batch.lock);
+    scan_batch_deliver();
+
+    /* Reports still pending when called from the callback itself are kept
+     * for the new one */
+    if (reports && batch.count > max_reports)
+        batch.count = max_reports;
+    if (reports && batch.count > 0)
+        memcpy(reports, batch.reports, batch.count * sizeof(*reports));
+    else
+        batch.count = 0;
+
+    free(batch.reports);
+    free(batch.spare);
+    batch.reports = reports;
+    batch.spare = spare;
+    batch.generation++;
+    batch.max_reports = cb ? max_reports : 0;
+    batch.max_delay_ms = cb ? max_delay_ms : 0;
+    /* Also read without the lock by scan_result_cb() */
+    __atomic_store_n(&batch.cb, cb, __ATOMIC_RELAXED);
+
+    if (batch.max_delay_ms && !batch.thread_running) {
+        batch.thread_stop = 0;
+        if (pthread_create(&batch.thread, NULL, scan_batch_thread, NULL)) {
+            __atomic_store_n(&batch.cb, NULL, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&batch.lock);
+            return -1;
+        }
+        batch.thread_running = 1;
+    }
 
-        dev->next = data.devices;
-        data.devices = dev;
+    stop_thread = !batch.max_delay_ms && batch.thread_running;
+    if (stop_thread) {
+        batch.thread_stop = 1;
+        batch.thread_running = 0;
+        pthread_cond_signal(&batch.cond);
     }
+    pthread_mutex_unlock(&batch.lock);
 
-    s = data.gattiface->client->connect(data.client, &dev->bda, true);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    /* The batch callback may disable batching from the batch thread */
+    if (stop_thread && pthread_equal(batch.thread, pthread_self()))
+        pthread_detach(batch.thread);
+    else if (stop_thread)
+        pthread_join(batch.thread, NULL);
 
     return 0;
 }
 
-/* Called every time a device gets disconnected */
-static void disconnect_cb(int conn_id, int status, int client_if,
-                          bt_bdaddr_t *bda) {
-    ble_device_t *dev;
-
-    dev = find_device_by_address(bda->address);
-    if (!dev)
-        return;
+int ble_flush_scan_batch() {
+    int ret = 0;
 
-    dev->conn_id = 0;
+    pthread_mutex_lock(&batch.lock);
+    if (batch.cb)
+        scan_batch_deliver();
+    else
+        ret = -1;
+    pthread_mutex_unlock(&batch.lock);
 
-    if (data.cbs.disconnect_cb)
-        data.cbs.disconnect_cb(bda->address, conn_id, status);
+    return ret;
 }
 
-int ble_disconnect(const uint8_t *address) {
-    ble_device_t *dev;
-    bt_status_t s;
+/* Notifications waiting for their consumer. The btif thread is the only
+ * producer and touches just records, head and drops, without locking. The
+ * lock and condition are only used to wake up a consumer thread that ran out
+ * of work. Kept out of data because it outlives ble_enable(). */
+static struct notif_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t thread_running;
+    uint8_t thread_stop;
+    ble_notification_batch_cb_t cb;
+
+    ble_notification_t *records; /* NULL while disabled */
+    unsigned int mask;
+    unsigned int producing; /* Set while notify_cb uses records */
+    unsigned int waiting; /* Set while the consumer thread sleeps */
+
+    /* Producer and consumer indexes on their own cache lines */
+    char pad1[64];
+    unsigned int head;
+    unsigned long drops;
+    char pad2[64];
+    unsigned int tail;
+    char pad3[64];
+} ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
 
-    if (!data.client)
-        return -1;
+/* Returns 0 if the ring is disabled, so the notification should be delivered
+ * right away */
+static int notif_ring_push(int conn_id, int char_id,
+                           btgatt_notify_params_t *p) {
+    ble_notification_t *records, *r;
+    unsigned int head;
+
+    __atomic_store_n(&ring.producing, 1, __ATOMIC_SEQ_CST);
+    records = __atomic_load_n(&ring.records, __ATOMIC_SEQ_CST);
+    if (!records) {
+        __atomic_store_n(&ring.producing, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
 
-    if (!data.gattiface)
-        return -1;
+    head = ring.head;
+    if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) > ring.mask) {
+        __atomic_store_n(&ring.drops, ring.drops + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring.producing, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
 
-    if (!data.adapter_state)
-        return -1;
+    r = &records[head & ring.mask];
+    r->conn_id = conn_id;
+    r->char_id = char_id;
+    r->timestamp = now_us();
+    r->is_indication = !p->is_notify;
+    r->len = p->len < BLE_GATT_MAX_ATTR_LEN ? p->len : BLE_GATT_MAX_ATTR_LEN;
+    memcpy(r->value, p->value, r->len);
+
+    /* Publish the record before looking for a sleeping consumer */
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring.waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ring.lock);
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+    }
 
-    if (!address)
-        return -1;
+    __atomic_store_n(&ring.producing, 0, __ATOMIC_RELEASE);
 
-    dev = find_device_by_address(address);
-    if (!dev)
-        return -1;
+    return 1;
+}
 
-    s = data.gattiface->client->disconnect(data.client, &dev->bda,
-                                           dev->conn_id);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+/* Called only from the consumer */
+static int notif_ring_drain(ble_notification_batch_cb_t cb, int max) {
+    unsigned int head, tail = ring.tail, first, n, run;
 
-    return 0;
+    head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    n = head - tail;
+    if (max >= 0 && n > (unsigned int) max)
+        n = max;
+    if (!n)
+        return 0;
+
+    first = tail & ring.mask;
+    run = ring.mask + 1 - first;
+    if (run > n)
+        run = n;
+
+    cb(&ring.records[first], run);
+    if (n > run)
+        cb(&ring.records[0], n - run);
+
+    /* The records can be reused once the callback returns */
+    __atomic_store_n(&ring.tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
 }
 
-/* Called every time the bond state with a device changes */
-static void bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
-                                  bt_bond_state_t state) {
-    ble_bond_state_t s;
-    ble_device_t *dev;
+/* Disables the ring and frees its records once notify_cb is done with them */
+static void notif_ring_retire(void) {
+    ble_notification_t *records = ring.records;
 
-    switch (state) {
-        case BT_BOND_STATE_NONE:
-            s = BLE_BOND_NONE;
-            break;
-        case BT_BOND_STATE_BONDING:
-            s = BLE_BOND_BONDING;
-            break;
-        case BT_BOND_STATE_BONDED:
-            s = BLE_BOND_BONDED;
-            break;
-        default:
-            return;
-    }
+    __atomic_store_n(&ring.records, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ring.producing, __ATOMIC_SEQ_CST))
+        sched_yield();
 
-    dev = find_device_by_address(bda->address);
-    if (dev && data.cbs.bond_state_cb)
-        data.cbs.bond_state_cb(bda->address, s, status);
+    free(records);
 }
 
-static int ble_pair_internal(const uint8_t *address, uint8_t operation) {
-    ble_device_t *dev;
-    bt_status_t s = BT_STATUS_UNSUPPORTED;
+static void *notif_ring_thread(void *arg) {
+    uint8_t stop = 0;
+
+    while (!stop) {
+        if (notif_ring_drain(ring.cb, -1))
+            continue;
+
+        /* The producer signals if it sees waiting set, and waiting is set
+         * before looking at head again, so no wakeup is lost */
+        pthread_mutex_lock(&ring.lock);
+        __atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+        while (!ring.thread_stop &&
+               __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) == ring.tail)
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        __atomic_store_n(&ring.waiting, 0, __ATOMIC_RELAXED);
+        stop = ring.thread_stop;
+        pthread_mutex_unlock(&ring.lock);
+    }
 
-    if (!data.btiface)
-        return -1;
+    notif_ring_drain(ring.cb, -1);
 
-    if (!data.adapter_state)
-        return -1;
+    return NULL;
+}
 
-    dev = find_device_by_address(address);
-    if (!dev) {
-        int i;
+int ble_set_notification_ring(int size, ble_notification_batch_cb_t cb) {
+    ble_notification_t *records = NULL;
+    unsigned int n = 1;
 
-        dev = calloc(1, sizeof(ble_device_t));
-        if (!dev)
-            return -1;
+    if (size < 0)
+        return -1;
 
-        /* TODO: memcpy() */
-        for (i = 0; i < 6; i++)
-            dev->bda.address[i] = address[i];
+    if (size > 0) {
+        while (n < (unsigned int) size)
+            n <<= 1;
 
-        dev->next = data.devices;
-        data.devices = dev;
+        records = malloc(n * sizeof(ble_notification_t));
+        if (!records)
+            return -1;
     }
 
-    switch (operation) {
-        case 0: /* Pair */
-            s = data.btiface->create_bond(&dev->bda);
-            break;
-        case 1: /* Cancel pairing */
-            s = data.btiface->cancel_bond(&dev->bda);
-            break;
-        case 2: /* Remove bond */
-            s = data.btiface->remove_bond(&dev->bda);
-            break;
+    pthread_mutex_lock(&ring.lock);
+    if (ring.thread_running) {
+        ring.thread_stop = 1;
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+        pthread_join(ring.thread, NULL);
+        pthread_mutex_lock(&ring.lock);
+        ring.thread_running = 0;
+        ring.thread_stop = 0;
     }
 
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    notif_ring_retire();
+
+    ring.head = 0;
+    ring.tail = 0;
+    ring.drops = 0;
+    ring.mask = n - 1;
+    ring.cb = records ? cb : NULL;
+    __atomic_store_n(&ring.records, records, __ATOMIC_SEQ_CST);
+
+    if (ring.cb) {
+        if (pthread_create(&ring.thread, NULL, notif_ring_thread, NULL)) {
+            notif_ring_retire();
+            ring.cb = NULL;
+            pthread_mutex_unlock(&ring.lock);
+            return -1;
+        }
+        ring.thread_running = 1;
+    }
+    pthread_mutex_unlock(&ring.lock);
 
     return 0;
 }
 
-int ble_pair(const uint8_t *address) {
-    return ble_pair_internal(address, 0);
+int ble_poll_notifications(ble_notification_batch_cb_t cb, int max) {
+    if (!cb || max < 0 || !ring.records || ring.cb)
+        return -1;
+
+    return notif_ring_drain(cb, max);
 }
 
-int ble_cancel_pairing(const uint8_t *address) {
-    return ble_pair_internal(address, 1);
+unsigned long ble_notification_drops() {
+    return __atomic_load_n(&ring.drops, __ATOMIC_RELAXED);
 }
 
-int ble_remove_bond(const uint8_t *address) {
-    return ble_pair_internal(address, 2);
+/* Scan filters compiled for fast evaluation: addresses and UUIDs derived from
+ * the base UUID are sorted integers, looked up with binary search */
+typedef struct scan_rules {
+    int min_rssi;
+
+    uint64_t *addresses;
+    int address_count;
+    uint32_t *short_uuids; /* 16 and 32-bit UUIDs */
+    int short_uuid_count;
+    bt_uuid_t *uuids; /* Other 128-bit UUIDs */
+    int uuid_count;
+    ble_scan_filter_t *manufacturer; /* Only company_id and data are used */
+    int manufacturer_count;
+} scan_rules_t;
+
+static struct scan_filter {
+    pthread_mutex_t lock;
+    scan_rules_t *rules; /* NULL when every report is delivered */
+} filter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Bytes 0-11 of UUIDs derived from the Bluetooth base UUID, see ad.c */
+extern const uint8_t base_uuid[12];
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
 }
 
-static ble_device_t *find_device_by_conn_id(int conn_id) {
-    ble_device_t *dev;
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
 
-    for (dev = data.devices; dev ; dev = dev->next)
-        if (dev->conn_id == conn_id)
-            break;
+    return x < y ? -1 : x > y;
+}
 
-    return dev;
+static void scan_rules_free(scan_rules_t *r) {
+    if (!r)
+        return;
+
+    free(r->addresses);
+    free(r->short_uuids);
+    free(r->uuids);
+    free(r->manufacturer);
+    free(r);
 }
 
-/* Called in response of a read remote RSSI operation */
-void read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
-                         int status) {
-    ble_device_t *dev;
-    int conn_id = -1;
+static scan_rules_t *scan_rules_compile(const ble_scan_filter_t *filters,
+                                        int count, int min_rssi) {
+    scan_rules_t *r;
+    const ble_scan_filter_t *f;
+    int i;
+
+    r = calloc(1, sizeof(scan_rules_t));
+    if (!r)
+        return NULL;
+
+    r->min_rssi = min_rssi;
+
+    if (count > 0) {
+        r->addresses = malloc(count * sizeof(uint64_t));
+        r->short_uuids = malloc(count * sizeof(uint32_t));
+        r->uuids = malloc(count * sizeof(bt_uuid_t));
+        r->manufacturer = malloc(count * sizeof(ble_scan_filter_t));
+        if (!r->addresses || !r->short_uuids || !r->uuids ||
+            !r->manufacturer) {
+            scan_rules_free(r);
+            return NULL;
+        }
+    }
 
-    if (!status) {
-        dev = find_device_by_address(bda->address);
-        if (dev)
-            conn_id = dev->conn_id;
+    for (i = 0; i < count; i++) {
+        f = &filters[i];
+        switch (f->type) {
+            case BLE_SCAN_FILTER_ADDRESS:
+                r->addresses[r->address_count++] = bda_key(f->address);
+                break;
+
+            case BLE_SCAN_FILTER_SERVICE_UUID:
+                if (!memcmp(f->uuid, base_uuid, sizeof(base_uuid)))
+                    r->short_uuids[r->short_uuid_count++] =
+                        f->uuid[12] | f->uuid[13] << 8 |
+                        f->uuid[14] << 16 | (uint32_t) f->uuid[15] << 24;
+                else
+                    memcpy(r->uuids[r->uuid_count++].uu, f->uuid, 16);
+                break;
+
+            case BLE_SCAN_FILTER_MANUFACTURER_DATA:
+                if (f->data_len > BLE_ADV_DATA_LEN) {
+                    scan_rules_free(r);
+                    return NULL;
+                }
+                r->manufacturer[r->manufacturer_count++] = *f;
+                break;
+
+            default:
+                scan_rules_free(r);
+                return NULL;
+        }
     }
 
-    if (data.cbs.rssi_cb)
-        data.cbs.rssi_cb(conn_id, rssi, status);
+    /* Both are NULL when there are no rules of their kind */
+    if (r->address_count)
+        qsort(r->addresses, r->address_count, sizeof(uint64_t), cmp_u64);
+    if (r->short_uuid_count)
+        qsort(r->short_uuids, r->short_uuid_count, sizeof(uint32_t), cmp_u32);
+
+    return r;
 }
 
-int ble_read_remote_rssi(int conn_id) {
-    ble_device_t *dev;
-    bt_status_t s;
+/* Called with filter.lock held */
+static int scan_rules_match_ad(scan_rules_t *r, const ble_ad_t *ad) {
+    const uint8_t *p = ad->data;
+    int len = ad->len, i, j;
+    uint32_t u;
+
+    switch (ad->type) {
+        case BLE_AD_UUID16_SOME:
+        case BLE_AD_UUID16_ALL:
+            if (!r->short_uuid_count)
+                break;
+            for (i = 0; i + 2 <= len; i += 2) {
+                u = p[i] | p[i + 1] << 8;
+                if (bsearch(&u, r->short_uuids, r->short_uuid_count,
+                            sizeof(uint32_t), cmp_u32))
+                    return 1;
+            }
+            break;
 
-    if (!data.client)
-        return -1;
+        case BLE_AD_UUID32_SOME:
+        case BLE_AD_UUID32_ALL:
+            if (!r->short_uuid_count)
+                break;
+            for (i = 0; i + 4 <= len; i += 4) {
+                u = p[i] | p[i + 1] << 8 | p[i + 2] << 16 |
+                    (uint32_t) p[i + 3] << 24;
+                if (bsearch(&u, r->short_uuids, r->short_uuid_count,
+                            sizeof(uint32_t), cmp_u32))
+                    return 1;
+            }
+            break;
 
-    if (conn_id <= 0)
-        return -1;
+        case BLE_AD_UUID128_SOME:
+        case BLE_AD_UUID128_ALL:
+            for (i = 0; i + 16 <= len; i += 16)
+                for (j = 0; j < r->uuid_count; j++)
+                    if (!memcmp(p + i, r->uuids[j].uu, 16))
+                        return 1;
+            break;
 
-    if (!data.gattiface)
+        case BLE_AD_MANUFACTURER_DATA: {
+            const uint8_t *data;
+            uint16_t company_id;
+
+            if (ble_ad_get_manufacturer_data(ad, &company_id, &data, &len) < 0)
+                break;
+            for (j = 0; j < r->manufacturer_count; j++)
+                if (r->manufacturer[j].company_id == company_id &&
+                    r->manufacturer[j].data_len <= len &&
+                    !memcmp(data, r->manufacturer[j].data,
+                            r->manufacturer[j].data_len))
+                    return 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Whether a report passes the scan filters */
+static int scan_filter_pass(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    scan_rules_t *r;
+    ble_ad_iter_t it;
+    ble_ad_t ad;
+    uint64_t key;
+    int pass = 0;
+
+    pthread_mutex_lock(&filter.lock);
+    r = filter.rules;
+    if (!r) {
+        pthread_mutex_unlock(&filter.lock);
+        return 1;
+    }
+
+    if (rssi < r->min_rssi)
+        goto done;
+
+    if (!r->address_count && !r->short_uuid_count && !r->uuid_count &&
+        !r->manufacturer_count) {
+        pass = 1;
+        goto done;
+    }
+
+    key = bda_key(bda->address);
+    if (r->address_count && bsearch(&key, r->addresses, r->address_count,
+                                    sizeof(uint64_t), cmp_u64)) {
+        pass = 1;
+        goto done;
+    }
+
+    ble_ad_iter_init(&it, adv_data, BLE_ADV_DATA_LEN);
+    while (ble_ad_next(&it, &ad) > 0)
+        if (scan_rules_match_ad(r, &ad)) {
+            pass = 1;
+            break;
+        }
+
+done:
+    pthread_mutex_unlock(&filter.lock);
+
+    return pass;
+}
+
+int ble_set_scan_filters(const ble_scan_filter_t *filters, int count,
+                         int min_rssi) {
+    scan_rules_t *r, *old;
+
+    if (count < 0 || (count > 0 && !filters))
         return -1;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
+    r = scan_rules_compile(filters, count, min_rssi);
+    if (!r)
         return -1;
 
-    s = data.gattiface->client->read_remote_rssi(data.client, &dev->bda);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    pthread_mutex_lock(&filter.lock);
+    old = filter.rules;
+    __atomic_store_n(&filter.rules, r, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&filter.lock);
+
+    scan_rules_free(old);
 
     return 0;
 }
 
-static int find_service(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
-    int id;
+void ble_clear_scan_filters() {
+    scan_rules_t *old;
 
-    for (id = 0; id < dev->srvc_count; id++)
-        if (!memcmp(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t)))
-            return id;
+    pthread_mutex_lock(&filter.lock);
+    old = filter.rules;
+    __atomic_store_n(&filter.rules, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&filter.lock);
 
-    return -1;
+    scan_rules_free(old);
 }
 
-/* Called when the service discovery finishes */
-void service_discovery_complete_cb(int conn_id, int status) {
-    if (data.cbs.srvc_finished_cb)
-        data.cbs.srvc_finished_cb(conn_id, status);
+/* What was last reported of a device, for scan coalescing */
+typedef struct scan_track {
+    uint64_t key; /* bda_key() with bit 48 set, zero marks an empty slot */
+    unsigned int adv_hash;
+    int rssi;
+    uint64_t refill_ms; /* Last time tokens were added */
+    unsigned int tokens; /* In thousandths of a report */
+} scan_track_t;
+
+#define SCAN_TRACK_MIN_SIZE 64
+/* Busy places with random addresses would grow the table forever, it's
+ * cleared when it gets this big and devices are then reported afresh */
+#define SCAN_TRACK_MAX_SIZE 8192
+
+/* Scan report coalescing and rate limiting, kept out of data like batch */
+static struct scan_coalesce {
+    pthread_mutex_t lock;
+    uint8_t enabled;
+    int rssi_threshold;
+    unsigned int max_rate;
+    unsigned int burst;
+
+    scan_track_t *table; /* Open addressing, always a power of two long */
+    unsigned int size;
+    unsigned int count;
+} coalesce = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Length of the significant part of the advertising data, the rest of the
+ * buffer isn't guaranteed to be zeroed */
+static int adv_data_len(const uint8_t *adv_data) {
+    ble_ad_iter_t it;
+    ble_ad_t ad;
+
+    ble_ad_iter_init(&it, adv_data, BLE_ADV_DATA_LEN);
+    while (ble_ad_next(&it, &ad) > 0);
+
+    return it.pos;
 }
 
-/* Called for each service discovery result */
-void service_discovery_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
-    int id;
-    ble_device_t *dev;
+/* Called with coalesce.lock held */
+static scan_track_t *scan_track_get(uint64_t key) {
+    unsigned int i;
+
+    if (coalesce.count * 2 >= coalesce.size) {
+        scan_track_t *table, *old = coalesce.table;
+        unsigned int size, old_size = coalesce.size;
+
+        if (!old_size)
+            size = SCAN_TRACK_MIN_SIZE;
+        else if (old_size < SCAN_TRACK_MAX_SIZE)
+            size = old_size * 2;
+        else {
+            size = old_size;
+            old_size = 0; /* Forget everything */
+        }
+
+        table = calloc(size, sizeof(scan_track_t));
+        if (!table)
+            return NULL;
+
+        coalesce.table = table;
+        coalesce.size = size;
+        coalesce.count = 0;
+
+        for (i = 0; i < old_size; i++)
+            if (old[i].key)
+                *scan_track_get(old[i].key) = old[i];
+        free(old);
+    }
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return;
+    i = hash_key(key, coalesce.size);
+    while (coalesce.table[i].key && coalesce.table[i].key != key)
+        i = (i + 1) & (coalesce.size - 1);
 
-    id = find_service(dev, srvc_id);
-    if (id < 0) {
-        id = dev->srvc_count++;
-        dev->srvcs = realloc(dev->srvcs,
-                             dev->srvc_count * sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t));
+    if (!coalesce.table[i].key) {
+        memset(&coalesce.table[i], 0, sizeof(scan_track_t));
+        coalesce.table[i].key = key;
+        coalesce.count++;
     }
 
-    if (data.cbs.srvc_found_cb)
-        data.cbs.srvc_found_cb(conn_id, id, srvc_id->id.uuid.uu,
-                               srvc_id->is_primary);
+    return &coalesce.table[i];
 }
 
-int ble_gatt_discover_services(int conn_id, const uint8_t *uuid) {
+/* Whether a report should reach the user or be suppressed */
+static int scan_coalesce_pass(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    scan_track_t *t;
+    unsigned int adv_hash;
+    uint64_t now;
+    int pass = 1, new_entry;
+
+    adv_hash = hash_bytes(adv_data, adv_data_len(adv_data));
+
+    pthread_mutex_lock(&coalesce.lock);
+    if (!coalesce.enabled) {
+        pthread_mutex_unlock(&coalesce.lock);
+        return 1;
+    }
+
+    t = scan_track_get(bda_key(bda->address) | 1ULL << 48);
+    if (!t) {
+        pthread_mutex_unlock(&coalesce.lock);
+        return 1;
+    }
+
+    now = now_ms();
+    new_entry = !t->refill_ms;
+
+    /* Same payload and about the same RSSI as last reported: nothing new */
+    if (!new_entry && coalesce.rssi_threshold && t->adv_hash == adv_hash &&
+        abs(rssi - t->rssi) < coalesce.rssi_threshold)
+        pass = 0;
+
+    if (coalesce.max_rate) {
+        if (new_entry)
+            t->tokens = coalesce.burst * 1000;
+        else {
+            uint64_t tokens = t->tokens +
+                              (now - t->refill_ms) * coalesce.max_rate;
+            t->tokens = tokens < coalesce.burst * 1000 ?
+                        tokens : coalesce.burst * 1000;
+        }
+
+        if (pass) {
+            if (t->tokens >= 1000)
+                t->tokens -= 1000;
+            else
+                pass = 0;
+        }
+    }
+    t->refill_ms = now;
+
+    if (pass) {
+        t->adv_hash = adv_hash;
+        t->rssi = rssi;
+    }
+    pthread_mutex_unlock(&coalesce.lock);
+
+    return pass;
+}
+
+int ble_set_scan_coalescing(int rssi_threshold, unsigned int max_rate,
+                            unsigned int burst) {
+    if (rssi_threshold < 0)
+        return -1;
+
+    if (max_rate && !burst)
+        return -1;
+
+    pthread_mutex_lock(&coalesce.lock);
+    __atomic_store_n(&coalesce.enabled, rssi_threshold || max_rate,
+                     __ATOMIC_RELAXED);
+    coalesce.rssi_threshold = rssi_threshold;
+    coalesce.max_rate = max_rate;
+    coalesce.burst = burst;
+
+    /* Start from scratch, with new settings old state is meaningless */
+    free(coalesce.table);
+    coalesce.table = NULL;
+    coalesce.size = 0;
+    coalesce.count = 0;
+    pthread_mutex_unlock(&coalesce.lock);
+
+    return 0;
+}
+
+/* Called every time an advertising report is seen */
+static void scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    /* Unlocked checks to skip the locks of what isn't in use, each step
+     * checks again under its lock */
+    if (__atomic_load_n(&filter.rules, __ATOMIC_RELAXED) &&
+        !scan_filter_pass(bda, rssi, adv_data))
+        return;
+
+    if (__atomic_load_n(&coalesce.enabled, __ATOMIC_RELAXED) &&
+        !scan_coalesce_pass(bda, rssi, adv_data))
+        return;
+
+    if (data.cbs.scan_cb)
+        data.cbs.scan_cb(bda->address, rssi, adv_data);
+
+    if (__atomic_load_n(&batch.cb, __ATOMIC_RELAXED))
+        scan_batch_add(bda, rssi, adv_data);
+}
+
+static int ble_scan(uint8_t start) {
+    uint8_t state = !start;
     bt_status_t s;
-    bt_uuid_t uu, *u = NULL;
+    int client;
 
-    if (conn_id <= 0)
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
         return -1;
 
-    if (!data.gattiface)
+    if (data.gattiface == NULL)
         return -1;
 
-    if (uuid) {
-        memcpy(uu.uu, uuid, 16 * sizeof(uint8_t));
-        u = &uu;
-    }
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
+        return -1;
 
-    s = data.gattiface->client->search_service(conn_id, u);
-    if (s != BT_STATUS_SUCCESS)
+    /* Only one of concurrent callers gets to change the state */
+    if (!__atomic_compare_exchange_n(&data.scan_state, &state, start, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 1;
+
+    s = data.gattiface->client->scan(client, start);
+    if (s != BT_STATUS_SUCCESS) {
+        __atomic_store_n(&data.scan_state, !start, __ATOMIC_RELEASE);
         return -s;
+    }
+
+    if (!start)
+        ble_flush_scan_batch();
 
     return 0;
 }
 
-static void get_included_service_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id, btgatt_srvc_id_t *incl_srvc_id) {
-    ble_device_t *dev;
-    int id;
+int ble_start_scan() {
+    return ble_scan(1);
+}
 
-    if (status != 0)
-        return;
+int ble_stop_scan() {
+    return ble_scan(0);
+}
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return;
+static ble_device_t **device_next(ble_device_t *dev, uint8_t by_conn_id) {
+    return by_conn_id ? &dev->conn_next : &dev->bda_next;
+}
 
-    id = find_service(dev, incl_srvc_id);
-    if (id < 0)
+static uint64_t device_key(ble_device_t *dev, uint8_t by_conn_id) {
+    return by_conn_id ? (uint64_t) dev->conn_id : dev->bda_key;
+}
+
+static void device_index_resize(ble_device_index_t *idx, uint8_t by_conn_id,
+                                unsigned int size) {
+    ble_device_t **buckets, *dev, *next;
+    unsigned int i, h;
+
+    buckets = calloc(size, sizeof(ble_device_t *));
+    if (!buckets)
+        return; /* Keep the current table, it's just slower */
+
+    for (i = 0; i < idx->size; i++)
+        for (dev = idx->buckets[i]; dev; dev = next) {
+            next = *device_next(dev, by_conn_id);
+            h = hash_key(device_key(dev, by_conn_id), size);
+            *device_next(dev, by_conn_id) = buckets[h];
+            buckets[h] = dev;
+        }
+
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->size = size;
+}
+
+static int device_index_add(ble_device_index_t *idx, uint8_t by_conn_id,
+                            ble_device_t *dev) {
+    unsigned int h;
+
+    if (!idx->buckets) {
+        idx->buckets = calloc(DEVICE_INDEX_MIN_SIZE, sizeof(ble_device_t *));
+        if (!idx->buckets)
+            return -1;
+        idx->size = DEVICE_INDEX_MIN_SIZE;
+    } else if (idx->count >= idx->size)
+        device_index_resize(idx, by_conn_id, idx->size * 2);
+
+    h = hash_key(device_key(dev, by_conn_id), idx->size);
+    *device_next(dev, by_conn_id) = idx->buckets[h];
+    idx->buckets[h] = dev;
+    idx->count++;
+
+    return 0;
+}
+
+static void device_index_remove(ble_device_index_t *idx, uint8_t by_conn_id,
+                                ble_device_t *dev) {
+    ble_device_t **p;
+
+    if (!idx->buckets)
         return;
 
-    if (data.cbs.srvc_found_cb)
-        data.cbs.srvc_found_cb(conn_id, id, incl_srvc_id->id.uuid.uu,
-                               incl_srvc_id->is_primary);
+    p = &idx->buckets[hash_key(device_key(dev, by_conn_id), idx->size)];
+    for (; *p; p = device_next(*p, by_conn_id))
+        if (*p == dev) {
+            *p = *device_next(dev, by_conn_id);
+            *device_next(dev, by_conn_id) = NULL;
+            idx->count--;
+            return;
+        }
+}
 
-    data.gattiface->client->get_included_service(conn_id, srvc_id,
-                                                 incl_srvc_id);
+static ble_device_t *device_index_find(ble_device_index_t *idx,
+                                       uint8_t by_conn_id, uint64_t key) {
+    ble_device_t *dev;
+
+    if (!idx->buckets)
+        return NULL;
+
+    dev = idx->buckets[hash_key(key, idx->size)];
+    for (; dev; dev = *device_next(dev, by_conn_id))
+        if (device_key(dev, by_conn_id) == key)
+            break;
+
+    return dev;
 }
 
-int ble_gatt_get_included_services(int conn_id, int service_id) {
+static ble_device_t *find_device_by_address(const uint8_t *address) {
+    ble_device_t *dev;
+
+    pthread_rwlock_rdlock(&devices_lock);
+    dev = device_index_find(&data.devices_by_bda, 0, bda_key(address));
+    pthread_rwlock_unlock(&devices_lock);
+
+    return dev;
+}
+
+static ble_device_t *find_device_by_conn_id(int conn_id) {
     ble_device_t *dev;
-    bt_status_t s;
 
     if (conn_id <= 0)
-        return -1;
+        return NULL;
 
-    if (!data.gattiface)
-        return -1;
+    pthread_rwlock_rdlock(&devices_lock);
+    dev = device_index_find(&data.devices_by_conn_id, 1, conn_id);
+    pthread_rwlock_unlock(&devices_lock);
+
+    return dev;
+}
+
+/* These return the device with its lock held, to be released with
+ * unlock_device() */
+static ble_device_t *lock_device_by_address(const uint8_t *address) {
+    ble_device_t *dev;
+
+    dev = find_device_by_address(address);
+    if (dev)
+        pthread_mutex_lock(&dev->lock);
+
+    return dev;
+}
+
+static ble_device_t *lock_device_by_conn_id(int conn_id) {
+    ble_device_t *dev;
 
     dev = find_device_by_conn_id(conn_id);
     if (!dev)
-        return -1;
+        return NULL;
 
-    if (dev->srvc_count <= 0)
-        return -1;
+    pthread_mutex_lock(&dev->lock);
 
-    if (service_id < 0 || service_id >= dev->srvc_count)
-        return -1;
+    /* Disconnected while we waited for the lock */
+    if (dev->conn_id != conn_id) {
+        pthread_mutex_unlock(&dev->lock);
+        return NULL;
+    }
 
-    s = data.gattiface->client->get_included_service(conn_id,
-                                                     &dev->srvcs[service_id],
-                                                     NULL);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    return dev;
+}
 
-    return 0;
+static void unlock_device(ble_device_t *dev) {
+    if (dev)
+        pthread_mutex_unlock(&dev->lock);
 }
 
-static int find_characteristic(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
-                               btgatt_char_id_t *char_id) {
-    int id;
+/* User callbacks run without the device lock, so they can't deadlock with a
+ * lock the application holds around API calls, and a thread they wake up
+ * doesn't wait for them to return. Whatever the caller relies on has to be
+ * checked again after callback_leave(). */
+static void callback_enter(ble_device_t *dev) {
+    if (dev)
+        pthread_mutex_unlock(&dev->lock);
+}
 
-    for (id = 0; id < dev->char_count; id++)
-        if (!memcmp(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t)) &&
-            !memcmp(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t)))
-            return id;
+static void callback_leave(ble_device_t *dev) {
+    if (dev)
+        pthread_mutex_lock(&dev->lock);
+}
 
-    return -1;
+/* First device of the list. Devices are only ever added at the head, so the
+ * list can be walked from it without holding devices_lock. */
+static ble_device_t *first_device() {
+    return __atomic_load_n(&data.devices, __ATOMIC_ACQUIRE);
 }
 
-/* Called for each characteristic discovery result */
-static void characteristic_discovery_cb(int conn_id, int status,
-                                        btgatt_srvc_id_t *srvc_id,
-                                        btgatt_char_id_t *char_id,
-                                        int char_prop) {
+/* Returns the device with the given address, creating it if necessary. The
+ * device is returned locked. */
+static ble_device_t *get_device(const uint8_t *address) {
+    pthread_mutexattr_t attr;
     ble_device_t *dev;
-    int id;
-    bt_status_t s;
 
-    if (status != 0) {
-        if (data.cbs.char_finished_cb)
-            data.cbs.char_finished_cb(conn_id, status);
+    dev = lock_device_by_address(address);
+    if (dev)
+        return dev;
+
+    pthread_rwlock_wrlock(&devices_lock);
+
+    /* Someone else may have created it meanwhile */
+    dev = device_index_find(&data.devices_by_bda, 0, bda_key(address));
+    if (dev)
+        goto done;
+
+    dev = calloc(1, sizeof(ble_device_t));
+    if (!dev)
+        goto done;
+
+    memcpy(dev->bda.address, address, sizeof(dev->bda.address));
+    dev->bda_key = bda_key(address);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&dev->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (device_index_add(&data.devices_by_bda, 0, dev) < 0) {
+        pthread_mutex_destroy(&dev->lock);
+        free(dev);
+        dev = NULL;
+        goto done;
+    }
+
+    dev->next = data.devices;
+    __atomic_store_n(&data.devices, dev, __ATOMIC_RELEASE);
+
+done:
+    pthread_rwlock_unlock(&devices_lock);
+
+    if (dev)
+        pthread_mutex_lock(&dev->lock);
+
+    return dev;
+}
+
+/* Updates the connection ID of a device, keeping the conn_id index in sync */
+static void set_device_conn_id(ble_device_t *dev, int conn_id) {
+    ble_device_t *old;
+
+    if (dev->conn_id == conn_id)
         return;
+
+    pthread_rwlock_wrlock(&devices_lock);
+
+    if (dev->conn_id > 0)
+        device_index_remove(&data.devices_by_conn_id, 1, dev);
+
+    /* The stack may reuse an ID we missed the disconnection of */
+    old = conn_id > 0 ?
+          device_index_find(&data.devices_by_conn_id, 1, conn_id) : NULL;
+    if (old) {
+        device_index_remove(&data.devices_by_conn_id, 1, old);
+        old->conn_id = 0;
     }
 
-    dev = find_device_by_conn_id(conn_id);
+    dev->conn_id = conn_id;
+    if (conn_id > 0 &&
+        device_index_add(&data.devices_by_conn_id, 1, dev) < 0)
+        dev->conn_id = 0;
+
+    pthread_rwlock_unlock(&devices_lock);
+}
+
+static void gatt_cache_load(ble_device_t *dev);
+static void gatt_cache_save(ble_device_t *dev);
+static void discovery_finish(ble_device_t *dev, int status);
+static void gatt_op_flush(ble_device_t *dev, int report);
+static void stream_abort(ble_device_t *dev);
+
+/* Called every time a device gets connected */
+static void connect_cb(int conn_id, int status, int client_if,
+                       bt_bdaddr_t *bda) {
+    ble_device_t *dev;
+
+    dev = lock_device_by_address(bda->address);
     if (!dev)
         return;
 
-    id = find_characteristic(dev, srvc_id, char_id);
-    if (id < 0) {
-        id = dev->char_count++;
-        dev->chars = realloc(dev->chars,
-                             dev->char_count * sizeof(ble_gatt_char_t));
-        memcpy(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t));
-    }
+    set_device_conn_id(dev, conn_id);
 
-    if (data.cbs.char_found_cb)
-        data.cbs.char_found_cb(conn_id, id, char_id->uuid.uu, char_prop);
+    /* Make the ids of a known database valid before any discovery */
+    if (status == 0 && !dev->srvc_count)
+        gatt_cache_load(dev);
 
-    /* Get next characteristic */
-    s = data.gattiface->client->get_characteristic(conn_id, srvc_id, char_id);
-    if (s != BT_STATUS_SUCCESS)
-        if (data.cbs.char_finished_cb)
-            data.cbs.char_finished_cb(conn_id, status);
+    unlock_device(dev);
+
+    if (data.cbs.connect_cb)
+        data.cbs.connect_cb(bda->address, conn_id, status);
 }
 
-int ble_gatt_discover_characteristics(int conn_id, int service_id) {
+int ble_connect(const uint8_t *address) {
     ble_device_t *dev;
     bt_status_t s;
+    int client;
 
-    if (conn_id <= 0)
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
         return -1;
 
     if (!data.gattiface)
         return -1;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
-
-    if (dev->srvc_count <= 0)
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
         return -1;
 
-    if (service_id < 0 || service_id >= dev->srvc_count)
+    dev = get_device(address);
+    if (!dev)
         return -1;
 
-    s = data.gattiface->client->get_characteristic(conn_id,
-                                                   &dev->srvcs[service_id],
-                                                   NULL);
+    s = data.gattiface->client->connect(client, &dev->bda, true);
+    unlock_device(dev);
     if (s != BT_STATUS_SUCCESS)
         return -s;
 
     return 0;
 }
 
-static int find_descriptor(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
-                           btgatt_char_id_t *char_id, bt_uuid_t *descr_id) {
-    int id;
+/* Called every time a device gets disconnected */
+static void disconnect_cb(int conn_id, int status, int client_if,
+                          bt_bdaddr_t *bda) {
+    ble_device_t *dev;
 
-    for (id = 0; id < dev->desc_count; id++)
-        if (!memcmp(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t)) &&
-            !memcmp(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t)) &&
-            !memcmp(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t)))
-            return id;
+    dev = lock_device_by_address(bda->address);
+    if (!dev)
+        return;
 
-    return -1;
-}
+    if (dev->discovery)
+        discovery_finish(dev, -1);
 
-/* Called for each descriptor discovery result */
-static void descriptor_discovery_cb(int conn_id, int status,
-                                    btgatt_srvc_id_t *srvc_id,
-                                    btgatt_char_id_t *char_id,
-                                    bt_uuid_t *descr_id) {
-    ble_device_t *dev;
-    int id;
-    bt_status_t s;
+    gatt_op_flush(dev, 1);
 
-    if (status != 0) {
-        if (data.cbs.desc_finished_cb)
-            data.cbs.desc_finished_cb(conn_id, status);
-        return;
-    }
+    stream_abort(dev);
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return;
+    set_device_conn_id(dev, 0);
 
-    id = find_descriptor(dev, srvc_id, char_id, descr_id);
-    if (id < 0) {
-        id = dev->desc_count++;
-        dev->descs = realloc(dev->descs,
-                             dev->desc_count * sizeof(ble_gatt_desc_t));
-        memcpy(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t));
-        memcpy(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t));
-    }
+    if (dev->cache_dirty)
+        gatt_cache_save(dev);
 
-    if (data.cbs.desc_found_cb)
-        data.cbs.desc_found_cb(conn_id, id, descr_id->uu, 0);
+    unlock_device(dev);
 
-    /* Get next descriptor */
-    s = data.gattiface->client->get_descriptor(conn_id, srvc_id, char_id,
-                                               descr_id);
-    if (s != BT_STATUS_SUCCESS)
-        if (data.cbs.desc_finished_cb)
-            data.cbs.desc_finished_cb(conn_id, status);
+    if (data.cbs.disconnect_cb)
+        data.cbs.disconnect_cb(bda->address, conn_id, status);
 }
 
-int ble_gatt_discover_descriptors(int conn_id, int char_id) {
+int ble_disconnect(const uint8_t *address) {
     ble_device_t *dev;
     bt_status_t s;
+    int client;
 
-    if (conn_id <= 0)
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
         return -1;
 
     if (!data.gattiface)
         return -1;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
         return -1;
 
-    if (dev->char_count <= 0)
+    if (!address)
         return -1;
 
-    if (char_id < 0 || char_id >= dev->char_count)
+    dev = lock_device_by_address(address);
+    if (!dev)
         return -1;
 
-    s = data.gattiface->client->get_descriptor(conn_id, &dev->chars[char_id].s,
-                                               &dev->chars[char_id].c, NULL);
+    s = data.gattiface->client->disconnect(client, &dev->bda, dev->conn_id);
+    unlock_device(dev);
     if (s != BT_STATUS_SUCCESS)
         return -s;
 
     return 0;
 }
 
-/* Called when a GATT read characteristic operation returns */
+/* Called every time the bond state with a device changes */
+static void bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
+                                  bt_bond_state_t state) {
+    ble_bond_state_t s;
+    ble_device_t *dev;
+
+    switch (state) {
+        case BT_BOND_STATE_NONE:
+            s = BLE_BOND_NONE;
+            break;
+        case BT_BOND_STATE_BONDING:
+            s = BLE_BOND_BONDING;
+            break;
+        case BT_BOND_STATE_BONDED:
+            s = BLE_BOND_BONDED;
+            break;
+        default:
+            return;
+    }
+
+    dev = find_device_by_address(bda->address);
+    if (dev && data.cbs.bond_state_cb)
+        data.cbs.bond_state_cb(bda->address, s, status);
+}
+
+static int ble_pair_internal(const uint8_t *address, uint8_t operation) {
+    ble_device_t *dev;
+    bt_status_t s = BT_STATUS_UNSUPPORTED;
+
+    if (!data.btiface)
+        return -1;
+
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
+        return -1;
+
+    dev = get_device(address);
+    if (!dev)
+        return -1;
+
+    switch (operation) {
+        case 0: /* Pair */
+            s = data.btiface->create_bond(&dev->bda);
+            break;
+        case 1: /* Cancel pairing */
+            s = data.btiface->cancel_bond(&dev->bda);
+            break;
+        case 2: /* Remove bond */
+            s = data.btiface->remove_bond(&dev->bda);
+            break;
+    }
+
+    unlock_device(dev);
+
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+int ble_pair(const uint8_t *address) {
+    return ble_pair_internal(address, 0);
+}
+
+int ble_cancel_pairing(const uint8_t *address) {
+    return ble_pair_internal(address, 1);
+}
+
+int ble_remove_bond(const uint8_t *address) {
+    return ble_pair_internal(address, 2);
+}
+
+/* Called in response of a read remote RSSI operation */
+void read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
+                         int status) {
+    ble_device_t *dev;
+    int conn_id = -1;
+
+    if (!status) {
+        dev = lock_device_by_address(bda->address);
+        if (dev)
+            conn_id = dev->conn_id;
+        unlock_device(dev);
+    }
+
+    if (data.cbs.rssi_cb)
+        data.cbs.rssi_cb(conn_id, rssi, status);
+}
+
+int ble_read_remote_rssi(int conn_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+    int client;
+
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    s = data.gattiface->client->read_remote_rssi(client, &dev->bda);
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+/* Makes room for one more element at the end of an attribute table, doubling
+ * its capacity when it's full so discovery costs O(log n) allocations */
+static int attr_table_reserve(void **table, int *alloc, int count,
+                              size_t elem_size) {
+    void *t;
+    int n;
+
+    if (count < *alloc)
+        return 0;
+
+    n = *alloc ? *alloc * 2 : ATTR_TABLE_MIN_SIZE;
+    t = realloc(*table, n * elem_size);
+    if (!t)
+        return -1;
+
+    *table = t;
+    *alloc = n;
+
+    return 0;
+}
+
+static int attr_index_find(ble_attr_index_t *idx, const void *table,
+                           size_t elem_size, const void *key) {
+    unsigned int i;
+    int slot;
+
+    if (!idx->size)
+        return -1;
+
+    i = hash_bytes(key, elem_size) & (idx->size - 1);
+    while ((slot = idx->slots[i])) {
+        if (!memcmp((const uint8_t *) table + (slot - 1) * elem_size, key,
+                    elem_size))
+            return slot - 1;
+        i = (i + 1) & (idx->size - 1);
+    }
+
+    return -1;
+}
+
+static void attr_index_insert(ble_attr_index_t *idx, const void *table,
+                              size_t elem_size, int id) {
+    unsigned int i;
+
+    i = hash_bytes((const uint8_t *) table + id * elem_size, elem_size) &
+        (idx->size - 1);
+    while (idx->slots[i])
+        i = (i + 1) & (idx->size - 1);
+
+    idx->slots[i] = id + 1;
+}
+
+/* Indexes the attribute id, which must already be stored on the table,
+ * rehashing the whole table when the index gets half full */
+static int attr_index_add(ble_attr_index_t *idx, const void *table,
+                          size_t elem_size, int id) {
+    if ((id + 1) * 2 > idx->size) {
+        int *slots, size, i;
+
+        size = idx->size ? idx->size * 2 : ATTR_TABLE_MIN_SIZE * 2;
+        slots = calloc(size, sizeof(int));
+        if (!slots)
+            return -1;
+
+        free(idx->slots);
+        idx->slots = slots;
+        idx->size = size;
+
+        for (i = 0; i < id; i++)
+            attr_index_insert(idx, table, elem_size, i);
+    }
+
+    attr_index_insert(idx, table, elem_size, id);
+
+    return 0;
+}
+
+static void attr_index_free(ble_attr_index_t *idx) {
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->size = 0;
+}
+
+/* Forgets every attribute id handed out for the device */
+static void clear_device_attrs(ble_device_t *dev) {
+    if (dev->discovery)
+        discovery_finish(dev, -1);
+
+    dev->srvc_count = 0;
+    dev->char_count = 0;
+    dev->desc_count = 0;
+    attr_index_free(&dev->srvc_index);
+    attr_index_free(&dev->char_index);
+    attr_index_free(&dev->desc_index);
+
+    free(dev->notif_handlers);
+    dev->notif_handlers = NULL;
+    dev->notif_handler_count = 0;
+    dev->cache_dirty = 0;
+}
+
+static int find_service(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
+    return attr_index_find(&dev->srvc_index, dev->srvcs,
+                           sizeof(btgatt_srvc_id_t), srvc_id);
+}
+
+static void discovery_free(ble_discovery_t *d) {
+    if (!d)
+        return;
+
+    free(d->srvcs);
+    free(d->chars);
+    free(d->descs);
+    free(d);
+}
+
+static void discovery_finish(ble_device_t *dev, int status) {
+    ble_discovery_t *d = dev->discovery;
+    ble_gatt_db_t db;
+
+    dev->discovery = NULL;
+
+    /* Save the complete tree right away, don't wait for the disconnection */
+    if (status == 0 && dev->cache_dirty)
+        gatt_cache_save(dev);
+
+    db.srvcs = d->srvcs;
+    db.srvc_count = d->srvc_count;
+    db.chars = d->chars;
+    db.char_count = d->char_count;
+    db.descs = d->descs;
+    db.desc_count = d->desc_count;
+    callback_enter(dev);
+    d->cb(dev->conn_id, &db, status);
+    callback_leave(dev);
+
+    discovery_free(d);
+}
+
+/* Starts exploring the next service or characteristic, finishing the
+ * discovery when there is none left */
+static void discovery_next(ble_device_t *dev) {
+    ble_discovery_t *d = dev->discovery;
+    ble_gatt_char_t *c;
+    bt_status_t s;
+
+    if (d->stage == DISCOVER_SRVCS) {
+        d->stage = DISCOVER_CHARS;
+        d->pos = -1;
+    }
+
+    if (d->stage == DISCOVER_CHARS) {
+        if (++d->pos < d->srvc_count) {
+            d->srvcs[d->pos].char_start = d->char_count;
+            s = data.gattiface->client->get_characteristic(dev->conn_id,
+                                        &dev->srvcs[d->srvcs[d->pos].id], NULL);
+            if (s != BT_STATUS_SUCCESS)
+                discovery_finish(dev, -s);
+            return;
+        }
+
+        d->stage = DISCOVER_DESCS;
+        d->pos = -1;
+    }
+
+    if (++d->pos < d->char_count) {
+        d->chars[d->pos].desc_start = d->desc_count;
+        c = &dev->chars[d->chars[d->pos].id];
+        s = data.gattiface->client->get_descriptor(dev->conn_id, &c->s, &c->c,
+                                                   NULL);
+        if (s != BT_STATUS_SUCCESS)
+            discovery_finish(dev, -s);
+        return;
+    }
+
+    discovery_finish(dev, 0);
+}
+
+/* Called when the service discovery finishes */
+void service_discovery_complete_cb(int conn_id, int status) {
+    ble_device_t *dev;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev && dev->discovery) {
+        if (status != 0)
+            discovery_finish(dev, status);
+        else
+            discovery_next(dev);
+        unlock_device(dev);
+        return;
+    }
+
+    unlock_device(dev);
+
+    if (data.cbs.srvc_finished_cb)
+        data.cbs.srvc_finished_cb(conn_id, status);
+}
+
+/* Called for each service discovery result */
+void service_discovery_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
+    int id;
+    ble_device_t *dev;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    id = find_service(dev, srvc_id);
+    if (id < 0) {
+        if (attr_table_reserve((void **) &dev->srvcs, &dev->srvc_alloc,
+                               dev->srvc_count, sizeof(btgatt_srvc_id_t)) < 0)
+            goto done;
+
+        id = dev->srvc_count;
+        memcpy(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t));
+        if (attr_index_add(&dev->srvc_index, dev->srvcs,
+                           sizeof(btgatt_srvc_id_t), id) < 0)
+            goto done;
+        dev->srvc_count++;
+        dev->cache_dirty = 1;
+    }
+
+    if (dev->discovery) {
+        ble_discovery_t *d = dev->discovery;
+
+        if (attr_table_reserve((void **) &d->srvcs, &d->srvc_alloc,
+                               d->srvc_count, sizeof(ble_gatt_db_srvc_t)) < 0) {
+            discovery_finish(dev, -1);
+            goto done;
+        }
+
+        d->srvcs[d->srvc_count].id = id;
+        memcpy(d->srvcs[d->srvc_count].uuid, srvc_id->id.uuid.uu, 16);
+        d->srvcs[d->srvc_count].is_primary = srvc_id->is_primary;
+        d->srvcs[d->srvc_count].char_start = 0;
+        d->srvcs[d->srvc_count].char_count = 0;
+        d->srvc_count++;
+        goto done;
+    }
+
+    unlock_device(dev);
+
+    if (data.cbs.srvc_found_cb)
+        data.cbs.srvc_found_cb(conn_id, id, srvc_id->id.uuid.uu,
+                               srvc_id->is_primary);
+    return;
+
+done:
+    unlock_device(dev);
+}
+
+int ble_gatt_discover_services(int conn_id, const uint8_t *uuid) {
+    ble_device_t *dev;
+    bt_status_t s;
+    bt_uuid_t uu, *u = NULL;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev && dev->discovery) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    if (uuid) {
+        memcpy(uu.uu, uuid, 16 * sizeof(uint8_t));
+        u = &uu;
+    }
+
+    s = data.gattiface->client->search_service(conn_id, u);
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+static void get_included_service_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id, btgatt_srvc_id_t *incl_srvc_id) {
+    ble_device_t *dev;
+    int id;
+
+    if (status != 0)
+        return;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    id = find_service(dev, incl_srvc_id);
+    unlock_device(dev);
+    if (id < 0)
+        return;
+
+    if (data.cbs.srvc_found_cb)
+        data.cbs.srvc_found_cb(conn_id, id, incl_srvc_id->id.uuid.uu,
+                               incl_srvc_id->is_primary);
+
+    data.gattiface->client->get_included_service(conn_id, srvc_id,
+                                                 incl_srvc_id);
+}
+
+int ble_gatt_get_included_services(int conn_id, int service_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (service_id < 0 || service_id >= dev->srvc_count) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    s = data.gattiface->client->get_included_service(conn_id,
+                                                     &dev->srvcs[service_id],
+                                                     NULL);
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+static int find_characteristic(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
+                               btgatt_char_id_t *char_id) {
+    ble_gatt_char_t key;
+
+    memcpy(&key.s, srvc_id, sizeof(btgatt_srvc_id_t));
+    memcpy(&key.c, char_id, sizeof(btgatt_char_id_t));
+
+    return attr_index_find(&dev->char_index, dev->chars,
+                           sizeof(ble_gatt_char_t), &key);
+}
+
+/* Called for each characteristic discovery result */
+static void characteristic_discovery_cb(int conn_id, int status,
+                                        btgatt_srvc_id_t *srvc_id,
+                                        btgatt_char_id_t *char_id,
+                                        int char_prop) {
+    ble_device_t *dev;
+    int id;
+    bt_status_t s;
+
+    dev = lock_device_by_conn_id(conn_id);
+
+    /* The end of the characteristics of a service is reported as an error */
+    if (status != 0) {
+        if (dev && dev->discovery)
+            discovery_next(dev);
+        else {
+            callback_enter(dev);
+            if (data.cbs.char_finished_cb)
+                data.cbs.char_finished_cb(conn_id, status);
+            callback_leave(dev);
+        }
+        unlock_device(dev);
+        return;
+    }
+
+    if (!dev)
+        return;
+
+    id = find_characteristic(dev, srvc_id, char_id);
+    if (id < 0) {
+        if (attr_table_reserve((void **) &dev->chars, &dev->char_alloc,
+                               dev->char_count, sizeof(ble_gatt_char_t)) < 0)
+            goto done;
+
+        id = dev->char_count;
+        memcpy(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t));
+        memcpy(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t));
+        if (attr_index_add(&dev->char_index, dev->chars,
+                           sizeof(ble_gatt_char_t), id) < 0)
+            goto done;
+        dev->char_count++;
+        dev->cache_dirty = 1;
+    }
+
+    if (dev->discovery) {
+        ble_discovery_t *d = dev->discovery;
+
+        if (attr_table_reserve((void **) &d->chars, &d->char_alloc,
+                               d->char_count, sizeof(ble_gatt_db_char_t)) < 0) {
+            discovery_finish(dev, -1);
+            goto done;
+        }
+
+        d->chars[d->char_count].id = id;
+        memcpy(d->chars[d->char_count].uuid, char_id->uuid.uu, 16);
+        d->chars[d->char_count].properties = char_prop;
+        d->chars[d->char_count].desc_start = 0;
+        d->chars[d->char_count].desc_count = 0;
+        d->char_count++;
+        d->srvcs[d->pos].char_count++;
+    } else if (data.cbs.char_found_cb) {
+        callback_enter(dev);
+        data.cbs.char_found_cb(conn_id, id, char_id->uuid.uu, char_prop);
+        callback_leave(dev);
+    }
+
+    /* Get next characteristic */
+    s = data.gattiface->client->get_characteristic(conn_id, srvc_id, char_id);
+    if (s != BT_STATUS_SUCCESS) {
+        if (dev->discovery)
+            discovery_next(dev);
+        else {
+            callback_enter(dev);
+            if (data.cbs.char_finished_cb)
+                data.cbs.char_finished_cb(conn_id, status);
+            callback_leave(dev);
+        }
+    }
+
+done:
+    unlock_device(dev);
+}
+
+int ble_gatt_discover_characteristics(int conn_id, int service_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->discovery || service_id < 0 || service_id >= dev->srvc_count) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    s = data.gattiface->client->get_characteristic(conn_id,
+                                                   &dev->srvcs[service_id],
+                                                   NULL);
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+static int find_descriptor(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
+                           btgatt_char_id_t *char_id, bt_uuid_t *descr_id) {
+    ble_gatt_desc_t key;
+
+    memcpy(&key.c.s, srvc_id, sizeof(btgatt_srvc_id_t));
+    memcpy(&key.c.c, char_id, sizeof(btgatt_char_id_t));
+    memcpy(&key.d, descr_id, sizeof(bt_uuid_t));
+
+    return attr_index_find(&dev->desc_index, dev->descs,
+                           sizeof(ble_gatt_desc_t), &key);
+}
+
+/* Called for each descriptor discovery result */
+static void descriptor_discovery_cb(int conn_id, int status,
+                                    btgatt_srvc_id_t *srvc_id,
+                                    btgatt_char_id_t *char_id,
+                                    bt_uuid_t *descr_id) {
+    ble_device_t *dev;
+    int id;
+    bt_status_t s;
+
+    dev = lock_device_by_conn_id(conn_id);
+
+    /* The end of the descriptors of a characteristic is reported as an error */
+    if (status != 0) {
+        if (dev && dev->discovery)
+            discovery_next(dev);
+        else {
+            callback_enter(dev);
+            if (data.cbs.desc_finished_cb)
+                data.cbs.desc_finished_cb(conn_id, status);
+            callback_leave(dev);
+        }
+        unlock_device(dev);
+        return;
+    }
+
+    if (!dev)
+        return;
+
+    id = find_descriptor(dev, srvc_id, char_id, descr_id);
+    if (id < 0) {
+        if (attr_table_reserve((void **) &dev->descs, &dev->desc_alloc,
+                               dev->desc_count, sizeof(ble_gatt_desc_t)) < 0)
+            goto done;
+
+        id = dev->desc_count;
+        memcpy(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t));
+        memcpy(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t));
+        memcpy(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t));
+        if (attr_index_add(&dev->desc_index, dev->descs,
+                           sizeof(ble_gatt_desc_t), id) < 0)
+            goto done;
+        dev->desc_count++;
+        dev->cache_dirty = 1;
+    }
+
+    if (dev->discovery) {
+        ble_discovery_t *d = dev->discovery;
+
+        if (attr_table_reserve((void **) &d->descs, &d->desc_alloc,
+                               d->desc_count, sizeof(ble_gatt_db_desc_t)) < 0) {
+            discovery_finish(dev, -1);
+            goto done;
+        }
+
+        d->descs[d->desc_count].id = id;
+        memcpy(d->descs[d->desc_count].uuid, descr_id->uu, 16);
+        d->desc_count++;
+        d->chars[d->pos].desc_count++;
+    } else if (data.cbs.desc_found_cb) {
+        callback_enter(dev);
+        data.cbs.desc_found_cb(conn_id, id, descr_id->uu, 0);
+        callback_leave(dev);
+    }
+
+    /* Get next descriptor */
+    s = data.gattiface->client->get_descriptor(conn_id, srvc_id, char_id,
+                                               descr_id);
+    if (s != BT_STATUS_SUCCESS) {
+        if (dev->discovery)
+            discovery_next(dev);
+        else {
+            callback_enter(dev);
+            if (data.cbs.desc_finished_cb)
+                data.cbs.desc_finished_cb(conn_id, status);
+            callback_leave(dev);
+        }
+    }
+
+done:
+    unlock_device(dev);
+}
+
+int ble_gatt_discover_descriptors(int conn_id, int char_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->discovery || char_id < 0 || char_id >= dev->char_count) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    s = data.gattiface->client->get_descriptor(conn_id, &dev->chars[char_id].s,
+                                               &dev->chars[char_id].c, NULL);
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+int ble_gatt_discover_all(int conn_id, ble_gatt_discovery_cb_t cb) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!cb)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->discovery) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    dev->discovery = calloc(1, sizeof(ble_discovery_t));
+    if (!dev->discovery) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    dev->discovery->cb = cb;
+    dev->discovery->stage = DISCOVER_SRVCS;
+
+    s = data.gattiface->client->search_service(conn_id, NULL);
+    if (s != BT_STATUS_SUCCESS) {
+        discovery_free(dev->discovery);
+        dev->discovery = NULL;
+    }
+
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+/*
+ * GATT database cache. The file holds a header, a directory sorted by address
+ * and, for each device, its service, characteristic and descriptor tables as
+ * they are kept in ble_device_t. It's mapped read-only and replaced as a whole
+ * when an entry changes, which only happens after discoveries.
+ */
+#define GATT_CACHE_MAGIC "BLEGATT"
+#define GATT_CACHE_VERSION 1
+
+typedef struct gatt_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} gatt_cache_header_t;
+
+typedef struct gatt_cache_dirent {
+    uint64_t key; /* bda_key() */
+    uint32_t offset;
+    uint32_t srvc_count;
+    uint32_t char_count;
+    uint32_t desc_count;
+} gatt_cache_dirent_t;
+
+static struct gatt_cache {
+    pthread_mutex_t lock;
+    char *path;
+    uint8_t *map;
+    size_t size;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t gatt_cache_entry_size(const gatt_cache_dirent_t *e) {
+    return (size_t) e->srvc_count * sizeof(btgatt_srvc_id_t) +
+           (size_t) e->char_count * sizeof(ble_gatt_char_t) +
+           (size_t) e->desc_count * sizeof(ble_gatt_desc_t);
+}
+
+/* Called with cache.lock held */
+static void gatt_cache_unmap() {
+    if (cache.map)
+        munmap(cache.map, cache.size);
+
+    cache.map = NULL;
+    cache.size = 0;
+}
+
+/* Maps the cache file, ignoring it if it's missing or malformed. Called with
+ * cache.lock held. */
+static void gatt_cache_map() {
+    const gatt_cache_header_t *h;
+    const gatt_cache_dirent_t *dir;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    gatt_cache_unmap();
+
+    fd = open(cache.path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*h)) {
+        close(fd);
+        return;
+    }
+
+    cache.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache.map == MAP_FAILED) {
+        cache.map = NULL;
+        return;
+    }
+    cache.size = st.st_size;
+
+    /* Validate everything once, so lookups can trust the file */
+    h = (const gatt_cache_header_t *) cache.map;
+    dir = (const gatt_cache_dirent_t *) (h + 1);
+    if (memcmp(h->magic, GATT_CACHE_MAGIC, sizeof(GATT_CACHE_MAGIC)) ||
+        h->version != GATT_CACHE_VERSION ||
+        h->count > (cache.size - sizeof(*h)) / sizeof(*dir))
+        goto invalid;
+
+    for (i = 0; i < h->count; i++) {
+        if (i > 0 && dir[i].key <= dir[i - 1].key)
+            goto invalid;
+        if (dir[i].srvc_count > cache.size || dir[i].char_count > cache.size ||
+            dir[i].desc_count > cache.size ||
+            dir[i].offset > cache.size ||
+            gatt_cache_entry_size(&dir[i]) > cache.size - dir[i].offset)
+            goto invalid;
+    }
+
+    return;
+
+invalid:
+    gatt_cache_unmap();
+}
+
+/* Called with cache.lock held */
+static const gatt_cache_dirent_t *gatt_cache_find(uint64_t key) {
+    const gatt_cache_header_t *h;
+    const gatt_cache_dirent_t *dir;
+    int lo, hi, mid;
+
+    if (!cache.map)
+        return NULL;
+
+    h = (const gatt_cache_header_t *) cache.map;
+    dir = (const gatt_cache_dirent_t *) (h + 1);
+
+    lo = 0;
+    hi = h->count - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (dir[mid].key == key)
+            return &dir[mid];
+        if (dir[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return NULL;
+}
+
+/* Rewrites the cache file with the entry of key replaced by the tables of dev,
+ * or removed if dev is NULL. Called with cache.lock held. */
+static int gatt_cache_store(uint64_t key, ble_device_t *dev) {
+    const gatt_cache_header_t *old_h = (const gatt_cache_header_t *) cache.map;
+    const gatt_cache_dirent_t *old_dir = NULL;
+    gatt_cache_header_t h;
+    gatt_cache_dirent_t *dir, e;
+    uint32_t old_count = 0, i, n = 0;
+    size_t offset;
+    char *tmp;
+    FILE *f;
+    int ret = -1;
+
+    if (old_h) {
+        old_count = old_h->count;
+        old_dir = (const gatt_cache_dirent_t *) (old_h + 1);
+    }
+
+    dir = malloc((old_count + 1) * sizeof(gatt_cache_dirent_t));
+    tmp = malloc(strlen(cache.path) + 5);
+    if (!dir || !tmp)
+        goto done;
+
+    memset(&e, 0, sizeof(e));
+    if (dev) {
+        e.key = key;
+        e.srvc_count = dev->srvc_count;
+        e.char_count = dev->char_count;
+        e.desc_count = dev->desc_count;
+    }
+
+    /* Merge the new entry into the sorted directory */
+    for (i = 0; i < old_count; i++) {
+        if (dev && e.key < old_dir[i].key && (!n || dir[n - 1].key < e.key))
+            dir[n++] = e;
+        if (old_dir[i].key != key)
+            dir[n++] = old_dir[i];
+    }
+    if (dev && (!n || dir[n - 1].key < e.key))
+        dir[n++] = e;
+
+    sprintf(tmp, "%s.tmp", cache.path);
+    f = fopen(tmp, "wb");
+    if (!f)
+        goto done;
+
+    memcpy(h.magic, GATT_CACHE_MAGIC, sizeof(h.magic));
+    h.version = GATT_CACHE_VERSION;
+    h.count = n;
+
+    /* Write the directory with the new offsets, then every entry. dir keeps
+     * the old offsets, the tables of unchanged entries come from the old map */
+    offset = sizeof(h) + n * sizeof(gatt_cache_dirent_t);
+    fwrite(&h, sizeof(h), 1, f);
+    for (i = 0; i < n; i++) {
+        e = dir[i];
+        e.offset = offset;
+        offset += gatt_cache_entry_size(&e);
+        fwrite(&e, sizeof(e), 1, f);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (dev && dir[i].key == key) {
+            fwrite(dev->srvcs, sizeof(btgatt_srvc_id_t), dev->srvc_count, f);
+            fwrite(dev->chars, sizeof(ble_gatt_char_t), dev->char_count, f);
+            fwrite(dev->descs, sizeof(ble_gatt_desc_t), dev->desc_count, f);
+        } else
+            fwrite(cache.map + dir[i].offset, 1,
+                   gatt_cache_entry_size(&dir[i]), f);
+    }
+
+    if (fclose(f) != 0 || offset > 0xffffffffU) {
+        unlink(tmp);
+        goto done;
+    }
+
+    if (rename(tmp, cache.path) < 0) {
+        unlink(tmp);
+        goto done;
+    }
+
+    gatt_cache_map();
+    ret = 0;
+
+done:
+    free(dir);
+    free(tmp);
+
+    return ret;
+}
+
+static void gatt_cache_save(ble_device_t *dev) {
+    pthread_mutex_lock(&cache.lock);
+    if (cache.path && gatt_cache_store(dev->bda_key, dev) == 0)
+        dev->cache_dirty = 0;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* Copies a table out of the cache, growing the device table to fit */
+static int gatt_cache_copy(void **table, int *alloc, int *count,
+                           const uint8_t *src, uint32_t n, size_t elem_size) {
+    while (*alloc < (int) n)
+        if (attr_table_reserve(table, alloc, *alloc, elem_size) < 0)
+            return -1;
+
+    memcpy(*table, src, n * elem_size);
+    *count = n;
+
+    return 0;
+}
+
+static void gatt_cache_load(ble_device_t *dev) {
+    const gatt_cache_dirent_t *e;
+    const uint8_t *p;
+    int i;
+
+    pthread_mutex_lock(&cache.lock);
+    e = gatt_cache_find(dev->bda_key);
+    if (!e) {
+        pthread_mutex_unlock(&cache.lock);
+        return;
+    }
+
+    p = cache.map + e->offset;
+    if (gatt_cache_copy((void **) &dev->srvcs, &dev->srvc_alloc,
+                        &dev->srvc_count, p, e->srvc_count,
+                        sizeof(btgatt_srvc_id_t)) < 0)
+        goto fail;
+    p += e->srvc_count * sizeof(btgatt_srvc_id_t);
+
+    if (gatt_cache_copy((void **) &dev->chars, &dev->char_alloc,
+                        &dev->char_count, p, e->char_count,
+                        sizeof(ble_gatt_char_t)) < 0)
+        goto fail;
+    p += e->char_count * sizeof(ble_gatt_char_t);
+
+    if (gatt_cache_copy((void **) &dev->descs, &dev->desc_alloc,
+                        &dev->desc_count, p, e->desc_count,
+                        sizeof(ble_gatt_desc_t)) < 0)
+        goto fail;
+    pthread_mutex_unlock(&cache.lock);
+
+    for (i = 0; i < dev->srvc_count; i++)
+        if (attr_index_add(&dev->srvc_index, dev->srvcs,
+                           sizeof(btgatt_srvc_id_t), i) < 0)
+            goto fail_unlocked;
+    for (i = 0; i < dev->char_count; i++)
+        if (attr_index_add(&dev->char_index, dev->chars,
+                           sizeof(ble_gatt_char_t), i) < 0)
+            goto fail_unlocked;
+    for (i = 0; i < dev->desc_count; i++)
+        if (attr_index_add(&dev->desc_index, dev->descs,
+                           sizeof(ble_gatt_desc_t), i) < 0)
+            goto fail_unlocked;
+
+    return;
+
+fail:
+    pthread_mutex_unlock(&cache.lock);
+fail_unlocked:
+    clear_device_attrs(dev);
+}
+
+int ble_set_gatt_cache(const char *path) {
+    char *p = NULL;
+
+    if (path) {
+        p = strdup(path);
+        if (!p)
+            return -1;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    gatt_cache_unmap();
+    free(cache.path);
+    cache.path = p;
+    if (p)
+        gatt_cache_map();
+    pthread_mutex_unlock(&cache.lock);
+
+    return 0;
+}
+
+int ble_gatt_cache_invalidate(const uint8_t *address) {
+    ble_device_t *dev;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.path)
+        ret = -1;
+    else if (!address) {
+        gatt_cache_unmap();
+        if (unlink(cache.path) < 0 && errno != ENOENT)
+            ret = -1;
+    } else if (gatt_cache_find(bda_key(address)))
+        ret = gatt_cache_store(bda_key(address), NULL);
+    pthread_mutex_unlock(&cache.lock);
+
+    if (ret < 0)
+        return ret;
+
+    /* The ids handed out for the old database are meaningless now */
+    if (!address) {
+        for (dev = first_device(); dev; dev = dev->next) {
+            pthread_mutex_lock(&dev->lock);
+            clear_device_attrs(dev);
+            pthread_mutex_unlock(&dev->lock);
+        }
+    } else {
+        dev = lock_device_by_address(address);
+        if (dev)
+            clear_device_attrs(dev);
+        unlock_device(dev);
+    }
+
+    return 0;
+}
+
+/*
+ * GATT operation queue. Bluedroid fails a read or write issued while another
+ * one is pending on the connection, so operations are sent one at a time,
+ * each one as soon as the previous is answered.
+ */
+#define GATT_BUSY 0x84
+#define GATT_ERROR 0x85
+#define GATT_OP_MAX_RETRIES 3
+#define GATT_OP_RETRY_DELAY_MS 20 /* Doubled on each retry */
+#define GATT_OP_MIN_SIZE 32
+
+static gatt_op_t *gatt_op_alloc(ble_device_t *dev, int len) {
+    gatt_op_t *op = dev->op_spare;
+    int size;
+
+    if (op && op->size >= len) {
+        dev->op_spare = NULL;
+        return op;
+    }
+
+    size = len > GATT_OP_MIN_SIZE ? len : GATT_OP_MIN_SIZE;
+    op = malloc(sizeof(gatt_op_t) + size);
+    if (op) {
+        op->size = size;
+        op->value = (char *) (op + 1);
+    }
+
+    return op;
+}
+
+static void gatt_op_release(ble_device_t *dev, gatt_op_t *op) {
+    if (!dev->op_spare)
+        dev->op_spare = op;
+    else
+        free(op);
+}
+
+static int gatt_op_valid(ble_device_t *dev, int operation, int id) {
+    switch (operation) {
+        case 0: /* Read characteristic */
+        case 2: /* Write characteristic with write command */
+        case 3: /* Write characteristic with write request */
+        case 4: /* Write characteristic with prepare write */
+            return id < dev->char_count;
+
+        case 1: /* Read descriptor */
+        case 5: /* Write descriptor with write command */
+        case 6: /* Write descriptor with write request */
+        case 7: /* Write descriptor with prepare write */
+            return id < dev->desc_count;
+
+        case 8: /* Execute or cancel prepared write */
+            return 1;
+    }
+
+    return 0;
+}
+
+static int stream_tag_write(ble_device_t *dev, gatt_stream_t **tagged);
+static void stream_untag_write(ble_device_t *dev, gatt_stream_t *tagged,
+                               int slot);
+
+static bt_status_t gatt_op_submit(ble_device_t *dev, gatt_op_t *op) {
+    int id = op->id, slot = -1;
+    gatt_stream_t *tagged = NULL;
+    bt_status_t s;
+
+    /* The attributes may have been invalidated while the op was queued */
+    if (!gatt_op_valid(dev, op->operation, id))
+        return BT_STATUS_PARM_INVALID;
+
+    /* Its answer will come among the ones of the stream */
+    if (op->operation >= 2 && op->operation <= 4) {
+        slot = stream_tag_write(dev, &tagged);
+        if (slot < 0 && tagged)
+            return BT_STATUS_NOMEM;
+    }
+
+    switch (op->operation) {
+        case 0: /* Read characteristic */
+            return data.gattiface->client->read_characteristic(dev->conn_id,
+                                                            &dev->chars[id].s,
+                                                            &dev->chars[id].c,
+                                                            op->auth);
+
+        case 1: /* Read descriptor */
+            return data.gattiface->client->read_descriptor(dev->conn_id,
+                                                        &dev->descs[id].c.s,
+                                                        &dev->descs[id].c.c,
+                                                        &dev->descs[id].d,
+                                                        op->auth);
+
+        case 4: /* Write characteristic with prepare write */
+            dev->write_prepared = 1;
+            dev->prep_write_type = BLE_GATT_ELEM_CHARACTERISTIC;
+            dev->prep_write_id = id;
+            /* pass-through */
+
+        case 2: /* Write characteristic with write command */
+        case 3: /* Write characteristic with write request */
+            s = data.gattiface->client->write_characteristic(dev->conn_id,
+                                                         &dev->chars[id].s,
+                                                         &dev->chars[id].c,
+                                                         op->operation - 1,
+                                                         op->len, op->auth,
+                                                         op->value);
+            if (s != BT_STATUS_SUCCESS && slot >= 0)
+                stream_untag_write(dev, tagged, slot);
+            return s;
+
+        case 7: /* Write descriptor with prepare write */
+            dev->write_prepared = 1;
+            dev->prep_write_type = BLE_GATT_ELEM_DESCRIPTOR;
+            dev->prep_write_id = id;
+            /* pass-through */
+
+        case 5: /* Write descriptor with write command */
+        case 6: /* Write descriptor with write request */
+            return data.gattiface->client->write_descriptor(dev->conn_id,
+                                                         &dev->descs[id].c.s,
+                                                         &dev->descs[id].c.c,
+                                                         &dev->descs[id].d,
+                                                         op->operation - 4,
+                                                         op->len, op->auth,
+                                                         op->value);
+
+        case 8:
+            if (id == 0) /* Cancel prepared write */
+                dev->write_prepared = 0;
+            return data.gattiface->client->execute_write(dev->conn_id, id);
+    }
+
+    return BT_STATUS_UNSUPPORTED;
+}
+
+/* Reports the end of a long write */
+static void long_write_finish(ble_device_t *dev, gatt_op_t *op, int status) {
+    ble_gatt_write_long_cb_t cb = op->long_write;
+
+    op->long_write = NULL;
+    callback_enter(dev);
+    cb(dev->conn_id, op->id, status);
+    callback_leave(dev);
+}
+
+static void read_multiple_free(gatt_read_multiple_t *m) {
+    free(m->results);
+    free(m->offsets);
+    free(m->values);
+    free(m);
+}
+
+/* Stores the answer of one of the reads, returns 1 if it was the last one */
+static int read_multiple_store(gatt_read_multiple_t *m, int i, int status,
+                               const uint8_t *value, int len) {
+    uint8_t *values;
+    int size;
+
+    if (status == 0 && len > m->values_size - m->values_len) {
+        size = m->values_size ? m->values_size : 64;
+        while (len > size - m->values_len)
+            size *= 2;
+
+        values = realloc(m->values, size);
+        if (values) {
+            m->values = values;
+            m->values_size = size;
+        } else
+            status = -BT_STATUS_NOMEM;
+    }
+
+    m->results[i].status = status;
+    if (status == 0) {
+        if (len > 0)
+            memcpy(m->values + m->values_len, value, len);
+        m->offsets[i] = m->values_len;
+        m->results[i].len = len;
+        m->values_len += len;
+    }
+
+    return --m->pending == 0;
+}
+
+static void read_multiple_finish(ble_device_t *dev, gatt_read_multiple_t *m) {
+    int i;
+
+    /* The buffer doesn't move anymore, point the results into it */
+    for (i = 0; i < m->count; i++)
+        if (m->results[i].status == 0)
+            m->results[i].value = m->values + m->offsets[i];
+
+    callback_enter(dev);
+    m->cb(dev->conn_id, m->results, m->count);
+    callback_leave(dev);
+
+    read_multiple_free(m);
+}
+
+/* Reports an operation that couldn't be sent through its usual callback */
+static void gatt_op_fail(ble_device_t *dev, gatt_op_t *op, int status) {
+    ble_gatt_response_cb_t cb = NULL;
+    int id = op->id;
+
+    if (op->multi) {
+        if (read_multiple_store(op->multi, op->index, status, NULL, 0))
+            read_multiple_finish(dev, op->multi);
+        return;
+    }
+
+    if (op->long_write) {
+        long_write_finish(dev, op, status);
+        return;
+    }
+
+    switch (op->operation) {
+        case 0:
+            cb = data.cbs.char_read_cb;
+            break;
+        case 1:
+            cb = data.cbs.desc_read_cb;
+            break;
+        case 2:
+        case 3:
+        case 4:
+            cb = data.cbs.char_write_cb;
+            break;
+        case 5:
+        case 6:
+        case 7:
+            cb = data.cbs.desc_write_cb;
+            break;
+        case 8:
+            if (!dev->write_prepared)
+                return;
+            id = dev->prep_write_id;
+            if (dev->prep_write_type == BLE_GATT_ELEM_CHARACTERISTIC)
+                cb = data.cbs.char_write_cb;
+            else if (dev->prep_write_type == BLE_GATT_ELEM_DESCRIPTOR)
+                cb = data.cbs.desc_write_cb;
+            break;
+    }
+
+    if (cb) {
+        callback_enter(dev);
+        cb(dev->conn_id, id, NULL, 0, 0, status);
+        callback_leave(dev);
+    }
+}
+
+/* Operations to be sent again once their delay is over. Kept out of data
+ * like batch, the thread is started by the first retry. */
+typedef struct gatt_retry {
+    int conn_id;
+    uint64_t due; /* now_ms() time */
+    struct gatt_retry *next;
+} gatt_retry_t;
+
+static struct gatt_retries {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t thread_running;
+    gatt_retry_t *head; /* Sorted by due time */
+} retries = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void hal_op_retry_cb(int conn_id);
+
+static void *gatt_retry_thread(void *arg) {
+    struct timespec ts;
+    gatt_retry_t *r;
+    uint64_t now;
+
+    pthread_mutex_lock(&retries.lock);
+    for (;;) {
+        r = retries.head;
+        if (!r) {
+            pthread_cond_wait(&retries.cond, &retries.lock);
+            continue;
+        }
+
+        now = now_ms();
+        if (now < r->due) {
+            deadline_timespec(r->due - now, &ts);
+            pthread_cond_timedwait(&retries.cond, &retries.lock, &ts);
+            continue;
+        }
+
+        retries.head = r->next;
+        pthread_mutex_unlock(&retries.lock);
+        hal_op_retry_cb(r->conn_id);
+        free(r);
+        pthread_mutex_lock(&retries.lock);
+    }
+
+    return NULL;
+}
+
+/* Returns -1 if the retry couldn't be scheduled */
+static int gatt_retry_schedule(int conn_id, unsigned int delay_ms) {
+    gatt_retry_t *r, **p;
+    pthread_t thread;
+
+    r = malloc(sizeof(gatt_retry_t));
+    if (!r)
+        return -1;
+
+    r->conn_id = conn_id;
+    r->due = now_ms() + delay_ms;
+
+    pthread_mutex_lock(&retries.lock);
+    if (!retries.thread_running) {
+        if (pthread_create(&thread, NULL, gatt_retry_thread, NULL)) {
+            pthread_mutex_unlock(&retries.lock);
+            free(r);
+            return -1;
+        }
+        pthread_detach(thread);
+        retries.thread_running = 1;
+    }
+
+    for (p = &retries.head; *p && (*p)->due <= r->due; p = &(*p)->next)
+        ;
+    r->next = *p;
+    *p = r;
+    pthread_cond_signal(&retries.cond);
+    pthread_mutex_unlock(&retries.lock);
+
+    return 0;
+}
+
+/* Sends the pending operation again if the stack was busy. Returns 1 if its
+ * answer is still to come. The stack is given some time first, sent right
+ * away it would most likely still be busy. */
+static int gatt_op_retry(ble_device_t *dev, int status) {
+    gatt_op_t *op = dev->op_head;
+
+    if (!op || (status != GATT_BUSY && status != GATT_ERROR) ||
+        op->retries >= GATT_OP_MAX_RETRIES)
+        return 0;
+
+    op->retries++;
+
+    if (!gatt_retry_schedule(dev->conn_id,
+                             GATT_OP_RETRY_DELAY_MS << (op->retries - 1))) {
+        dev->op_retrying = 1;
+        return 1;
+    }
+
+    return gatt_op_submit(dev, op) == BT_STATUS_SUCCESS;
+}
+
+static void gatt_op_done(ble_device_t *dev);
+
+/* Sends the operation whose retry delay is over, from the retry thread or
+ * ble_dispatch() */
+static void gatt_op_resend(int conn_id) {
+    ble_device_t *dev;
+    gatt_op_t *op;
+    bt_status_t s;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    /* The queue may have been dropped meanwhile, e.g. by a disconnection */
+    op = dev->op_head;
+    if (!op || !dev->op_retrying)
+        goto done;
+
+    dev->op_retrying = 0;
+    s = gatt_op_submit(dev, op);
+    if (s != BT_STATUS_SUCCESS) {
+        gatt_op_fail(dev, op, -s);
+        if (op == dev->op_head)
+            gatt_op_done(dev);
+    }
+
+done:
+    unlock_device(dev);
+}
+
+/* Drops the answered operation and sends the next one */
+static void gatt_op_done(ble_device_t *dev) {
+    gatt_op_t *op;
+    bt_status_t s;
+
+    op = dev->op_head;
+    if (!op)
+        return;
+
+    while (op) {
+        dev->op_head = op->next;
+        if (!dev->op_head)
+            dev->op_tail = NULL;
+        gatt_op_release(dev, op);
+
+        op = dev->op_head;
+        if (!op)
+            break;
+
+        s = gatt_op_submit(dev, op);
+        if (s == BT_STATUS_SUCCESS)
+            break;
+
+        gatt_op_fail(dev, op, -s);
+        /* The callback may have dropped the queue, e.g. by disconnecting */
+        if (op != dev->op_head)
+            break;
+    }
+}
+
+/* Drops all the operations. Results of read_multiple calls are reported,
+ * with a -1 status for the reads not done, if report is set. */
+static void gatt_op_flush(ble_device_t *dev, int report) {
+    gatt_op_t *op, *next;
+
+    /* Taken off first, other threads may queue more during the reports */
+    op = dev->op_head;
+    dev->op_head = NULL;
+    dev->op_tail = NULL;
+    dev->op_retrying = 0;
+
+    for (; op; op = next) {
+        next = op->next;
+        if (op->multi &&
+            read_multiple_store(op->multi, op->index, -1, NULL, 0)) {
+            if (report)
+                read_multiple_finish(dev, op->multi);
+            else
+                read_multiple_free(op->multi);
+        }
+        if (op->long_write && report)
+            long_write_finish(dev, op, -1);
+        gatt_op_release(dev, op);
+    }
+}
+
+/* Called when a GATT read characteristic operation returns */
 void read_characteristic_cb(int conn_id, int status,
                             btgatt_read_params_t *p_data) {
     ble_device_t *dev;
+    gatt_read_multiple_t *m;
+    int id = -1, last;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev) {
+        if (gatt_op_retry(dev, status))
+            goto done;
+
+        /* Reads of ble_gatt_read_multiple() are reported all together */
+        if (dev->op_head && dev->op_head->multi) {
+            m = dev->op_head->multi;
+            last = read_multiple_store(m, dev->op_head->index, status,
+                                       p_data->value.value, p_data->value.len);
+            gatt_op_done(dev);
+            if (last)
+                read_multiple_finish(dev, m);
+            goto done;
+        }
+
+        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    }
+
+    /* The operation stays at the head of the queue meanwhile */
+    callback_enter(dev);
+    if (data.cbs.char_read_cb)
+        data.cbs.char_read_cb(conn_id, id, p_data->value.value,
+                              p_data->value.len, p_data->value_type, status);
+    callback_leave(dev);
+
+    if (dev)
+        gatt_op_done(dev);
+
+done:
+    unlock_device(dev);
+}
+
+/* Called when a GATT read descriptor operation returns */
+static void read_descriptor_cb(int conn_id, int status,
+                               btgatt_read_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev) {
+        if (gatt_op_retry(dev, status)) {
+            unlock_device(dev);
+            return;
+        }
+        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
+                             &p_data->descr_id);
+    }
+
+    callback_enter(dev);
+    if (data.cbs.desc_read_cb)
+        data.cbs.desc_read_cb(conn_id, id, p_data->value.value,
+                              p_data->value.len, p_data->value_type, status);
+    callback_leave(dev);
+
+    if (dev) {
+        gatt_op_done(dev);
+        unlock_device(dev);
+    }
+}
+
+/* Called with stream_lock held. Returns the ring slot of the write, or -1 if
+ * the ring is full and couldn't grow. */
+static int stream_push_write(gatt_stream_t *st, int len) {
+    int *writes;
+    int i, slot;
+
+    if (st->write_count == st->write_size) {
+        writes = malloc(st->write_size * 2 * sizeof(int));
+        if (!writes)
+            return -1;
+
+        for (i = 0; i < st->write_count; i++)
+            writes[i] = st->writes[(st->write_head + i) % st->write_size];
+
+        free(st->writes);
+        st->writes = writes;
+        st->write_size *= 2;
+        st->write_head = 0;
+    }
+
+    slot = (st->write_head + st->write_count) % st->write_size;
+    st->writes[slot] = len;
+    st->write_count++;
+
+    return slot;
+}
+
+/* Called with stream_lock held. Takes a write that failed to be sent off the
+ * ring, the ones pushed after it move back a slot. Writes are sent with the
+ * device locked, so those have already been sent or dropped. */
+static void stream_drop_write(gatt_stream_t *st, int slot) {
+    int i = (slot - st->write_head + st->write_size) % st->write_size;
+
+    for (; i < st->write_count - 1; i++)
+        st->writes[(st->write_head + i) % st->write_size] =
+            st->writes[(st->write_head + i + 1) % st->write_size];
+
+    st->write_count--;
+}
+
+/* Reports the end of a stream already detached from its device. Called
+ * without stream_lock, the callback may start another stream. */
+static void stream_finish(ble_device_t *dev, gatt_stream_t *st) {
+    uint64_t elapsed = now_us() - st->start_us;
+    uint32_t rate = 0;
+
+    if (elapsed > 0)
+        rate = st->sent * 1000000 / elapsed;
+
+    callback_enter(dev);
+    st->cb(dev->conn_id, st->char_id, st->sent, rate, st->status);
+    callback_leave(dev);
+
+    free(st->writes);
+    free(st);
+}
+
+/* Called with stream_lock held. Detaches the stream and returns it if it's
+ * over, so the caller finishes it once the lock is released. */
+static gatt_stream_t *stream_done(ble_device_t *dev) {
+    gatt_stream_t *st = dev->stream;
+
+    if (st->filling || !(st->eof || st->status))
+        return NULL;
+
+    if (st->in_flight && !st->disconnected)
+        return NULL;
+
+    dev->stream = NULL;
+
+    return st;
+}
+
+/* Sends write commands until the credits run out. Called with stream_lock
+ * held, which is released while calling the producer and the stack, whose
+ * answers may come from another thread or from within the call. Only one
+ * caller fills at a time, the others leave it the credits they return. */
+static gatt_stream_t *stream_fill(ble_device_t *dev) {
+    gatt_stream_t *st = dev->stream;
+    ble_gatt_char_t *c;
+    const char *chunk;
+    bt_status_t s;
+    int n, slot;
+
+    if (st->filling)
+        return NULL;
+
+    st->filling = 1;
+    while (st->in_flight < st->credits && !st->eof && !st->status) {
+        if (st->value) {
+            n = st->len - st->offset;
+            if (n > BLE_GATT_STREAM_CHUNK)
+                n = BLE_GATT_STREAM_CHUNK;
+            chunk = st->value + st->offset;
+        } else {
+            pthread_mutex_unlock(&stream_lock);
+            callback_enter(dev);
+            n = st->producer(dev->conn_id, st->char_id, st->chunk,
+                             BLE_GATT_STREAM_CHUNK);
+            callback_leave(dev);
+            pthread_mutex_lock(&stream_lock);
+            if (n > BLE_GATT_STREAM_CHUNK)
+                n = -1;
+            chunk = st->chunk;
+        }
+
+        if (n <= 0) {
+            if (n < 0 && !st->status)
+                st->status = -1;
+            st->eof = 1;
+            break;
+        }
+
+        slot = stream_push_write(st, n);
+        if (slot < 0) {
+            if (!st->status)
+                st->status = -BT_STATUS_NOMEM;
+            break;
+        }
+        st->offset += n;
+        st->in_flight++;
+
+        /* Bluedroid copies the value, the chunk may be reused right away */
+        c = &dev->chars[st->char_id];
+        pthread_mutex_unlock(&stream_lock);
+        s = data.gattiface->client->write_characteristic(dev->conn_id, &c->s,
+                                                         &c->c, 1, n, 0,
+                                                         (char *) chunk);
+        pthread_mutex_lock(&stream_lock);
+        if (s != BT_STATUS_SUCCESS) {
+            stream_drop_write(st, slot); /* Never answered */
+            st->in_flight--;
+            if (!st->status)
+                st->status = -s;
+            break;
+        }
+    }
+    st->filling = 0;
+
+    return stream_done(dev);
+}
+
+/* Takes the answer of the oldest characteristic write in flight if it
+ * belongs to the stream. Returns 1 if it did. */
+static int stream_answer(ble_device_t *dev, int status) {
+    gatt_stream_t *st, *done = NULL;
+    int len = 0;
+
+    pthread_mutex_lock(&stream_lock);
+    st = dev->stream;
+    if (st && st->write_count) {
+        len = st->writes[st->write_head];
+        st->write_head = (st->write_head + 1) % st->write_size;
+        st->write_count--;
+    }
+
+    if (len > 0) {
+        st->in_flight--;
+        if (status == 0)
+            st->sent += len;
+        else if (!st->status)
+            st->status = status;
+
+        done = stream_fill(dev);
+    }
+    pthread_mutex_unlock(&stream_lock);
+
+    if (done)
+        stream_finish(dev, done);
+
+    return len > 0;
+}
+
+/* Accounts for a write of the operation queue among the answers of the
+ * stream. Returns the ring slot of the write, or -1 if there's no stream or
+ * it couldn't be accounted for (tagged is then set). */
+static int stream_tag_write(ble_device_t *dev, gatt_stream_t **tagged) {
+    int slot = -1;
+
+    pthread_mutex_lock(&stream_lock);
+    *tagged = dev->stream;
+    if (*tagged)
+        slot = stream_push_write(*tagged, 0);
+    pthread_mutex_unlock(&stream_lock);
+
+    return slot;
+}
+
+/* A write tagged by stream_tag_write() failed to be sent */
+static void stream_untag_write(ble_device_t *dev, gatt_stream_t *tagged,
+                               int slot) {
+    pthread_mutex_lock(&stream_lock);
+    if (dev->stream && dev->stream == tagged)
+        stream_drop_write(tagged, slot);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+/* The device disconnected, its writes in flight won't be answered */
+static void stream_abort(ble_device_t *dev) {
+    gatt_stream_t *st;
+
+    pthread_mutex_lock(&stream_lock);
+    st = dev->stream;
+    if (st) {
+        st->status = -1;
+        st->disconnected = 1;
+        st = stream_done(dev);
+    }
+    pthread_mutex_unlock(&stream_lock);
+
+    if (st)
+        stream_finish(dev, st);
+}
+
+int ble_gatt_stream_char(int conn_id, int char_id, const char *value, int len,
+                         ble_gatt_stream_producer_t producer, int credits,
+                         ble_gatt_stream_cb_t cb) {
+    ble_device_t *dev;
+    gatt_stream_t *st, *done;
+    gatt_op_t *op;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if ((!value || len < 0) && !producer)
+        return -1;
+
+    if (credits <= 0 || !cb)
+        return -1;
+
+    st = calloc(1, sizeof(gatt_stream_t));
+    if (!st)
+        return -1;
+
+    /* The stream's writes, and the one of the queue in flight */
+    st->write_size = credits + 1;
+    st->writes = malloc(st->write_size * sizeof(int));
+    if (!st->writes) {
+        free(st);
+        return -1;
+    }
+
+    st->cb = cb;
+    st->producer = value ? NULL : producer;
+    st->value = value;
+    st->len = len;
+    st->char_id = char_id;
+    st->credits = credits;
+    st->start_us = now_us();
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev || char_id < 0 || char_id >= dev->char_count) {
+        unlock_device(dev);
+        free(st->writes);
+        free(st);
+        return -1;
+    }
+
+    pthread_mutex_lock(&stream_lock);
+    if (dev->stream) {
+        pthread_mutex_unlock(&stream_lock);
+        unlock_device(dev);
+        free(st->writes);
+        free(st);
+        return -1;
+    }
+
+    /* A characteristic write of the queue may already be in flight */
+    op = dev->op_head;
+    if (op && op->operation >= 2 && op->operation <= 4)
+        stream_push_write(st, 0);
+
+    dev->stream = st;
+    done = stream_fill(dev);
+    pthread_mutex_unlock(&stream_lock);
+
+    if (done)
+        stream_finish(dev, done);
+
+    unlock_device(dev);
+
+    return 0;
+}
+
+int ble_gatt_stream_cancel(int conn_id) {
+    ble_device_t *dev;
+    gatt_stream_t *st;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    /* The writes in flight are still waited for */
+    pthread_mutex_lock(&stream_lock);
+    st = dev->stream;
+    if (st) {
+        st->eof = 1;
+        if (!st->status)
+            st->status = -1;
+        st = stream_done(dev);
+    } else
+        conn_id = -1;
+    pthread_mutex_unlock(&stream_lock);
+
+    if (st)
+        stream_finish(dev, st);
+
+    unlock_device(dev);
+
+    return conn_id < 0 ? -1 : 0;
+}
+
+/* Called when a GATT write characteristic operation returns */
+static void write_characteristic_cb(int conn_id, int status,
+                                    btgatt_write_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev) {
+        if (stream_answer(dev, status) || gatt_op_retry(dev, status))
+            goto done;
+
+        if (dev->op_head && dev->op_head->long_write) {
+            long_write_finish(dev, dev->op_head, status);
+            gatt_op_done(dev);
+            goto done;
+        }
+
+        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    }
+
+    callback_enter(dev);
+    if (data.cbs.char_write_cb)
+        data.cbs.char_write_cb(conn_id, id, NULL, 0, 0, status);
+    callback_leave(dev);
+
+    if (dev)
+        gatt_op_done(dev);
+
+done:
+    unlock_device(dev);
+}
+
+/* Called when a GATT write descriptor operation returns */
+static void write_descriptor_cb(int conn_id, int status,
+                                btgatt_write_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev) {
+        if (gatt_op_retry(dev, status)) {
+            unlock_device(dev);
+            return;
+        }
+        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
+                             &p_data->descr_id);
+    }
+
+    callback_enter(dev);
+    if (data.cbs.desc_write_cb)
+        data.cbs.desc_write_cb(conn_id, id, NULL, 0, 0, status);
+    callback_leave(dev);
+
+    if (dev) {
+        gatt_op_done(dev);
+        unlock_device(dev);
+    }
+}
+
+static void execute_write_cb(int conn_id, int status) {
+    ble_device_t *dev;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    if (gatt_op_retry(dev, status))
+        goto done;
+
+    if (dev->write_prepared) {
+        gatt_elem_t type = dev->prep_write_type;
+        int id = dev->prep_write_id;
+
+        callback_enter(dev);
+        if (type == BLE_GATT_ELEM_CHARACTERISTIC && data.cbs.char_write_cb)
+            data.cbs.char_write_cb(conn_id, id, NULL, 0, 0, status);
+        else if (type == BLE_GATT_ELEM_DESCRIPTOR && data.cbs.desc_write_cb)
+            data.cbs.desc_write_cb(conn_id, id, NULL, 0, 0, status);
+        callback_leave(dev);
+    }
+
+    gatt_op_done(dev);
+
+done:
+    unlock_device(dev);
+}
+
+static int ble_gatt_op(int operation, int conn_id, int id, int auth,
+                       const char *value, int len) {
+    ble_device_t *dev;
+    gatt_op_t *op;
+    bt_status_t s;
+    int ret = 0;
+
+    if (id < 0)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (len < 0 || (len > 0 && !value))
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (!gatt_op_valid(dev, operation, id)) {
+        ret = -1;
+        goto done;
+    }
+
+    op = gatt_op_alloc(dev, len);
+    if (!op) {
+        ret = -1;
+        goto done;
+    }
+
+    op->operation = operation;
+    op->id = id;
+    op->auth = auth;
+    op->len = len;
+    op->retries = 0;
+    op->multi = NULL;
+    op->long_write = NULL;
+    if (len > 0)
+        memcpy(op->value, value, len);
+    op->next = NULL;
+
+    if (dev->op_tail)
+        dev->op_tail->next = op;
+    else
+        dev->op_head = op;
+    dev->op_tail = op;
+
+    /* Queued operations are sent as the ones before them are answered */
+    if (dev->op_head != op)
+        goto done;
+
+    s = gatt_op_submit(dev, op);
+    if (s != BT_STATUS_SUCCESS) {
+        dev->op_head = NULL;
+        dev->op_tail = NULL;
+        gatt_op_release(dev, op);
+        ret = -s;
+    }
+
+done:
+    unlock_device(dev);
+
+    return ret;
+}
+
+int ble_gatt_read_char(int conn_id, int char_id, int auth) {
+    return ble_gatt_op(0, conn_id, char_id, auth, NULL, 0);
+}
+
+int ble_gatt_read_multiple(int conn_id, const int *char_ids, int count,
+                           int auth, ble_gatt_read_multiple_cb_t cb) {
+    ble_device_t *dev;
+    gatt_read_multiple_t *m;
+    gatt_op_t *first = NULL, *last = NULL, *op;
+    bt_status_t s;
+    int i;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!char_ids || count <= 0 || !cb)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        if (char_ids[i] < 0 || !gatt_op_valid(dev, 0, char_ids[i])) {
+            unlock_device(dev);
+            return -1;
+        }
+
+    m = calloc(1, sizeof(gatt_read_multiple_t));
+    if (!m) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    m->cb = cb;
+    m->count = count;
+    m->pending = count;
+    m->results = calloc(count, sizeof(ble_gatt_read_result_t));
+    m->offsets = calloc(count, sizeof(int));
+    if (!m->results || !m->offsets)
+        goto fail;
+
+    for (i = 0; i < count; i++) {
+        m->results[i].char_id = char_ids[i];
+
+        op = gatt_op_alloc(dev, 0);
+        if (!op)
+            goto fail;
+
+        op->operation = 0;
+        op->id = char_ids[i];
+        op->auth = auth;
+        op->len = 0;
+        op->retries = 0;
+        op->multi = m;
+        op->index = i;
+        op->long_write = NULL;
+        op->next = NULL;
+
+        if (last)
+            last->next = op;
+        else
+            first = op;
+        last = op;
+    }
+
+    /* All the reads go in a row, right after the already queued operations */
+    if (dev->op_tail) {
+        dev->op_tail->next = first;
+        dev->op_tail = last;
+        unlock_device(dev);
+        return 0;
+    }
+
+    dev->op_head = first;
+    dev->op_tail = last;
+
+    s = gatt_op_submit(dev, first);
+    if (s != BT_STATUS_SUCCESS) {
+        dev->op_head = NULL;
+        dev->op_tail = NULL;
+        for (op = first; op; op = first) {
+            first = op->next;
+            gatt_op_release(dev, op);
+        }
+        read_multiple_free(m);
+        unlock_device(dev);
+        return -s;
+    }
+
+    unlock_device(dev);
+
+    return 0;
+
+fail:
+    for (op = first; op; op = first) {
+        first = op->next;
+        gatt_op_release(dev, op);
+    }
+    read_multiple_free(m);
+    unlock_device(dev);
+
+    return -1;
+}
+
+int ble_gatt_write_long_char(int conn_id, int char_id, int auth,
+                             const char *value, int len,
+                             ble_gatt_write_long_cb_t cb) {
+    ble_device_t *dev;
+    gatt_op_t *op;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!value || len <= 0 || len > BTGATT_MAX_ATTR_LEN || !cb)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (char_id < 0 || !gatt_op_valid(dev, 3, char_id)) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    op = gatt_op_alloc(dev, len);
+    if (!op) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    /* A single write request, the stack sends it as prepared writes at
+     * increasing offsets followed by the execute when it doesn't fit in the
+     * MTU. The HAL's own prepared writes have no offset, they can't be used
+     * to split the value here. */
+    op->operation = 3;
+    op->id = char_id;
+    op->auth = auth;
+    op->len = len;
+    op->retries = 0;
+    op->multi = NULL;
+    op->long_write = cb;
+    memcpy(op->value, value, len);
+    op->next = NULL;
+
+    if (dev->op_tail) {
+        dev->op_tail->next = op;
+        dev->op_tail = op;
+        unlock_device(dev);
+        return 0;
+    }
+
+    dev->op_head = op;
+    dev->op_tail = op;
+
+    s = gatt_op_submit(dev, op);
+    if (s != BT_STATUS_SUCCESS) {
+        dev->op_head = NULL;
+        dev->op_tail = NULL;
+        gatt_op_release(dev, op);
+        unlock_device(dev);
+        return -s;
+    }
+
+    unlock_device(dev);
+
+    return 0;
+}
+
+int ble_gatt_read_desc(int conn_id, int desc_id, int auth) {
+    return ble_gatt_op(1, conn_id, desc_id, auth, NULL, 0);
+}
+
+int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(2, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(3, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(5, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(6, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
+                             const char *value, int len) {
+    return ble_gatt_op(4, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
+                             const char *value, int len) {
+    return ble_gatt_op(7, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_execute_write(int conn_id, int execute) {
+    return ble_gatt_op(8, conn_id, execute, 0, NULL, 0);
+}
+
+/* Called when the registration for notifications on a char finishes */
+static void register_for_notification_cb(int conn_id, int registered,
+                                         int status,
+                                         btgatt_srvc_id_t *srvc_id,
+                                         btgatt_char_id_t *char_id) {
+    ble_device_t *dev;
     int id = -1;
 
-    dev = find_device_by_conn_id(conn_id);
+    dev = lock_device_by_conn_id(conn_id);
     if (dev)
-        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+        id = find_characteristic(dev, srvc_id, char_id);
+    unlock_device(dev);
 
-    if (data.cbs.char_read_cb)
-        data.cbs.char_read_cb(conn_id, id, p_data->value.value,
-                              p_data->value.len, p_data->value_type, status);
+    if (data.cbs.char_notification_register_cb)
+        data.cbs.char_notification_register_cb(conn_id, id, registered, status);
 }
 
-/* Called when a GATT read descriptor operation returns */
-static void read_descriptor_cb(int conn_id, int status,
-                               btgatt_read_params_t *p_data) {
+/* Called when notifications of a characteristic are received */
+void notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
+    ble_gatt_notification_cb_t cb = data.cbs.char_notification_cb;
     ble_device_t *dev;
     int id = -1;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
-                             &p_data->descr_id);
+    /* The handler runs unlocked, notifications don't change the device */
+    dev = lock_device_by_conn_id(conn_id);
+    if (dev) {
+        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+        if (id >= 0 && id < dev->notif_handler_count &&
+            dev->notif_handlers[id])
+            cb = dev->notif_handlers[id];
+        unlock_device(dev);
+    }
+
+    if (notif_ring_push(conn_id, id, p_data))
+        return;
+
+    if (cb)
+        cb(conn_id, id, p_data->value, p_data->len, !p_data->is_notify);
+}
+
+int ble_gatt_set_char_notification_handler(int conn_id, int char_id,
+                                           ble_gatt_notification_cb_t handler) {
+    ble_device_t *dev;
+
+    if (char_id < 0)
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (char_id >= dev->char_count) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    if (char_id >= dev->notif_handler_count) {
+        ble_gatt_notification_cb_t *h;
+
+        if (!handler) {
+            unlock_device(dev);
+            return 0;
+        }
+
+        /* Sized after the characteristic table, so it rarely grows again */
+        h = realloc(dev->notif_handlers,
+                    dev->char_alloc * sizeof(ble_gatt_notification_cb_t));
+        if (!h) {
+            unlock_device(dev);
+            return -1;
+        }
+
+        memset(h + dev->notif_handler_count, 0,
+               (dev->char_alloc - dev->notif_handler_count) *
+               sizeof(ble_gatt_notification_cb_t));
+        dev->notif_handlers = h;
+        dev->notif_handler_count = dev->char_alloc;
+    }
+
+    dev->notif_handlers[char_id] = handler;
+    unlock_device(dev);
+
+    return 0;
+}
+
+static int ble_gatt_char_notification(uint8_t operation, int conn_id,
+                                      int char_id) {
+    ble_device_t *dev;
+    bt_status_t s = BT_STATUS_UNSUPPORTED;
+    btgatt_srvc_id_t *srvc;
+    btgatt_char_id_t *ch;
+    int client;
+
+    if (char_id < 0)
+        return -1;
+
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
+        return -1;
+
+    dev = lock_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (char_id >= dev->char_count) {
+        unlock_device(dev);
+        return -1;
+    }
+
+    srvc = &dev->chars[char_id].s;
+    ch = &dev->chars[char_id].c;
+
+    switch (operation) {
+        case 0:
+            s = data.gattiface->client->register_for_notification(client,
+                                                                  &dev->bda,
+                                                                  srvc, ch);
+            break;
+        case 1:
+            s = data.gattiface->client->deregister_for_notification(client,
+                                                                    &dev->bda,
+                                                                    srvc, ch);
+            break;
+    }
+
+    unlock_device(dev);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+int ble_gatt_register_char_notification(int conn_id, int char_id) {
+    return ble_gatt_char_notification(0, conn_id, char_id);
+}
+
+int ble_gatt_unregister_char_notification(int conn_id, int char_id) {
+    return ble_gatt_char_notification(1, conn_id, char_id);
+}
+
+/* Called when the client registration is finished */
+static void register_client_cb(int status, int client_if, bt_uuid_t *app_uuid) {
+    if (status == BT_STATUS_SUCCESS) {
+        __atomic_store_n(&data.client, client_if, __ATOMIC_RELEASE);
+        if (data.cbs.enable_cb)
+            data.cbs.enable_cb();
+    } else
+        __atomic_store_n(&data.client, 0, __ATOMIC_RELEASE);
+}
+
+static void adapter_state_changed_cb(bt_state_t state);
+
+/* Stack callbacks deferred to ble_dispatch(), with copies of their
+ * arguments */
+typedef enum {
+    EV_ADAPTER_STATE,
+    EV_BOND_STATE,
+    EV_REGISTER_CLIENT,
+    EV_SCAN_RESULT,
+    EV_CONNECT,
+    EV_DISCONNECT,
+    EV_SEARCH_COMPLETE,
+    EV_SEARCH_RESULT,
+    EV_CHARACTERISTIC,
+    EV_DESCRIPTOR,
+    EV_INCLUDED_SERVICE,
+    EV_REGISTER_NOTIFICATION,
+    EV_NOTIFY,
+    EV_READ_CHAR,
+    EV_WRITE_CHAR,
+    EV_READ_DESC,
+    EV_WRITE_DESC,
+    EV_EXECUTE_WRITE,
+    EV_RSSI,
+    EV_OP_RETRY,
+} hal_event_type_t;
+
+typedef struct hal_event {
+    hal_event_type_t type;
+    int id; /* conn_id, or client_if */
+    int status;
+    int arg;
+    bt_bdaddr_t bda;
+    bt_uuid_t uuid;
+    btgatt_srvc_id_t srvc_id;
+    btgatt_srvc_id_t incl_srvc_id;
+    btgatt_char_id_t char_id;
+    union {
+        uint8_t adv_data[BLE_ADV_DATA_LEN];
+        btgatt_notify_params_t notify;
+        btgatt_read_params_t read;
+        btgatt_write_params_t write;
+    } p;
+    struct hal_event *next;
+} hal_event_t;
+
+/* Dispatched events kept for reuse, the others are freed */
+#define EVENTS_SPARE_MAX 64
+/* Events set aside for answers, which can't be dropped */
+#define EVENTS_RESERVED 32
+
+/* Events waiting for ble_dispatch(). Kept out of data because the event fd
+ * outlives ble_enable(). */
+static struct hal_events {
+    pthread_mutex_t lock;
+    int fd; /* -1 while callbacks are delivered from the stack thread */
+    hal_event_t *head;
+    hal_event_t *tail;
+    hal_event_t *spare; /* Dispatched events, reused */
+    int spare_count;
+    hal_event_t *reserve; /* Only taken when allocation fails */
+    int reserve_count;
+    pthread_cond_t reserve_cond; /* Signaled when the reserve is refilled */
+    uint8_t dispatching;
+    pthread_t dispatcher;
+    unsigned long drops; /* Events that couldn't be allocated */
+} events = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .reserve_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Whether callbacks are queued for ble_dispatch() instead of run right away */
+static int events_queued() {
+    return __atomic_load_n(&events.fd, __ATOMIC_ACQUIRE) >= 0;
+}
+
+/* Scan reports and notifications may be lost, the other events answer
+ * operations or change the state of a device */
+static int event_droppable(hal_event_type_t type) {
+    return type == EV_SCAN_RESULT || type == EV_NOTIFY;
+}
+
+/* Returns NULL if the event couldn't be allocated, it's then dropped: running
+ * its callback here would break the order of the events and the thread they
+ * are delivered on. The others come from the reserve, waiting for
+ * ble_dispatch() to give events back if it's empty. */
+static hal_event_t *event_new(hal_event_type_t type) {
+    hal_event_t *ev;
+
+    pthread_mutex_lock(&events.lock);
+    ev = events.spare;
+    if (ev) {
+        events.spare = ev->next;
+        events.spare_count--;
+    }
+    pthread_mutex_unlock(&events.lock);
+
+    if (!ev)
+        ev = malloc(sizeof(hal_event_t));
+
+    if (!ev && !event_droppable(type)) {
+        pthread_mutex_lock(&events.lock);
+        /* Nothing comes back while this thread is dispatching */
+        while (!events.reserve && !(events.dispatching &&
+               pthread_equal(events.dispatcher, pthread_self())))
+            pthread_cond_wait(&events.reserve_cond, &events.lock);
+        ev = events.reserve;
+        if (ev) {
+            events.reserve = ev->next;
+            events.reserve_count--;
+        }
+        pthread_mutex_unlock(&events.lock);
+    }
+
+    if (!ev) {
+        __atomic_fetch_add(&events.drops, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    ev->type = type;
+
+    return ev;
+}
+
+/* Refills the reserve, then keeps up to EVENTS_SPARE_MAX events for reuse
+ * and frees the rest, so a burst doesn't pin its memory */
+static void events_recycle(hal_event_t *ev) {
+    hal_event_t *next, *drop = NULL;
+
+    pthread_mutex_lock(&events.lock);
+    if (ev && events.reserve_count < EVENTS_RESERVED)
+        pthread_cond_broadcast(&events.reserve_cond);
+
+    for (; ev; ev = next) {
+        next = ev->next;
+        if (events.reserve_count < EVENTS_RESERVED) {
+            ev->next = events.reserve;
+            events.reserve = ev;
+            events.reserve_count++;
+        } else if (events.spare_count < EVENTS_SPARE_MAX) {
+            ev->next = events.spare;
+            events.spare = ev;
+            events.spare_count++;
+        } else {
+            ev->next = drop;
+            drop = ev;
+        }
+    }
+    pthread_mutex_unlock(&events.lock);
+
+    for (; drop; drop = next) {
+        next = drop->next;
+        free(drop);
+    }
+}
+
+/* The fd is only written when the queue becomes non-empty, ble_dispatch()
+ * takes all the events queued since */
+static void event_post(hal_event_t *ev) {
+    uint64_t one = 1;
+    int was_empty;
+
+    ev->next = NULL;
+
+    pthread_mutex_lock(&events.lock);
+    was_empty = !events.head;
+    if (events.tail)
+        events.tail->next = ev;
+    else
+        events.head = ev;
+    events.tail = ev;
+    pthread_mutex_unlock(&events.lock);
+
+    if (was_empty && write(events.fd, &one, sizeof(one)) < 0)
+        perror("write event fd");
+}
+
+static void event_run(hal_event_t *ev) {
+    switch (ev->type) {
+        case EV_ADAPTER_STATE:
+            adapter_state_changed_cb(ev->arg);
+            break;
+        case EV_BOND_STATE:
+            bond_state_changed_cb(ev->status, &ev->bda, ev->arg);
+            break;
+        case EV_REGISTER_CLIENT:
+            register_client_cb(ev->status, ev->id, &ev->uuid);
+            break;
+        case EV_SCAN_RESULT:
+            scan_result_cb(&ev->bda, ev->arg, ev->p.adv_data);
+            break;
+        case EV_CONNECT:
+            connect_cb(ev->id, ev->status, ev->arg, &ev->bda);
+            break;
+        case EV_DISCONNECT:
+            disconnect_cb(ev->id, ev->status, ev->arg, &ev->bda);
+            break;
+        case EV_SEARCH_COMPLETE:
+            service_discovery_complete_cb(ev->id, ev->status);
+            break;
+        case EV_SEARCH_RESULT:
+            service_discovery_result_cb(ev->id, &ev->srvc_id);
+            break;
+        case EV_CHARACTERISTIC:
+            characteristic_discovery_cb(ev->id, ev->status, &ev->srvc_id,
+                                        &ev->char_id, ev->arg);
+            break;
+        case EV_DESCRIPTOR:
+            descriptor_discovery_cb(ev->id, ev->status, &ev->srvc_id,
+                                    &ev->char_id, &ev->uuid);
+            break;
+        case EV_INCLUDED_SERVICE:
+            get_included_service_cb(ev->id, ev->status, &ev->srvc_id,
+                                    &ev->incl_srvc_id);
+            break;
+        case EV_REGISTER_NOTIFICATION:
+            register_for_notification_cb(ev->id, ev->arg, ev->status,
+                                         &ev->srvc_id, &ev->char_id);
+            break;
+        case EV_NOTIFY:
+            notify_cb(ev->id, &ev->p.notify);
+            break;
+        case EV_READ_CHAR:
+            read_characteristic_cb(ev->id, ev->status, &ev->p.read);
+            break;
+        case EV_WRITE_CHAR:
+            write_characteristic_cb(ev->id, ev->status, &ev->p.write);
+            break;
+        case EV_READ_DESC:
+            read_descriptor_cb(ev->id, ev->status, &ev->p.read);
+            break;
+        case EV_WRITE_DESC:
+            write_descriptor_cb(ev->id, ev->status, &ev->p.write);
+            break;
+        case EV_EXECUTE_WRITE:
+            execute_write_cb(ev->id, ev->status);
+            break;
+        case EV_RSSI:
+            read_remote_rssi_cb(ev->id, &ev->bda, ev->arg, ev->status);
+            break;
+        case EV_OP_RETRY:
+            gatt_op_resend(ev->id);
+            break;
+    }
+}
+
+/* Drops the events of a previous session */
+static void events_discard() {
+    hal_event_t *ev;
+    uint64_t count;
+
+    pthread_mutex_lock(&events.lock);
+    ev = events.head;
+    events.head = NULL;
+    events.tail = NULL;
+    pthread_mutex_unlock(&events.lock);
+
+    events_recycle(ev);
+
+    if (events_queued() && read(events.fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN)
+        perror("read event fd");
+}
+
+int ble_get_event_fd() {
+    hal_event_t *ev;
+    int fd;
+
+    pthread_mutex_lock(&events.lock);
+    while (events.reserve_count < EVENTS_RESERVED) {
+        ev = malloc(sizeof(hal_event_t));
+        if (!ev)
+            break;
+        ev->next = events.reserve;
+        events.reserve = ev;
+        events.reserve_count++;
+    }
+
+    fd = events.fd;
+    if (fd < 0 && events.reserve_count == EVENTS_RESERVED) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        /* Read without the lock, it's only set once */
+        __atomic_store_n(&events.fd, fd, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&events.lock);
+
+    return fd;
+}
+
+int ble_dispatch(int max_events) {
+    hal_event_t *batch, *last, *ev;
+    uint64_t count, one = 1;
+    int n = 1, more;
+
+    if (!events_queued())
+        return -1;
+
+    /* Read before taking the events, so a later post writes the fd again */
+    if (read(events.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+
+    pthread_mutex_lock(&events.lock);
+    batch = events.head;
+    if (!batch) {
+        pthread_mutex_unlock(&events.lock);
+        return 0;
+    }
+
+    for (last = batch; last->next && (max_events <= 0 || n < max_events);
+         last = last->next)
+        n++;
+
+    events.head = last->next;
+    if (!events.head)
+        events.tail = NULL;
+    more = events.head != NULL;
+    last->next = NULL;
+    pthread_mutex_unlock(&events.lock);
+
+    /* Keep the fd readable for the events left */
+    if (more && write(events.fd, &one, sizeof(one)) < 0)
+        perror("write event fd");
+
+    pthread_mutex_lock(&events.lock);
+    events.dispatching = 1;
+    events.dispatcher = pthread_self();
+    pthread_mutex_unlock(&events.lock);
+
+    for (ev = batch; ev; ev = ev->next)
+        event_run(ev);
+
+    pthread_mutex_lock(&events.lock);
+    events.dispatching = 0;
+    pthread_mutex_unlock(&events.lock);
+
+    events_recycle(batch);
+
+    return n;
+}
+
+unsigned long ble_dispatch_drops() {
+    return __atomic_load_n(&events.drops, __ATOMIC_RELAXED);
+}
+
+/* The functions registered with the stack, which run the callbacks right
+ * away or queue them for ble_dispatch(). Scan reports and notifications
+ * that can't be allocated are dropped, see ble_dispatch_drops(). */
+static void hal_register_client_cb(int status, int client_if,
+                                   bt_uuid_t *app_uuid) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        register_client_cb(status, client_if, app_uuid);
+        return;
+    }
+
+    ev = event_new(EV_REGISTER_CLIENT);
+    if (!ev)
+        return;
+
+    ev->status = status;
+    ev->id = client_if;
+    ev->uuid = *app_uuid;
+    event_post(ev);
+}
+
+static void hal_scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        scan_result_cb(bda, rssi, adv_data);
+        return;
+    }
+
+    ev = event_new(EV_SCAN_RESULT);
+    if (!ev)
+        return;
+
+    ev->bda = *bda;
+    ev->arg = rssi;
+    memcpy(ev->p.adv_data, adv_data, BLE_ADV_DATA_LEN);
+    event_post(ev);
+}
+
+static void hal_connect_cb(int conn_id, int status, int client_if,
+                           bt_bdaddr_t *bda) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        connect_cb(conn_id, status, client_if, bda);
+        return;
+    }
+
+    ev = event_new(EV_CONNECT);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->status = status;
+    ev->arg = client_if;
+    ev->bda = *bda;
+    event_post(ev);
+}
+
+static void hal_disconnect_cb(int conn_id, int status, int client_if,
+                              bt_bdaddr_t *bda) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        disconnect_cb(conn_id, status, client_if, bda);
+        return;
+    }
+
+    ev = event_new(EV_DISCONNECT);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->status = status;
+    ev->arg = client_if;
+    ev->bda = *bda;
+    event_post(ev);
+}
+
+static void hal_search_complete_cb(int conn_id, int status) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        service_discovery_complete_cb(conn_id, status);
+        return;
+    }
 
-    if (data.cbs.desc_read_cb)
-        data.cbs.desc_read_cb(conn_id, id, p_data->value.value,
-                              p_data->value.len, p_data->value_type, status);
+    ev = event_new(EV_SEARCH_COMPLETE);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->status = status;
+    event_post(ev);
 }
 
-/* Called when a GATT write characteristic operation returns */
-static void write_characteristic_cb(int conn_id, int status,
-                                    btgatt_write_params_t *p_data) {
-    ble_device_t *dev;
-    int id = -1;
+static void hal_search_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
+    hal_event_t *ev;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    if (!events_queued()) {
+        service_discovery_result_cb(conn_id, srvc_id);
+        return;
+    }
 
-    if (data.cbs.char_write_cb)
-        data.cbs.char_write_cb(conn_id, id, NULL, 0, 0, status);
+    ev = event_new(EV_SEARCH_RESULT);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->srvc_id = *srvc_id;
+    event_post(ev);
 }
 
-/* Called when a GATT write descriptor operation returns */
-static void write_descriptor_cb(int conn_id, int status,
-                                btgatt_write_params_t *p_data) {
-    ble_device_t *dev;
-    int id = -1;
+static void hal_characteristic_cb(int conn_id, int status,
+                                  btgatt_srvc_id_t *srvc_id,
+                                  btgatt_char_id_t *char_id, int char_prop) {
+    hal_event_t *ev;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
-                             &p_data->descr_id);
+    if (!events_queued()) {
+        characteristic_discovery_cb(conn_id, status, srvc_id, char_id,
+                                    char_prop);
+        return;
+    }
 
-    if (data.cbs.desc_write_cb)
-        data.cbs.desc_write_cb(conn_id, id, NULL, 0, 0, status);
+    ev = event_new(EV_CHARACTERISTIC);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->status = status;
+    ev->srvc_id = *srvc_id;
+    ev->char_id = *char_id;
+    ev->arg = char_prop;
+    event_post(ev);
 }
 
-static void execute_write_cb(int conn_id, int status) {
-    ble_device_t *dev;
+static void hal_descriptor_cb(int conn_id, int status,
+                              btgatt_srvc_id_t *srvc_id,
+                              btgatt_char_id_t *char_id, bt_uuid_t *descr_id) {
+    hal_event_t *ev;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev || !dev->write_prepared)
+    if (!events_queued()) {
+        descriptor_discovery_cb(conn_id, status, srvc_id, char_id, descr_id);
+        return;
+    }
+
+    ev = event_new(EV_DESCRIPTOR);
+    if (!ev)
         return;
 
-    if (dev->prep_write_type == BLE_GATT_ELEM_CHARACTERISTIC &&
-        data.cbs.char_write_cb)
-        data.cbs.char_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0, status);
-    else if (dev->prep_write_type == BLE_GATT_ELEM_DESCRIPTOR &&
-        data.cbs.desc_write_cb)
-        data.cbs.desc_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0, status);
+    ev->id = conn_id;
+    ev->status = status;
+    ev->srvc_id = *srvc_id;
+    ev->char_id = *char_id;
+    ev->uuid = *descr_id;
+    event_post(ev);
 }
 
-static int ble_gatt_op(int operation, int conn_id, int id, int auth,
-                       const char *value, int len) {
-    ble_device_t *dev;
-    bt_status_t s = BT_STATUS_UNSUPPORTED;
+static void hal_included_service_cb(int conn_id, int status,
+                                    btgatt_srvc_id_t *srvc_id,
+                                    btgatt_srvc_id_t *incl_srvc_id) {
+    hal_event_t *ev;
 
-    if (id < 0)
-        return -1;
+    if (!events_queued()) {
+        get_included_service_cb(conn_id, status, srvc_id, incl_srvc_id);
+        return;
+    }
 
-    if (conn_id <= 0)
-        return -1;
+    ev = event_new(EV_INCLUDED_SERVICE);
+    if (!ev)
+        return;
 
-    if (!data.gattiface)
-        return -1;
+    ev->id = conn_id;
+    ev->status = status;
+    ev->srvc_id = *srvc_id;
+    ev->incl_srvc_id = *incl_srvc_id;
+    event_post(ev);
+}
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
+static void hal_register_notification_cb(int conn_id, int registered,
+                                         int status, btgatt_srvc_id_t *srvc_id,
+                                         btgatt_char_id_t *char_id) {
+    hal_event_t *ev;
 
-    switch (operation) {
-        case 0: /* Read characteristic */
-            if (dev->char_count <= 0)
-                return -1;
-            if (id >= dev->char_count)
-                return -1;
-
-            s = data.gattiface->client->read_characteristic(conn_id,
-	                                                    &dev->chars[id].s,
-	                                                    &dev->chars[id].c,
-                                                            auth);
-            break;
+    if (!events_queued()) {
+        register_for_notification_cb(conn_id, registered, status, srvc_id,
+                                     char_id);
+        return;
+    }
 
-        case 1: /* Read descriptor */
-            if (dev->desc_count <= 0)
-                return -1;
-            if (id >= dev->desc_count)
-                return -1;
-
-	    s = data.gattiface->client->read_descriptor(conn_id,
-	                                                &dev->descs[id].c.s,
-							&dev->descs[id].c.c,
-							&dev->descs[id].d,
-                                                        auth);
-            break;
+    ev = event_new(EV_REGISTER_NOTIFICATION);
+    if (!ev)
+        return;
 
-        case 4: /* Write characteristic with prepare write */
-            dev->write_prepared = 1;
-            dev->prep_write_type = BLE_GATT_ELEM_CHARACTERISTIC;
-            dev->prep_write_id = id;
-            /* pass-through */
+    ev->id = conn_id;
+    ev->arg = registered;
+    ev->status = status;
+    ev->srvc_id = *srvc_id;
+    ev->char_id = *char_id;
+    event_post(ev);
+}
 
-        case 2: /* Write characteristic with write command */
-        case 3: /* Write characteristic with write request */
-            if (dev->char_count <= 0 || id >= dev->char_count)
-                return -1;
-
-            s = data.gattiface->client->write_characteristic(conn_id,
-	                                                     &dev->chars[id].s,
-	                                                     &dev->chars[id].c,
-                                                             operation-1, len,
-                                                             auth,
-                                                             (char *) value);
-            break;
+static void hal_notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
+    hal_event_t *ev;
 
-        case 7: /* Write descriptor with prepare write */
-            dev->write_prepared = 1;
-            dev->prep_write_type = BLE_GATT_ELEM_DESCRIPTOR;
-            dev->prep_write_id = id;
-            /* pass-through */
+    if (!events_queued()) {
+        notify_cb(conn_id, p_data);
+        return;
+    }
 
-        case 5: /* Write descriptor with write command */
-        case 6: /* Write descriptor with write request */
-            if (dev->desc_count <= 0 || id >= dev->desc_count)
-                return -1;
-
-	    s = data.gattiface->client->write_descriptor(conn_id,
-	                                                 &dev->descs[id].c.s,
-							 &dev->descs[id].c.c,
-							 &dev->descs[id].d,
-                                                         operation-4, len,
-                                                         auth, (char *) value);
-            break;
+    ev = event_new(EV_NOTIFY);
+    if (!ev)
+        return;
 
-        case 8:
-            if (id == 0) /* Cancel prepared write */
-                dev->write_prepared = 0;
-            s = data.gattiface->client->execute_write(conn_id, id);
-            break;
+    /* Only the significant part of the value is copied */
+    ev->id = conn_id;
+    ev->p.notify.bda = p_data->bda;
+    ev->p.notify.srvc_id = p_data->srvc_id;
+    ev->p.notify.char_id = p_data->char_id;
+    ev->p.notify.len = p_data->len < BTGATT_MAX_ATTR_LEN ? p_data->len :
+                                                           BTGATT_MAX_ATTR_LEN;
+    ev->p.notify.is_notify = p_data->is_notify;
+    memcpy(ev->p.notify.value, p_data->value, ev->p.notify.len);
+    event_post(ev);
+}
+
+static void hal_read_characteristic_cb(int conn_id, int status,
+                                       btgatt_read_params_t *p_data) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        read_characteristic_cb(conn_id, status, p_data);
+        return;
     }
 
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    ev = event_new(EV_READ_CHAR);
+    if (!ev)
+        return;
 
-    return 0;
+    ev->id = conn_id;
+    ev->status = status;
+    ev->p.read = *p_data;
+    event_post(ev);
 }
 
-int ble_gatt_read_char(int conn_id, int char_id, int auth) {
-    return ble_gatt_op(0, conn_id, char_id, auth, NULL, 0);
-}
+static void hal_write_characteristic_cb(int conn_id, int status,
+                                        btgatt_write_params_t *p_data) {
+    hal_event_t *ev;
 
-int ble_gatt_read_desc(int conn_id, int desc_id, int auth) {
-    return ble_gatt_op(1, conn_id, desc_id, auth, NULL, 0);
-}
+    if (!events_queued()) {
+        write_characteristic_cb(conn_id, status, p_data);
+        return;
+    }
 
-int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(2, conn_id, char_id, auth, value, len);
-}
+    ev = event_new(EV_WRITE_CHAR);
+    if (!ev)
+        return;
 
-int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(3, conn_id, char_id, auth, value, len);
+    ev->id = conn_id;
+    ev->status = status;
+    ev->p.write = *p_data;
+    event_post(ev);
 }
 
-int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(5, conn_id, desc_id, auth, value, len);
-}
+static void hal_read_descriptor_cb(int conn_id, int status,
+                                   btgatt_read_params_t *p_data) {
+    hal_event_t *ev;
 
-int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(6, conn_id, desc_id, auth, value, len);
-}
+    if (!events_queued()) {
+        read_descriptor_cb(conn_id, status, p_data);
+        return;
+    }
 
-int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
-                             const char *value, int len) {
-    return ble_gatt_op(4, conn_id, char_id, auth, value, len);
-}
+    ev = event_new(EV_READ_DESC);
+    if (!ev)
+        return;
 
-int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
-                             const char *value, int len) {
-    return ble_gatt_op(7, conn_id, desc_id, auth, value, len);
+    ev->id = conn_id;
+    ev->status = status;
+    ev->p.read = *p_data;
+    event_post(ev);
 }
 
-int ble_gatt_execute_write(int conn_id, int execute) {
-    return ble_gatt_op(8, conn_id, execute, 0, NULL, 0);
-}
+static void hal_write_descriptor_cb(int conn_id, int status,
+                                    btgatt_write_params_t *p_data) {
+    hal_event_t *ev;
 
-/* Called when the registration for notifications on a char finishes */
-static void register_for_notification_cb(int conn_id, int registered,
-                                         int status,
-                                         btgatt_srvc_id_t *srvc_id,
-                                         btgatt_char_id_t *char_id) {
-    int id = 0;
+    if (!events_queued()) {
+        write_descriptor_cb(conn_id, status, p_data);
+        return;
+    }
 
-    if (data.cbs.char_notification_register_cb)
-        data.cbs.char_notification_register_cb(conn_id, id, registered, status);
+    ev = event_new(EV_WRITE_DESC);
+    if (!ev)
+        return;
+
+    ev->id = conn_id;
+    ev->status = status;
+    ev->p.write = *p_data;
+    event_post(ev);
 }
 
-/* Called when notifications of a characteristic are received */
-void notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
-    int id = 0;
+static void hal_execute_write_cb(int conn_id, int status) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        execute_write_cb(conn_id, status);
+        return;
+    }
+
+    ev = event_new(EV_EXECUTE_WRITE);
+    if (!ev)
+        return;
 
-    if (data.cbs.char_notification_cb)
-        data.cbs.char_notification_cb(conn_id, id, p_data->value, p_data->len,
-                                      !p_data->is_notify);
+    ev->id = conn_id;
+    ev->status = status;
+    event_post(ev);
 }
 
-static int ble_gatt_char_notification(uint8_t operation, int conn_id,
-                                      int char_id) {
-    ble_device_t *dev;
-    bt_status_t s = BT_STATUS_UNSUPPORTED;
-    btgatt_srvc_id_t *srvc;
-    btgatt_char_id_t *ch;
+static void hal_read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
+                                    int status) {
+    hal_event_t *ev;
 
-    if (char_id < 0)
-        return -1;
+    if (!events_queued()) {
+        read_remote_rssi_cb(client_if, bda, rssi, status);
+        return;
+    }
 
-    if (!data.client)
-        return -1;
+    ev = event_new(EV_RSSI);
+    if (!ev)
+        return;
 
-    if (!data.gattiface)
-        return -1;
+    ev->id = client_if;
+    ev->bda = *bda;
+    ev->arg = rssi;
+    ev->status = status;
+    event_post(ev);
+}
 
-    if (!data.adapter_state)
-        return -1;
+/* Not from the stack, but a retry may call callbacks too */
+static void hal_op_retry_cb(int conn_id) {
+    hal_event_t *ev;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
+    if (!events_queued()) {
+        gatt_op_resend(conn_id);
+        return;
+    }
 
-    if (dev->char_count <= 0 || char_id >= dev->char_count)
-        return -1;
+    ev = event_new(EV_OP_RETRY);
+    if (!ev)
+        return;
 
-    srvc = &dev->chars[char_id].s;
-    ch = &dev->chars[char_id].c;
+    ev->id = conn_id;
+    event_post(ev);
+}
 
-    switch (operation) {
-        case 0:
-            s = data.gattiface->client->register_for_notification(data.client,
-                                                                  &dev->bda,
-                                                                  srvc, ch);
-            break;
-        case 1:
-            s = data.gattiface->client->deregister_for_notification(data.client,
-                                                                    &dev->bda,
-                                                                    srvc, ch);
-            break;
+static void hal_adapter_state_changed_cb(bt_state_t state) {
+    hal_event_t *ev;
+
+    if (!events_queued()) {
+        adapter_state_changed_cb(state);
+        return;
     }
 
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    ev = event_new(EV_ADAPTER_STATE);
+    if (!ev)
+        return;
 
-    return 0;
+    ev->arg = state;
+    event_post(ev);
 }
 
-int ble_gatt_register_char_notification(int conn_id, int char_id) {
-    return ble_gatt_char_notification(0, conn_id, char_id);
-}
+static void hal_bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
+                                      bt_bond_state_t state) {
+    hal_event_t *ev;
 
-int ble_gatt_unregister_char_notification(int conn_id, int char_id) {
-    return ble_gatt_char_notification(1, conn_id, char_id);
-}
+    if (!events_queued()) {
+        bond_state_changed_cb(status, bda, state);
+        return;
+    }
 
-/* Called when the client registration is finished */
-static void register_client_cb(int status, int client_if, bt_uuid_t *app_uuid) {
-    if (status == BT_STATUS_SUCCESS) {
-        data.client = client_if;
-        if (data.cbs.enable_cb)
-            data.cbs.enable_cb();
-    } else
-        data.client = 0;
+    ev = event_new(EV_BOND_STATE);
+    if (!ev)
+        return;
+
+    ev->status = status;
+    ev->bda = *bda;
+    ev->arg = state;
+    event_post(ev);
 }
 
 /* GATT client interface callbacks */
 static const btgatt_client_callbacks_t gattccbs = {
-    register_client_cb,
-    scan_result_cb,
-    connect_cb,
-    disconnect_cb,
-    service_discovery_complete_cb,
-    service_discovery_result_cb,
-    characteristic_discovery_cb,
-    descriptor_discovery_cb,
-    get_included_service_cb,
-    register_for_notification_cb,
-    notify_cb,
-    read_characteristic_cb,
-    write_characteristic_cb,
-    read_descriptor_cb,
-    write_descriptor_cb,
-    execute_write_cb,
-    read_remote_rssi_cb
+    hal_register_client_cb,
+    hal_scan_result_cb,
+    hal_connect_cb,
+    hal_disconnect_cb,
+    hal_search_complete_cb,
+    hal_search_result_cb,
+    hal_characteristic_cb,
+    hal_descriptor_cb,
+    hal_included_service_cb,
+    hal_register_notification_cb,
+    hal_notify_cb,
+    hal_read_characteristic_cb,
+    hal_write_characteristic_cb,
+    hal_read_descriptor_cb,
+    hal_write_descriptor_cb,
+    hal_execute_write_cb,
+    hal_read_remote_rssi_cb
 };
 
 /* GATT interface callbacks */
@@ -962,12 +4707,13 @@ static void adapter_state_changed_cb(bt_state_t state) {
     bt_uuid_t app_uuid = { .uu = { 0x1b, 0x1c, 0xb9, 0x2e, 0x0d, 0x2e, 0x4c,
                                    0x45, 0xbb, 0xb8, 0xf4, 0x1b, 0x46, 0x39,
                                    0x23, 0x36 } };
+    uint8_t on = state == BT_STATE_ON ? 1 : 0;
 
-    data.adapter_state = state == BT_STATE_ON ? 1 : 0;
+    __atomic_store_n(&data.adapter_state, on, __ATOMIC_RELEASE);
     if (data.cbs.adapter_state_cb)
-        data.cbs.adapter_state_cb(data.adapter_state);
+        data.cbs.adapter_state_cb(on);
 
-    if (data.adapter_state) {
+    if (on) {
         bt_status_t s = data.gattiface->client->register_client(&app_uuid);
         if (s != BT_STATUS_SUCCESS)
             data.btiface->disable();
@@ -1003,20 +4749,60 @@ static void thread_event_cb(bt_cb_thread_evt event) {
 /* Bluetooth interface callbacks */
 static bt_callbacks_t btcbs = {
     sizeof(bt_callbacks_t),
-    adapter_state_changed_cb,
+    hal_adapter_state_changed_cb,
     NULL, /* adapter_properties_cb */
     NULL, /* remote_device_properties_callback */
     NULL, /* device_found_cb */
     NULL, /* discovery_state_changed_cb */
     NULL, /* pin_request_cb */
     NULL, /* ssp_request_cb */
-    bond_state_changed_cb,
+    hal_bond_state_changed_cb,
     NULL, /* acl_state_changed_callback */
     thread_event_cb,
     NULL, /* dut_mode_recv_callback */
     NULL, /* le_test_mode_callback */
 };
 
+/* No other thread may be using libble meanwhile */
+static void remove_all_devices() {
+    ble_device_t *dev, *next;
+
+    pthread_rwlock_wrlock(&devices_lock);
+
+    dev = data.devices;
+    while (dev) {
+        next = dev->next;
+
+        free(dev->srvcs);
+        free(dev->chars);
+        free(dev->descs);
+        attr_index_free(&dev->srvc_index);
+        attr_index_free(&dev->char_index);
+        attr_index_free(&dev->desc_index);
+        free(dev->notif_handlers);
+        discovery_free(dev->discovery);
+        gatt_op_flush(dev, 0);
+        free(dev->op_spare);
+        if (dev->stream) {
+            free(dev->stream->writes);
+            free(dev->stream);
+        }
+        pthread_mutex_destroy(&dev->lock);
+        free(dev);
+
+        dev = next;
+    }
+
+    data.devices = NULL;
+
+    free(data.devices_by_bda.buckets);
+    memset(&data.devices_by_bda, 0, sizeof(data.devices_by_bda));
+    free(data.devices_by_conn_id.buckets);
+    memset(&data.devices_by_conn_id, 0, sizeof(data.devices_by_conn_id));
+
+    pthread_rwlock_unlock(&devices_lock);
+}
+
 int ble_enable(ble_cbs_t cbs) {
     int status;
     bt_status_t s;
@@ -1024,7 +4810,10 @@ int ble_enable(ble_cbs_t cbs) {
     hw_device_t *hwdev;
     bluetooth_device_t *btdev;
 
+    /* Drop the devices known from a previous session */
+    remove_all_devices();
     memset(&data, 0, sizeof(data));
+    events_discard();
 
     /* Get the Bluetooth module from libhardware */
     status = hw_get_module(BT_STACK_MODULE_ID, (hw_module_t const**) &module);
@@ -1042,46 +4831,41 @@ int ble_enable(ble_cbs_t cbs) {
     if (data.btiface == NULL)
         return -1;
 
+    /* Store the user callbacks before the stack thread can call any of them */
+    data.cbs = cbs;
+
     /* Init the Bluetooth interface, setting a callback for each operation */
     s = data.btiface->init(&btcbs);
     if (s != BT_STATUS_SUCCESS && s != BT_STATUS_DONE)
         return -s;
 
-    /* Store the user callbacks */
-    data.cbs = cbs;
-
     return 0;
 }
 
-static void remove_all_devices() {
-    ble_device_t *dev, *next;
-
-    dev = data.devices;
-    while (dev) {
-        next = dev->next;
-
-        free(dev->srvcs);
-        free(dev->chars);
-        free(dev->descs);
-        free(dev);
-
-        dev = next;
-    }
-}
-
 int ble_disable() {
+    ble_device_t *dev;
     bt_status_t s;
+    int client;
 
-    if (!data.adapter_state)
+    if (!__atomic_load_n(&data.adapter_state, __ATOMIC_ACQUIRE))
         return -1;
 
+    /* Devices still connected won't get a disconnection callback */
+    for (dev = first_device(); dev; dev = dev->next) {
+        pthread_mutex_lock(&dev->lock);
+        if (dev->cache_dirty)
+            gatt_cache_save(dev);
+        pthread_mutex_unlock(&dev->lock);
+    }
+
     if (!data.btiface)
         return -1;
 
-    if (!data.client)
+    client = __atomic_load_n(&data.client, __ATOMIC_ACQUIRE);
+    if (!client)
         return -1;
 
-    s = data.gattiface->client->unregister_client(data.client);
+    s = data.gattiface->client->unregister_client(client);
     if (s != BT_STATUS_SUCCESS)
         return -s;
 
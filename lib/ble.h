@@ -39,8 +39,19 @@
  * time. That means that only one program that makes use of libble can run on
  * the system at a certain time and that Bluetooth should be disabled in the
  * Android GUI (if running).
+ *
+ * \section threads_sec Threads
+ *
+ * The functions of the API may be called from several threads at the same
+ * time, except ble_enable() and ble_disable(). Each device has its own lock,
+ * so calls for different devices don't wait for each other. The callbacks
+ * run on the stack thread (or the one calling ble_dispatch()) without any
+ * libble lock held, so they may call the API and take application locks
+ * that are held around API calls.
  */
 
+#include <stdint.h>
+
 /** BLE device bond state. */
 typedef enum {
     BLE_BOND_NONE,     /**< There is no bond with the remote device. */
@@ -70,11 +81,123 @@ typedef void (*ble_adapter_state_cb_t)(uint8_t state);
  *                most-significant byte is on position 0 and the
  *                least-sifnificant byte is on position 5.
  * @param rssi The RSSI of the found device.
- * @param adv_data A pointer to the advertising data of the found device.
+ * @param adv_data A pointer to the advertising data of the found device,
+ *                 BLE_ADV_DATA_LEN bytes long. See ble_ad_next() for parsing
+ *                 it.
  */
 typedef void (*ble_scan_cb_t)(const uint8_t *address, int rssi,
                               const uint8_t *adv_data);
 
+/**
+ * Length of the advertising data of a scan report, advertising data and scan
+ * response included.
+ */
+#define BLE_ADV_DATA_LEN 62
+
+/** @name Advertising data (AD) structure types
+ * @{ */
+#define BLE_AD_FLAGS              0x01
+#define BLE_AD_UUID16_SOME        0x02
+#define BLE_AD_UUID16_ALL         0x03
+#define BLE_AD_UUID32_SOME        0x04
+#define BLE_AD_UUID32_ALL         0x05
+#define BLE_AD_UUID128_SOME       0x06
+#define BLE_AD_UUID128_ALL        0x07
+#define BLE_AD_NAME_SHORT         0x08
+#define BLE_AD_NAME_COMPLETE      0x09
+#define BLE_AD_TX_POWER           0x0a
+#define BLE_AD_SLAVE_CONN_INT     0x12
+#define BLE_AD_SOLICIT_UUID16     0x14
+#define BLE_AD_SOLICIT_UUID128    0x15
+#define BLE_AD_SERVICE_DATA       0x16
+#define BLE_AD_PUBLIC_ADDRESS     0x17
+#define BLE_AD_RANDOM_ADDRESS     0x18
+#define BLE_AD_GAP_APPEARANCE     0x19
+#define BLE_AD_ADV_INTERVAL       0x1a
+#define BLE_AD_SOLICIT_UUID32     0x1f
+#define BLE_AD_MANUFACTURER_DATA  0xff
+/** @} */
+
+/**
+ * An AD structure. It points into the advertising data it was read from,
+ * nothing is copied.
+ */
+typedef struct ble_ad {
+    /** The AD type, one of BLE_AD_* */
+    uint8_t type;
+    /** The AD data, after the type */
+    const uint8_t *data;
+    /** The length of data */
+    uint8_t len;
+} ble_ad_t;
+
+/**
+ * Iterator over the AD structures of advertising data. Initialize it with
+ * ble_ad_iter_init(), its fields are private.
+ */
+typedef struct ble_ad_iter {
+    const uint8_t *adv_data;
+    int len;
+    int pos;
+} ble_ad_iter_t;
+
+/**
+ * An advertising report found during a scanning session.
+ */
+typedef struct ble_scan_report {
+    /** Bluetooth address of the found device, most-significant byte first. */
+    uint8_t address[6];
+    /** The RSSI of the found device. */
+    int rssi;
+    /** When the report was received, in milliseconds of a monotonic clock. */
+    uint64_t timestamp;
+    /** The advertising data of the found device. */
+    uint8_t adv_data[BLE_ADV_DATA_LEN];
+} ble_scan_report_t;
+
+/**
+ * Type that represents a callback function to deliver a batch of advertising
+ * reports found during a scanning session.
+ *
+ * @param reports An array of reports, in the order they were received. It's
+ *                only valid until the callback returns.
+ * @param count The number of reports in the array.
+ */
+typedef void (*ble_scan_batch_cb_t)(const ble_scan_report_t *reports,
+                                    int count);
+
+/**
+ * Kinds of scan filter rules.
+ */
+typedef enum ble_scan_filter_type {
+    /** Report comes from the given address */
+    BLE_SCAN_FILTER_ADDRESS,
+    /** Advertising data lists the given service UUID */
+    BLE_SCAN_FILTER_SERVICE_UUID,
+    /** Advertising data has manufacturer specific data of the given company,
+     * starting with the given bytes */
+    BLE_SCAN_FILTER_MANUFACTURER_DATA
+} ble_scan_filter_type_t;
+
+/**
+ * A scan filter rule. Only the fields relevant for its type are used.
+ */
+typedef struct ble_scan_filter {
+    ble_scan_filter_type_t type;
+    /** Bluetooth address, most-significant byte first */
+    uint8_t address[6];
+    /** Service UUID, in the same byte order as the other UUIDs of the API.
+     * UUIDs derived from the Bluetooth base UUID also match their 16 and 32
+     * bit forms. */
+    uint8_t uuid[16];
+    /** Bluetooth SIG company identifier */
+    uint16_t company_id;
+    /** Prefix of the manufacturer data, after the company identifier */
+    uint8_t data[BLE_ADV_DATA_LEN];
+    /** Length of the prefix, 0 matches any data of the company */
+    uint8_t data_len;
+} ble_scan_filter_t;
+
 /**
  * Type that represents a callback function to notify of a new connection with
  * a BLE device or a disconnection from a device.
@@ -186,6 +309,185 @@ typedef void (*ble_gatt_notification_cb_t)(int conn_id, int char_id,
                                            uint16_t value_len,
                                            uint8_t is_indication);
 
+/**
+ * Maximum length of an attribute value.
+ */
+#define BLE_GATT_MAX_ATTR_LEN 600
+
+/**
+ * A notification or indication stored in the notification ring.
+ */
+typedef struct ble_notification {
+    /** The identifier of the connected remote device. */
+    int conn_id;
+    /** ID of the characteristic that the notification refers to. */
+    int char_id;
+    /** When it was received, in microseconds of a monotonic clock. */
+    uint64_t timestamp;
+    /** Whether it's a notification or an indication: 0 notification, 1
+     * indication. */
+    uint8_t is_indication;
+    /** The length of value. */
+    uint16_t len;
+    /** The new value of the characteristic. */
+    uint8_t value[BLE_GATT_MAX_ATTR_LEN];
+} ble_notification_t;
+
+/**
+ * Type that represents a callback function to deliver a batch of
+ * notifications and indications from the notification ring.
+ *
+ * @param notifications An array of notifications, in the order they were
+ *                      received. It's only valid until the callback returns.
+ * @param count The number of notifications in the array.
+ */
+typedef void (*ble_notification_batch_cb_t)(
+        const ble_notification_t *notifications, int count);
+
+/**
+ * A service of the attribute tree built by ble_gatt_discover_all().
+ */
+typedef struct ble_gatt_db_srvc {
+    /** The identifier of the service. */
+    int id;
+    /** The UUID of the service. */
+    uint8_t uuid[16];
+    /** Whether the service is primary or not: 1 primary, 0 included. */
+    uint8_t is_primary;
+    /** Position of the first characteristic of the service in chars. */
+    int char_start;
+    /** Number of characteristics of the service. */
+    int char_count;
+} ble_gatt_db_srvc_t;
+
+/**
+ * A characteristic of the attribute tree built by ble_gatt_discover_all().
+ */
+typedef struct ble_gatt_db_char {
+    /** The identifier of the characteristic. */
+    int id;
+    /** The UUID of the characteristic. */
+    uint8_t uuid[16];
+    /** The characteristic properties bit field. */
+    int properties;
+    /** Position of the first descriptor of the characteristic in descs. */
+    int desc_start;
+    /** Number of descriptors of the characteristic. */
+    int desc_count;
+} ble_gatt_db_char_t;
+
+/**
+ * A descriptor of the attribute tree built by ble_gatt_discover_all().
+ */
+typedef struct ble_gatt_db_desc {
+    /** The identifier of the descriptor. */
+    int id;
+    /** The UUID of the descriptor. */
+    uint8_t uuid[16];
+} ble_gatt_db_desc_t;
+
+/**
+ * The attribute tree of a remote device. The characteristics of each service
+ * and the descriptors of each characteristic are contiguous in their arrays.
+ */
+typedef struct ble_gatt_db {
+    const ble_gatt_db_srvc_t *srvcs;
+    int srvc_count;
+    const ble_gatt_db_char_t *chars;
+    int char_count;
+    const ble_gatt_db_desc_t *descs;
+    int desc_count;
+} ble_gatt_db_t;
+
+/**
+ * Type that represents a callback function to notify that the discovery of
+ * all the attributes of a remote device has finished.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param db The attributes discovered. It's only valid until the callback
+ *           returns.
+ * @param status The status in which the discovery has finished: 0 if the
+ *               whole tree was discovered, the status of the failed stage
+ *               otherwise, or -1 if the device disconnected. On failure db
+ *               holds the attributes discovered up to that point.
+ */
+typedef void (*ble_gatt_discovery_cb_t)(int conn_id, const ble_gatt_db_t *db,
+                                        int status);
+
+/**
+ * The result of one of the reads of ble_gatt_read_multiple().
+ */
+typedef struct ble_gatt_read_result {
+    /** The identifier of the characteristic read. */
+    int char_id;
+    /** The status of the read, 0 on success. */
+    int status;
+    /** The value read, NULL if the read failed. */
+    const uint8_t *value;
+    /** The length of the value. */
+    uint16_t len;
+} ble_gatt_read_result_t;
+
+/**
+ * Type that represents a callback function to deliver the values read by
+ * ble_gatt_read_multiple().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param results One result per requested characteristic, in the requested
+ *                order. The results and their values are only valid until the
+ *                callback returns.
+ * @param count The number of results.
+ */
+typedef void (*ble_gatt_read_multiple_cb_t)(
+        int conn_id, const ble_gatt_read_result_t *results, int count);
+
+/**
+ * Type that represents a callback function to report the result of
+ * ble_gatt_write_long_char().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic written.
+ * @param status The status of the write.
+ */
+typedef void (*ble_gatt_write_long_cb_t)(int conn_id, int char_id,
+                                         int status);
+
+/**
+ * Size of the chunks sent by ble_gatt_stream_char(), the payload of a write
+ * command with the default ATT MTU.
+ */
+#define BLE_GATT_STREAM_CHUNK 20
+
+/**
+ * Type that represents a function producing the data of ble_gatt_stream_char().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic being written.
+ * @param buf Where the data should be stored.
+ * @param size The size of buf, BLE_GATT_STREAM_CHUNK.
+ *
+ * @return The number of bytes stored in buf, 0 at the end of the data or -1 to
+ *         abort the stream.
+ */
+typedef int (*ble_gatt_stream_producer_t)(int conn_id, int char_id, char *buf,
+                                          int size);
+
+/**
+ * Type that represents a callback function to report the end of
+ * ble_gatt_stream_char().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic written.
+ * @param sent The number of bytes accepted by the stack.
+ * @param bytes_per_sec The throughput achieved, from the start of the stream
+ *                      until the last answer.
+ * @param status 0 if all the data was sent, the status of the first write that
+ *               failed, or -1 if the stream was cancelled, the device
+ *               disconnected or the producer failed.
+ */
+typedef void (*ble_gatt_stream_cb_t)(int conn_id, int char_id, uint64_t sent,
+                                     uint32_t bytes_per_sec, int status);
+
 /**
  * List of callbacks for BLE operations.
  */
@@ -229,6 +531,51 @@ int ble_enable(ble_cbs_t cbs);
  */
 int ble_disable();
 
+/**
+ * Get a file descriptor to deliver the callbacks from the caller's thread.
+ *
+ * From the first call on, the events of the Bluetooth stack are queued
+ * instead of running the callbacks from the stack thread. The descriptor (an
+ * eventfd) becomes readable when events are waiting, and ble_dispatch() runs
+ * their callbacks, so it can be added to a poll() or epoll loop. This applies
+ * to every callback of libble, including the ones of enabling and disabling,
+ * so ble_dispatch() has to be called for ble_enable() and ble_disable() to
+ * complete. It may be called before ble_enable(), the descriptor is kept
+ * across sessions.
+ *
+ * @return The file descriptor on success.
+ * @return -1 on failure.
+ */
+int ble_get_event_fd();
+
+/**
+ * Run the callbacks of the events queued since ble_get_event_fd() was
+ * called, on the calling thread.
+ *
+ * It should be called from a single thread, when the descriptor returned by
+ * ble_get_event_fd() is readable. Events queued meanwhile are left for the
+ * next call, and the descriptor stays readable while events are waiting.
+ *
+ * @param max_events The maximum number of events to dispatch, 0 for all the
+ *                   events waiting.
+ *
+ * @return The number of events dispatched.
+ * @return -1 if ble_get_event_fd() wasn't called.
+ */
+int ble_dispatch(int max_events);
+
+/**
+ * Number of scan reports and notifications dropped because they couldn't be
+ * allocated once ble_get_event_fd() was called. Their callbacks are never
+ * called. The other events, which answer operations or change the state of
+ * devices, are never dropped: they use events set aside by
+ * ble_get_event_fd(), and the stack thread waits for ble_dispatch() to
+ * return some if those run out.
+ *
+ * @return The number of events dropped.
+ */
+unsigned long ble_dispatch_drops();
+
 /**
  * Starts a LE scan procedure on the adapter.
  *
@@ -249,6 +596,88 @@ int ble_start_scan();
  */
 int ble_stop_scan();
 
+/**
+ * Enables or disables batched delivery of scan reports.
+ *
+ * While enabled, advertising reports are also accumulated in a buffer and
+ * delivered to the batch callback when max_reports reports have been
+ * accumulated, when the oldest of them is max_delay_ms milliseconds old or
+ * when scan is stopped. The per-report scan_cb callback is still called for
+ * each report, so it should be left NULL when batching is used.
+ *
+ * Batches that reach max_delay_ms are delivered from an internal libble
+ * thread.
+ *
+ * @param max_reports Maximum number of reports on a batch.
+ * @param max_delay_ms Maximum time a report waits to be delivered, 0 means
+ *                     batches are only delivered when full or flushed.
+ * @param cb The batch callback, NULL disables batching. Pending reports are
+ *           delivered to the previous callback before it's replaced.
+ *
+ * @return 0 on success.
+ * @return -1 on failure.
+ */
+int ble_set_scan_batching(int max_reports, unsigned int max_delay_ms,
+                          ble_scan_batch_cb_t cb);
+
+/**
+ * Delivers the pending scan reports to the batch callback right away.
+ *
+ * @return 0 on success.
+ * @return -1 if batching is not enabled.
+ */
+int ble_flush_scan_batch();
+
+/**
+ * Configures coalescing and rate limiting of scan reports.
+ *
+ * Advertising reports are checked against the last report delivered for the
+ * same address before reaching scan_cb or the batch callback. A report is
+ * suppressed when its advertising data is unchanged and its RSSI moved less
+ * than rssi_threshold. Reports that make it through are also subject to a
+ * per-device token bucket, refilled at max_rate tokens per second up to burst
+ * tokens, each report taking one token.
+ *
+ * The first report of a device is always delivered. Up to 4096 devices are
+ * tracked; beyond that, the state is cleared and devices are reported again.
+ *
+ * @param rssi_threshold Minimum RSSI change, in dBm, for a report with
+ *                       unchanged advertising data to be delivered. 0 disables
+ *                       coalescing.
+ * @param max_rate Maximum sustained number of reports per second delivered for
+ *                 each device. 0 disables rate limiting.
+ * @param burst Maximum number of reports of a device delivered in a row.
+ *              Ignored when max_rate is 0.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_set_scan_coalescing(int rssi_threshold, unsigned int max_rate,
+                            unsigned int burst);
+
+/**
+ * Sets the filters advertising reports must pass to be delivered.
+ *
+ * A report is delivered when its RSSI is at least min_rssi and it matches any
+ * of the rules, or there are no rules. Filters are evaluated before
+ * coalescing, so reports rejected by them never leave the library. They replace
+ * any filters previously set.
+ *
+ * @param filters An array of filter rules, copied by the library.
+ * @param count The number of rules in the array.
+ * @param min_rssi Minimum RSSI of the delivered reports.
+ *
+ * @return 0 on success.
+ * @return -1 on failure, the previous filters are kept.
+ */
+int ble_set_scan_filters(const ble_scan_filter_t *filters, int count,
+                         int min_rssi);
+
+/**
+ * Removes all the scan filters, delivering every report.
+ */
+void ble_clear_scan_filters();
+
 /**
  * Connects to a BLE device.
  *
@@ -379,11 +808,40 @@ int ble_gatt_discover_characteristics(int conn_id, int service_id);
  */
 int ble_gatt_discover_descriptors(int conn_id, int char_id);
 
+/**
+ * Discover all services, characteristics and descriptors of a BLE device.
+ *
+ * The library runs the service, characteristic and descriptor discoveries one
+ * after the other, without waiting for the application in between, and
+ * reports the whole attribute tree through a single callback. The srvc_*,
+ * char_* and desc_* callbacks are not called for the attributes found, and
+ * the other discovery functions fail for the device until this one finishes.
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param cb The function called when the discovery finishes.
+ *
+ * @return 0 if the discovery has been successfully requested.
+ * @return -1 if failed to request the discovery, or one is already running.
+ */
+int ble_gatt_discover_all(int conn_id, ble_gatt_discovery_cb_t cb);
+
 /**
  * Read the value of a characteristic.
  *
  * There should be an active connection with the device.
  *
+ * Reads, writes and executions of prepared writes are queued per connection
+ * and sent one at a time, in the order they were requested, each one as soon
+ * as the previous is answered. An operation answered with a busy (0x84) or
+ * error (0x85) status is sent again, up to three times, 20, 40 and then 80
+ * milliseconds later, before its callback is called. If a queued operation
+ * can't be sent, its callback is called with the negated bt_status_t as
+ * status, from an internal libble thread if that happens on a retry and
+ * ble_get_event_fd() isn't used. Queued operations are dropped when the
+ * device disconnects.
+ *
  * @param conn_id The identifier of the connected remote device.
  * @param char_id The identifier of the characteristic to be read.
  * @param auth Whether or not link authentication should be requested before
@@ -394,10 +852,33 @@ int ble_gatt_discover_descriptors(int conn_id, int char_id);
  */
 int ble_gatt_read_char(int conn_id, int char_id, int auth);
 
+/**
+ * Read the values of several characteristics.
+ *
+ * There should be an active connection with the device.
+ *
+ * The reads are queued in a row, as described in ble_gatt_read_char(), and
+ * the char_read_cb callback isn't called for them. When all of them have been
+ * answered, or the device disconnects, the results are delivered together.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_ids The identifiers of the characteristics to be read.
+ * @param count The number of identifiers in char_ids.
+ * @param auth Whether or not link authentication should be requested before
+ *             trying to read the characteristics: 1 request, 0 do not request.
+ * @param cb The function called with the results.
+ *
+ * @return 0 if the reads have been successfully requested.
+ * @return -1 if failed to request the reads.
+ */
+int ble_gatt_read_multiple(int conn_id, const int *char_ids, int count,
+                           int auth, ble_gatt_read_multiple_cb_t cb);
+
 /**
  * Read the value of a characteristic descriptor.
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param desc_id The identifier of the descriptor to be read.
@@ -413,6 +894,7 @@ int ble_gatt_read_desc(int conn_id, int desc_id, int auth);
  * Write the value of a characteristic using write command (no response).
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param char_id The identifier of the characteristic to be written.
@@ -432,6 +914,7 @@ int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
  * Write the value of a characteristic using write request (with response).
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param char_id The identifier of the characteristic to be written.
@@ -451,6 +934,7 @@ int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
  * Write the value of a descriptor using write command (no response).
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param desc_id The identifier of the descriptor to be written.
@@ -470,6 +954,7 @@ int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
  * Write the value of a descriptor using write request (with response).
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param desc_id The identifier of the descriptor to be written.
@@ -490,6 +975,7 @@ int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
  * @func ble_execute_write().
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param char_id The identifier of the characteristic to be written.
@@ -510,6 +996,7 @@ int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
  * @func ble_execute_write().
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param desc_id The identifier of the descriptor to be written.
@@ -529,6 +1016,7 @@ int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
  * Execute or cancel a previously prepared write operation.
  *
  * There should be an active connection with the device.
+ * The operation is queued as described in ble_gatt_read_char().
  *
  * @param conn_id The identifier of the connected remote device.
  * @param execute Whether the operation should be executed or cancelled:
@@ -539,6 +1027,77 @@ int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
  */
 int ble_gatt_execute_write(int conn_id, int execute);
 
+/**
+ * Write a value longer than what fits in a single write request.
+ *
+ * There should be an active connection with the device.
+ *
+ * The value is sent as a single write request, queued as described in
+ * ble_gatt_read_char(). When it doesn't fit in the ATT MTU, the stack splits
+ * it in prepared writes at increasing offsets, followed by their execution.
+ * Prepared writes made with ble_gatt_prep_write_char() can't be used for
+ * that, the HAL sends them all at offset 0. This is what
+ * ble_gatt_write_req_char() does as well, except that the result goes to cb
+ * instead of the char_write_cb callback.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic to be written.
+ * @param auth Whether or not link encryption should be requested before trying
+ *             to write the characteristic: 1 request, 0 do not request.
+ * @param value Pointer to the value that should be written on the
+ *              characteristic. It's copied, so it doesn't need to be kept.
+ * @param len The length of the data pointed by the value parameter, up to
+ *            BTGATT_MAX_ATTR_LEN (600) bytes.
+ * @param cb The function called with the status of the write.
+ *
+ * @return 0 if the write has been successfully requested.
+ * @return -1 if failed to request the write.
+ */
+int ble_gatt_write_long_char(int conn_id, int char_id, int auth,
+                             const char *value, int len,
+                             ble_gatt_write_long_cb_t cb);
+
+/**
+ * Stream data to a characteristic with write commands.
+ *
+ * There should be an active connection with the device.
+ *
+ * Up to credits write commands are kept in flight, and a new one is sent each
+ * time the stack answers one, so the link is kept busy without waiting for
+ * each write. The writes bypass the queue described in ble_gatt_read_char(),
+ * queued operations are still sent in between. The char_write_cb callback
+ * isn't called for the chunks of the stream, cb is called once when the
+ * stream ends. Only one stream can be running per connection.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic to be written.
+ * @param value The data to send, or NULL to get it from producer. It isn't
+ *              copied, so it must be kept until cb is called.
+ * @param len The length of the data pointed by the value parameter.
+ * @param producer The function called for each chunk when value is NULL.
+ * @param credits The number of write commands kept in flight.
+ * @param cb The function called when the stream ends.
+ *
+ * @return 0 if the stream has been successfully started.
+ * @return -1 if failed to start the stream.
+ */
+int ble_gatt_stream_char(int conn_id, int char_id, const char *value, int len,
+                         ble_gatt_stream_producer_t producer, int credits,
+                         ble_gatt_stream_cb_t cb);
+
+/**
+ * Stop a stream started by ble_gatt_stream_char().
+ *
+ * No more data is sent, cb is called with status -1 once the writes in flight
+ * are answered.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ *
+ * @return 0 if the stream is being stopped.
+ * @return -1 if there was no stream running.
+ */
+int ble_gatt_stream_cancel(int conn_id);
+
 /**
  * Register for notifications of changes in the value of a characteristic.
  *
@@ -570,4 +1129,203 @@ int ble_gatt_register_char_notification(int conn_id, int char_id);
  *            notifications.
  */
 int ble_gatt_unregister_char_notification(int conn_id, int char_id);
+
+/**
+ * Set a handler for the notifications and indications of a characteristic.
+ *
+ * Notifications of a characteristic with a handler are delivered only to the
+ * handler, all the others are delivered to the char_notification_cb callback.
+ * Handlers are kept across reconnections, until they are replaced or libble is
+ * disabled. The characteristic must have already been discovered.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic.
+ * @param handler The function called for each notification or indication of
+ *                the characteristic, NULL to remove the current handler.
+ *
+ * @return 0 if the handler has been set.
+ * @return -1 if failed to set the handler.
+ */
+int ble_gatt_set_char_notification_handler(int conn_id, int char_id,
+                                           ble_gatt_notification_cb_t handler);
+
+/**
+ * Enables or disables the notification ring.
+ *
+ * While enabled, notifications and indications are copied to a ring of
+ * preallocated records instead of being delivered from the Bluetooth stack
+ * thread, so a slow consumer doesn't delay the other events. Neither the
+ * char_notification_cb callback nor the per-characteristic handlers are
+ * called. The ring is lock-free, with the stack thread as its only producer
+ * and a single consumer: an internal libble thread calling cb, or the caller
+ * of ble_poll_notifications() when cb is NULL. Notifications received while
+ * the ring is full are dropped and counted, see ble_notification_drops().
+ *
+ * The batch callback must not call ble_set_notification_ring().
+ *
+ * @param size The number of records of the ring, rounded up to a power of
+ *             two, 0 disables the ring. Records not yet consumed are
+ *             discarded when the ring is replaced.
+ * @param cb The function the internal thread delivers batches to, or NULL to
+ *           consume them with ble_poll_notifications().
+ *
+ * @return 0 on success.
+ * @return -1 on failure.
+ */
+int ble_set_notification_ring(int size, ble_notification_batch_cb_t cb);
+
+/**
+ * Delivers the notifications waiting on the ring.
+ *
+ * Only valid when the ring was enabled without a callback, and from a single
+ * thread at a time. The notifications are delivered in place, in at most two
+ * calls of cb since the ring wraps around.
+ *
+ * @param cb The function the notifications are delivered to.
+ * @param max The maximum number of notifications delivered.
+ *
+ * @return The number of notifications delivered.
+ * @return -1 if the ring is disabled or consumed by the internal thread.
+ */
+int ble_poll_notifications(ble_notification_batch_cb_t cb, int max);
+
+/**
+ * Number of notifications dropped because the ring was full, since it was
+ * enabled.
+ *
+ * @return The number of notifications dropped.
+ */
+unsigned long ble_notification_drops();
+
+/**
+ * Set the file used to cache the attributes discovered on remote devices.
+ *
+ * The services, characteristics and descriptors of a device are saved to the
+ * cache when it disconnects, or when libble is disabled, if any new attribute
+ * was discovered. When a device with a cache entry connects and none of its
+ * attributes are known, they are loaded from the cache before the connect_cb
+ * callback is called, so the identifiers from previous sessions are valid
+ * right away. The Bluetooth stack may still require a discovery before the
+ * attributes can be accessed on some remote devices.
+ *
+ * @param path The path of the cache file, NULL to stop using the cache. The
+ *             file is created when the first entry is saved.
+ *
+ * @return 0 if the cache file has been set.
+ * @return -1 if failed to set the cache file.
+ */
+int ble_set_gatt_cache(const char *path);
+
+/**
+ * Invalidate the cached attributes of a remote device.
+ *
+ * Must be called when the attribute database of a device changes, e.g. after
+ * a firmware update. The cache entry is removed and all the attribute
+ * identifiers and notification handlers of the device are forgotten, so the
+ * attributes have to be discovered again.
+ *
+ * @param address The address of the remote device, NULL to invalidate the
+ *                whole cache.
+ *
+ * @return 0 if the cached attributes have been invalidated.
+ * @return -1 if there is no cache or failed to update it.
+ */
+int ble_gatt_cache_invalidate(const uint8_t *address);
+
+/**
+ * Prepares an iterator to walk the AD structures of advertising data.
+ *
+ * @param it The iterator.
+ * @param adv_data The advertising data, which must outlive the iterator.
+ * @param len The length of adv_data, BLE_ADV_DATA_LEN for scan reports.
+ */
+void ble_ad_iter_init(ble_ad_iter_t *it, const uint8_t *adv_data, int len);
+
+/**
+ * Gets the next AD structure of advertising data.
+ *
+ * A structure is never read past len bytes of the advertising data. Walking
+ * stops at the first zero length structure or at the first structure that
+ * doesn't fit in the advertising data.
+ *
+ * @param it The iterator.
+ * @param ad Where the structure is stored.
+ *
+ * @return 1 if a structure has been stored in ad.
+ * @return 0 if there are no more structures.
+ * @return -1 if the next structure is truncated, iteration is over.
+ */
+int ble_ad_next(ble_ad_iter_t *it, ble_ad_t *ad);
+
+/**
+ * Finds the first AD structure of a given type.
+ *
+ * @param adv_data The advertising data.
+ * @param len The length of adv_data.
+ * @param type The AD type to look for.
+ * @param ad Where the structure is stored.
+ *
+ * @return 0 if the structure has been found.
+ * @return -1 if there is no structure of that type.
+ */
+int ble_ad_find(const uint8_t *adv_data, int len, uint8_t type,
+                ble_ad_t *ad);
+
+/**
+ * Gets the flags of a BLE_AD_FLAGS structure.
+ *
+ * @return 0 on success.
+ * @return -1 if ad is not a valid flags structure.
+ */
+int ble_ad_get_flags(const ble_ad_t *ad, uint8_t *flags);
+
+/**
+ * Gets the TX power level, in dBm, of a BLE_AD_TX_POWER structure.
+ *
+ * @return 0 on success.
+ * @return -1 if ad is not a valid TX power structure.
+ */
+int ble_ad_get_tx_power(const ble_ad_t *ad, int8_t *tx_power);
+
+/**
+ * Gets the local name of a BLE_AD_NAME_SHORT or BLE_AD_NAME_COMPLETE
+ * structure. The name points into the advertising data and isn't NUL
+ * terminated.
+ *
+ * @return 0 on success.
+ * @return -1 if ad is not a name structure.
+ */
+int ble_ad_get_name(const ble_ad_t *ad, const char **name, int *len);
+
+/**
+ * Counts the UUIDs of a 16, 32 or 128-bit UUID list or solicitation structure.
+ *
+ * @return The number of UUIDs.
+ * @return -1 if ad is not a UUID list.
+ */
+int ble_ad_uuid_count(const ble_ad_t *ad);
+
+/**
+ * Gets a UUID from a UUID list or solicitation structure.
+ *
+ * @param ad The structure.
+ * @param i The position of the UUID on the list.
+ * @param uuid A 16 element array where the UUID is stored, in the same byte
+ *             order as the other UUIDs of the API. 16 and 32-bit UUIDs are
+ *             expanded with the Bluetooth base UUID.
+ *
+ * @return 0 on success.
+ * @return -1 if ad is not a UUID list or i is out of range.
+ */
+int ble_ad_get_uuid(const ble_ad_t *ad, int i, uint8_t *uuid);
+
+/**
+ * Gets the company identifier and data of a BLE_AD_MANUFACTURER_DATA
+ * structure. The data points into the advertising data.
+ *
+ * @return 0 on success.
+ * @return -1 if ad is not a valid manufacturer data structure.
+ */
+int ble_ad_get_manufacturer_data(const ble_ad_t *ad, uint16_t *company_id,
+                                 const uint8_t **data, int *len);
 #endif
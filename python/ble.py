@@ -37,6 +37,103 @@ gatt_response_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c
 gatt_notification_register_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int)
 gatt_notification_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c_ubyte)
 
+## Batched scan reports
+BLE_ADV_DATA_LEN = 62
+
+class ble_scan_report_t(Structure):
+    _fields_ = [
+        ("address", 6 * c_ubyte),
+        ("rssi", c_int),
+        ("timestamp", c_uint64),
+        ("adv_data", BLE_ADV_DATA_LEN * c_ubyte)
+    ]
+
+scan_batch_cb_t = CFUNCTYPE(None, POINTER(ble_scan_report_t), c_int)
+
+## Scan filters
+BLE_SCAN_FILTER_ADDRESS = 0
+BLE_SCAN_FILTER_SERVICE_UUID = 1
+BLE_SCAN_FILTER_MANUFACTURER_DATA = 2
+
+class ble_scan_filter_t(Structure):
+    _fields_ = [
+        ("type", c_int),
+        ("address", 6 * c_ubyte),
+        ("uuid", 16 * c_ubyte),
+        ("company_id", c_ushort),
+        ("data", BLE_ADV_DATA_LEN * c_ubyte),
+        ("data_len", c_ubyte)
+    ]
+
+## Attribute tree of ble_gatt_discover_all()
+class ble_gatt_db_srvc_t(Structure):
+    _fields_ = [
+        ("id", c_int),
+        ("uuid", 16 * c_ubyte),
+        ("is_primary", c_ubyte),
+        ("char_start", c_int),
+        ("char_count", c_int)
+    ]
+
+class ble_gatt_db_char_t(Structure):
+    _fields_ = [
+        ("id", c_int),
+        ("uuid", 16 * c_ubyte),
+        ("properties", c_int),
+        ("desc_start", c_int),
+        ("desc_count", c_int)
+    ]
+
+class ble_gatt_db_desc_t(Structure):
+    _fields_ = [
+        ("id", c_int),
+        ("uuid", 16 * c_ubyte)
+    ]
+
+class ble_gatt_db_t(Structure):
+    _fields_ = [
+        ("srvcs", POINTER(ble_gatt_db_srvc_t)),
+        ("srvc_count", c_int),
+        ("chars", POINTER(ble_gatt_db_char_t)),
+        ("char_count", c_int),
+        ("descs", POINTER(ble_gatt_db_desc_t)),
+        ("desc_count", c_int)
+    ]
+
+gatt_discovery_cb_t = CFUNCTYPE(None, c_int, POINTER(ble_gatt_db_t), c_int)
+
+## Results of ble_gatt_read_multiple()
+class ble_gatt_read_result_t(Structure):
+    _fields_ = [
+        ("char_id", c_int),
+        ("status", c_int),
+        ("value", POINTER(c_ubyte)),
+        ("len", c_ushort)
+    ]
+
+gatt_read_multiple_cb_t = CFUNCTYPE(None, c_int,
+                                    POINTER(ble_gatt_read_result_t), c_int)
+
+gatt_write_long_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
+
+## Notification ring
+BLE_GATT_MAX_ATTR_LEN = 600
+
+class ble_notification_t(Structure):
+    _fields_ = [
+        ("conn_id", c_int),
+        ("char_id", c_int),
+        ("timestamp", c_ulonglong),
+        ("is_indication", c_ubyte),
+        ("len", c_ushort),
+        ("value", BLE_GATT_MAX_ATTR_LEN * c_ubyte)
+    ]
+
+notification_batch_cb_t = CFUNCTYPE(None, POINTER(ble_notification_t), c_int)
+
+gatt_stream_producer_t = CFUNCTYPE(c_int, c_int, c_int, POINTER(c_ubyte), c_int)
+gatt_stream_cb_t = CFUNCTYPE(None, c_int, c_int, c_ulonglong, c_uint, c_int)
+
 ## BLE callbacks structure
 class ble_cbs_t(Structure):
     _fields_ = [
@@ -83,9 +180,50 @@ def enable(cbs):
     libble.ble_enable(cbs)
 
 disable = libble.ble_disable
+get_event_fd = libble.ble_get_event_fd
+dispatch = libble.ble_dispatch
+dispatch_drops = libble.ble_dispatch_drops
+dispatch_drops.restype = c_ulong
 start_scan = libble.ble_start_scan
 stop_scan = libble.ble_stop_scan
 
+# libble keeps the callback, so keep a reference to it as well
+_scan_batch_cb = None
+
+def set_scan_batching(max_reports, max_delay_ms, cb):
+    global _scan_batch_cb
+    _scan_batch_cb = scan_batch_cb_t(cb) if cb is not None else None
+    return libble.ble_set_scan_batching(max_reports, max_delay_ms, _scan_batch_cb)
+
+flush_scan_batch = libble.ble_flush_scan_batch
+set_scan_coalescing = libble.ble_set_scan_coalescing
+
+def address_filter(address):
+    f = ble_scan_filter_t()
+    f.type = BLE_SCAN_FILTER_ADDRESS
+    f.address = bda_from_string(address)
+    return f
+
+def service_uuid_filter(uuid):
+    f = ble_scan_filter_t()
+    f.type = BLE_SCAN_FILTER_SERVICE_UUID
+    f.uuid = uuid_from_string(uuid)
+    return f
+
+def manufacturer_data_filter(company_id, data = ''):
+    f = ble_scan_filter_t()
+    f.type = BLE_SCAN_FILTER_MANUFACTURER_DATA
+    f.company_id = company_id
+    f.data_len = len(data) / 2
+    for i in range(f.data_len):
+        f.data[i] = int(data[2 * i:2 * i + 2], 16)
+    return f
+
+def set_scan_filters(filters, min_rssi = -128):
+    return libble.ble_set_scan_filters((len(filters) * ble_scan_filter_t)(*filters), len(filters), min_rssi)
+
+clear_scan_filters = libble.ble_clear_scan_filters
+
 def connect(address):
     libble.ble_connect(bda_from_string(address))
 
@@ -101,6 +239,13 @@ def cancel_pairing(address):
 def remove_bond(address):
     libble.ble_remove_bond(bda_from_string(address))
 
+set_gatt_cache = libble.ble_set_gatt_cache
+
+def gatt_cache_invalidate(address = None):
+    if address is None:
+        return libble.ble_gatt_cache_invalidate(None)
+    return libble.ble_gatt_cache_invalidate(bda_from_string(address))
+
 read_remote_rssi = libble.ble_read_remote_rssi
 
 def gatt_discover_services(conn_id, uuid):
@@ -110,7 +255,30 @@ def gatt_discover_services(conn_id, uuid):
 gatt_get_included_services = libble.ble_gatt_get_included_services
 gatt_discover_characteristics = libble.ble_gatt_discover_characteristics
 gatt_discover_descriptors = libble.ble_gatt_discover_descriptors
+
+# Keep a reference to each running discovery callback, by conn_id
+_discovery_cbs = {}
+
+def gatt_discover_all(conn_id, cb):
+    _discovery_cbs[conn_id] = gatt_discovery_cb_t(cb)
+    return libble.ble_gatt_discover_all(conn_id, _discovery_cbs[conn_id])
 gatt_read_char = libble.ble_gatt_read_char
+
+# Keep a reference to each read_multiple callback until it's called
+_read_multiple_cbs = []
+
+def gatt_read_multiple(conn_id, char_ids, auth, cb):
+    def done(conn_id, results, count):
+        _read_multiple_cbs.remove(c)
+        cb(conn_id, results, count)
+
+    c = gatt_read_multiple_cb_t(done)
+    _read_multiple_cbs.append(c)
+    ids = (len(char_ids) * c_int)(*char_ids)
+    r = libble.ble_gatt_read_multiple(conn_id, ids, len(char_ids), auth, c)
+    if r != 0:
+        _read_multiple_cbs.remove(c)
+    return r
 gatt_read_desc = libble.ble_gatt_read_desc
 
 def gatt_write_cmd_char(conn_id, char_id, auth, value, l):
@@ -138,8 +306,71 @@ def gatt_prep_write_desc(conn_id, desc_id, auth, value, l):
     libble.ble_gatt_prep_write_desc
 
 gatt_execute_write = libble.ble_gatt_execute_write
+
+# Keep a reference to each write_long_char callback until it finishes
+_write_long_cbs = []
+
+def gatt_write_long_char(conn_id, char_id, auth, value, l, cb):
+    def finished(conn_id, char_id, status):
+        _write_long_cbs.remove(c)
+        cb(conn_id, char_id, status)
+
+    v = hex_string_to_ubyte_pointer(value, l)
+    c = gatt_write_long_cb_t(finished)
+    _write_long_cbs.append(c)
+    r = libble.ble_gatt_write_long_char(conn_id, char_id, auth, v, l, c)
+    if r != 0:
+        _write_long_cbs.remove(c)
+    return r
+
+# Keep the data and callbacks of each stream until it finishes
+_streams = []
+
+# producer is called with (conn_id, char_id, size) and returns a hex string of
+# at most size bytes, empty at the end of the data
+def gatt_stream_char(conn_id, char_id, value, l, producer, credits, cb):
+    def produce(conn_id, char_id, buf, size):
+        d = producer(conn_id, char_id, size)
+        if d is None or len(d) > size * 2:
+            return -1
+        for i in range(0, len(d), 2):
+            buf[i/2] = int(d[i:i+2], 16)
+        return len(d) / 2
+
+    def finished(conn_id, char_id, sent, rate, status):
+        _streams.remove(k)
+        cb(conn_id, char_id, sent, rate, status)
+
+    v = None
+    if value is not None:
+        v = hex_string_to_ubyte_pointer(value, l)
+    p = gatt_stream_producer_t(produce) if producer else \
+        gatt_stream_producer_t()
+    c = gatt_stream_cb_t(finished)
+    k = (v, p, c)
+    _streams.append(k)
+    r = libble.ble_gatt_stream_char(conn_id, char_id, v, l, p, credits, c)
+    if r != 0 and k in _streams:
+        _streams.remove(k)
+    return r
+gatt_stream_cancel = libble.ble_gatt_stream_cancel
+
+_notification_batch_cb = None
+
+def set_notification_ring(size, cb):
+    global _notification_batch_cb
+    _notification_batch_cb = notification_batch_cb_t(cb) if cb is not None \
+                             else None
+    return libble.ble_set_notification_ring(size, _notification_batch_cb)
+
+def poll_notifications(cb, max):
+    return libble.ble_poll_notifications(notification_batch_cb_t(cb), max)
+
+notification_drops = libble.ble_notification_drops
+notification_drops.restype = c_ulong
 gatt_register_char_notification = libble.ble_gatt_register_char_notification
 gatt_unregister_char_notification = libble.ble_gatt_unregister_char_notification
+gatt_set_char_notification_handler = libble.ble_gatt_set_char_notification_handler
 
 ## Utils
 
@@ -160,6 +391,11 @@ def py_adapter_state_cb(state): # void (uint8_t state)
 def py_scan_cb(address, rssi, adv_data): # void (const uint8_t *address, int rssi, const uint8_t *adv_data)
     print "Found %02X:%02X:%02X:%02X:%02X:%02X RSSI %d" % (address[0], address[1], address[2], address[3], address[4], address[5], rssi)
 
+def py_scan_batch_cb(reports, count): # void (const ble_scan_report_t *reports, int count)
+    for i in range(count):
+        r = reports[i]
+        print "Found %02X:%02X:%02X:%02X:%02X:%02X RSSI %d at %d ms" % (r.address[0], r.address[1], r.address[2], r.address[3], r.address[4], r.address[5], r.rssi, r.timestamp)
+
 def py_connect_cb(address, conn_id, status): # void (const uint8_t *address, int conn_id, int status):
     print "%02X:%02X:%02X:%02X:%02X:%02X connected: conn_id %d status %d" % (address[0], address[1], address[2], address[3], address[4], address[5], conn_id, status)
 
@@ -250,10 +486,27 @@ cbs = ble_cbs_t(enable_cb_t(py_enable_cb),
 __all__ = [libble, enable_cb_t, adapter_state_cb_t, scan_cb_t, connect_cb_t,
            bond_state_cb_t, rssi_cb_t, gatt_found_cb_t, gatt_finished_cb_t,
            gatt_response_cb_t, gatt_notification_register_cb_t,
-           gatt_notification_cb_t, ble_cbs_t, enable, disable, start_scan,
-           stop_scan, connect, disconnect, pair, remove_bond, read_remote_rssi,
+           gatt_notification_cb_t, ble_cbs_t, ble_scan_report_t,
+           scan_batch_cb_t, enable, disable, get_event_fd, dispatch,
+           start_scan, stop_scan,
+           set_scan_batching, flush_scan_batch, set_scan_coalescing,
+           ble_scan_filter_t, address_filter, service_uuid_filter,
+           manufacturer_data_filter, set_scan_filters, clear_scan_filters,
+           connect,
+           disconnect, pair, remove_bond, set_gatt_cache,
+           gatt_cache_invalidate, read_remote_rssi,
            gatt_discover_services, gatt_discover_characteristics,
-           gatt_discover_descriptors, gatt_read_char, gatt_read_desc,
-           gatt_write_cmd_char, gatt_write_req_char, gatt_write_cmd_desc,
-           gatt_write_req_desc, gatt_register_char_notification,
-           gatt_unregister_char_notification]
+           gatt_discover_descriptors, ble_gatt_db_srvc_t, ble_gatt_db_char_t,
+           ble_gatt_db_desc_t, ble_gatt_db_t, gatt_discovery_cb_t,
+           gatt_discover_all, ble_gatt_read_result_t,
+           gatt_read_multiple_cb_t, gatt_read_char, gatt_read_multiple,
+           gatt_read_desc, gatt_write_cmd_char, gatt_write_req_char,
+           gatt_write_cmd_desc,
+           gatt_write_req_desc, gatt_write_long_cb_t, gatt_write_long_char,
+           gatt_stream_producer_t, gatt_stream_cb_t, gatt_stream_char,
+           gatt_stream_cancel, BLE_GATT_MAX_ATTR_LEN, ble_notification_t,
+           notification_batch_cb_t, set_notification_ring, poll_notifications,
+           notification_drops,
+           gatt_register_char_notification,
+           gatt_unregister_char_notification,
+           gatt_set_char_notification_handler]
@@ -8,3 +8,25 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := libble-scan
 
 include $(BUILD_EXECUTABLE)
+
+# Host build against the fake Bluetooth HAL
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_HEADERS)
+LOCAL_SRC_FILES := libble-scan.c
+LOCAL_SHARED_LIBRARIES := libble libfakehal
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := libble-scan
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_HEADERS)
+LOCAL_SRC_FILES := libble-bench.c
+LOCAL_SHARED_LIBRARIES := libble libfakehal
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := libble-bench
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,1371 @@
+/*
+ *  libble-bench -- Measures libble hot paths against the fake Bluetooth HAL
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libble/ble.h>
+#include <fakehal/fakehal.h>
+
+static volatile uint8_t enabled;
+static int connected;
+static int last_conn_id;
+static int rssi_count;
+static int found_count;
+static int read_count;
+
+#define NOTIFY_CHARS 100
+
+static int notify_counts[NOTIFY_CHARS];
+static int misrouted;
+
+static int scan_reports;
+static int scan_calls;
+
+/* Discovery completions, signalled from the callback thread */
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+static int finished;
+static int discovered;
+static int signal_answers; /* Signal each read or write answer */
+static const char *expect_value; /* Checked against the values read */
+static int expect_len;
+static int mismatches;
+static int write_status;
+static uint32_t stream_rate;
+
+static void enable_cb(void) {
+    enabled = 1;
+}
+
+static void connect_cb(const uint8_t *address, int conn_id, int status) {
+    if (status == 0) {
+        connected++;
+        last_conn_id = conn_id;
+    }
+}
+
+static void rssi_cb(int conn_id, int rssi, int status) {
+    if (status == 0)
+        rssi_count++;
+}
+
+static void scan_cb(const uint8_t *address, int rssi,
+                    const uint8_t *adv_data) {
+    scan_reports++;
+    scan_calls++;
+}
+
+static void scan_batch_cb(const ble_scan_report_t *reports, int count) {
+    scan_reports += count;
+    scan_calls++;
+}
+
+static void found_cb(int conn_id, int id, const uint8_t *uuid, int props) {
+    found_count++;
+}
+
+static void signal_finished(void);
+
+/* Application threads issuing reads concurrently, each one waiting for the
+ * answers to its own */
+#define CALLERS_MAX 8
+
+static struct caller {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int conn_id;
+    int char_id;
+    int reads;
+    int answered;
+    int failed;
+} callers[CALLERS_MAX];
+static int caller_count;
+
+static void caller_answer(int conn_id, int id, int status) {
+    struct caller *c;
+    int i;
+
+    for (i = 0; i < caller_count; i++) {
+        c = &callers[i];
+        if (c->conn_id != conn_id || c->char_id != id)
+            continue;
+
+        pthread_mutex_lock(&c->lock);
+        c->answered++;
+        if (status != 0)
+            c->failed++;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+}
+
+static void read_cb(int conn_id, int id, const uint8_t *value, uint16_t len,
+                    uint16_t type, int status) {
+    if (caller_count) {
+        caller_answer(conn_id, id, status);
+        return;
+    }
+
+    if (status == 0 && id >= 0)
+        read_count++;
+
+    if (expect_value && (status != 0 || len != expect_len ||
+                         memcmp(value, expect_value, len) != 0))
+        mismatches++;
+
+    if (signal_answers)
+        signal_finished();
+}
+
+static void signal_finished(void) {
+    pthread_mutex_lock(&finished_lock);
+    finished = 1;
+    pthread_cond_signal(&finished_cond);
+    pthread_mutex_unlock(&finished_lock);
+}
+
+static void wait_finished(void) {
+    pthread_mutex_lock(&finished_lock);
+    while (!finished)
+        pthread_cond_wait(&finished_cond, &finished_lock);
+    finished = 0;
+    pthread_mutex_unlock(&finished_lock);
+}
+
+static void finished_cb(int conn_id, int status) {
+    signal_finished();
+}
+
+static void read_multiple_cb(int conn_id, const ble_gatt_read_result_t *results,
+                             int count) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (results[i].status == 0 && results[i].len > 0 &&
+            results[i].value[0] == results[i].char_id)
+            read_count++;
+
+    signal_finished();
+}
+
+static void discovery_cb(int conn_id, const ble_gatt_db_t *db, int status) {
+    discovered = status == 0 ? db->srvc_count + db->char_count +
+                               db->desc_count : -1;
+    signal_finished();
+}
+
+/* Value sent by write_cb one chunk after the other */
+static const char *chain_value;
+static int chain_len;
+static int chain_offset;
+
+static int chain_write(int conn_id) {
+    int n = chain_len - chain_offset;
+
+    if (n <= 0)
+        return 0;
+
+    if (n > BLE_GATT_STREAM_CHUNK)
+        n = BLE_GATT_STREAM_CHUNK;
+    ble_gatt_write_cmd_char(conn_id, 0, 0, chain_value + chain_offset, n);
+    chain_offset += n;
+
+    return 1;
+}
+
+static void write_cb(int conn_id, int id, const uint8_t *value, uint16_t len,
+                     uint16_t type, int status) {
+    write_status = status;
+
+    if (chain_value && !status && chain_write(conn_id))
+        return;
+
+    if (signal_answers || chain_value)
+        signal_finished();
+}
+
+static void write_long_cb(int conn_id, int char_id, int status) {
+    write_status = status;
+    signal_finished();
+}
+
+static void stream_cb(int conn_id, int char_id, uint64_t sent,
+                      uint32_t bytes_per_sec, int status) {
+    write_status = status;
+    stream_rate = bytes_per_sec;
+    signal_finished();
+}
+
+/* Notifications are all expected on the per-characteristic handlers */
+static void notify_cb(int conn_id, int char_id, const uint8_t *value,
+                      uint16_t len, uint8_t is_indication) {
+    misrouted++;
+}
+
+static void notify_handler(int conn_id, int char_id, const uint8_t *value,
+                           uint16_t len, uint8_t is_indication) {
+    if (char_id < 0 || char_id >= NOTIFY_CHARS || value[0] != char_id)
+        misrouted++;
+    else
+        notify_counts[char_id]++;
+}
+
+#define CONSUMER_NS 500 /* Work done by the application per notification */
+
+static uint64_t now_ns(void);
+
+static void consume(void) {
+    uint64_t end = now_ns() + CONSUMER_NS;
+
+    while (now_ns() < end);
+}
+
+static volatile int consumed;
+
+static void slow_handler(int conn_id, int char_id, const uint8_t *value,
+                         uint16_t len, uint8_t is_indication) {
+    consume();
+    consumed++;
+}
+
+static void slow_batch_cb(const ble_notification_t *notifications,
+                          int count) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        consume();
+    consumed += count;
+}
+
+static ble_cbs_t ble_cbs = {
+    .enable_cb = enable_cb,
+    .connect_cb = connect_cb,
+    .scan_cb = scan_cb,
+    .rssi_cb = rssi_cb,
+    .srvc_found_cb = found_cb,
+    .srvc_finished_cb = finished_cb,
+    .char_found_cb = found_cb,
+    .char_finished_cb = finished_cb,
+    .desc_found_cb = found_cb,
+    .desc_finished_cb = finished_cb,
+    .char_read_cb = read_cb,
+    .char_write_cb = write_cb,
+    .desc_read_cb = read_cb,
+    .char_notification_cb = notify_cb,
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void device_address(int i, uint8_t *address) {
+    address[0] = 0x00;
+    address[1] = 0x1b;
+    address[2] = (i >> 24) & 0xff;
+    address[3] = (i >> 16) & 0xff;
+    address[4] = (i >> 8) & 0xff;
+    address[5] = i & 0xff;
+}
+
+/* Cost of the connection callbacks (read remote RSSI round trips, which look
+ * devices up both by conn_id and by address) as the device count grows */
+static int bench_devices(int iterations) {
+    static const int counts[] = { 1, 10, 100, 1000, 10000 };
+    uint8_t address[6];
+    int *conn_ids, n, i, c;
+    uint64_t start, elapsed;
+
+    conn_ids = malloc(counts[sizeof(counts) / sizeof(counts[0]) - 1] *
+                      sizeof(int));
+    if (!conn_ids)
+        return -1;
+
+    printf("%10s %12s\n", "devices", "ns/callback");
+
+    n = 0;
+    for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++) {
+        /* Connect new devices until there are counts[c] of them */
+        for (; n < counts[c]; n++) {
+            device_address(n, address);
+            fakehal_add_device(address, -40 - n % 50, NULL, 0);
+
+            connected = 0;
+            if (ble_connect(address) < 0 || connected != 1) {
+                printf("Failed to connect device %d\n", n);
+                free(conn_ids);
+                return -1;
+            }
+            /* The fake HAL hands out conn_ids sequentially from 1 */
+            conn_ids[n] = n + 1;
+        }
+
+        rssi_count = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            ble_read_remote_rssi(conn_ids[(i * 7919) % n]);
+        elapsed = now_ns() - start;
+
+        if (rssi_count != iterations) {
+            printf("Lost %d callbacks\n", iterations - rssi_count);
+            free(conn_ids);
+            return -1;
+        }
+
+        printf("%10d %12.1f\n", n, (double) elapsed / iterations);
+    }
+
+    free(conn_ids);
+
+    return 0;
+}
+
+/* Connects to a new device with one service of n characteristics, each one
+ * with a descriptor, and discovers all of them. Returns the conn_id. */
+static int connect_gatt_device(int i, int n, uint8_t *address) {
+    uint8_t uuid[16];
+    int srvc, chr, conn_id;
+
+    device_address(0x10000 + i, address);
+    fakehal_add_device(address, -50, NULL, 0);
+
+    memset(uuid, 0, sizeof(uuid));
+    uuid[12] = 0xff;
+    srvc = fakehal_add_service(address, uuid, 1);
+    for (i = 0; i < n; i++) {
+        uuid[0] = 1;
+        uuid[12] = i & 0xff;
+        uuid[13] = (i >> 8) & 0xff;
+        chr = fakehal_add_characteristic(address, srvc, uuid, 0x12);
+        uuid[0] = 2;
+        fakehal_add_descriptor(address, srvc, chr, uuid);
+    }
+
+    connected = 0;
+    if (ble_connect(address) < 0 || connected != 1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+    conn_id = last_conn_id;
+
+    found_count = 0;
+    ble_gatt_discover_services(conn_id, NULL);
+    ble_gatt_discover_characteristics(conn_id, 0);
+    for (i = 0; i < n; i++)
+        ble_gatt_discover_descriptors(conn_id, i);
+    if (found_count != 1 + 2 * n) {
+        printf("Discovered %d of %d attributes\n", found_count, 1 + 2 * n);
+        return -1;
+    }
+
+    return conn_id;
+}
+
+/* Cost of resolving the attribute of a read response as the number of
+ * characteristics (each one with a descriptor) of the device grows */
+static int bench_chars(int iterations) {
+    static const int counts[] = { 1, 10, 100, 1000 };
+    uint8_t address[6];
+    int n, i, c, conn_id;
+    uint64_t start, char_ns, desc_ns;
+
+    printf("%10s %14s %14s\n", "chars", "ns/char read", "ns/desc read");
+
+    for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++) {
+        n = counts[c];
+
+        conn_id = connect_gatt_device(c, n, address);
+        if (conn_id < 0)
+            return -1;
+
+        /* The last attribute is the worst case of a linear search */
+        read_count = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            ble_gatt_read_char(conn_id, n - 1, 0);
+        char_ns = now_ns() - start;
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            ble_gatt_read_desc(conn_id, n - 1, 0);
+        desc_ns = now_ns() - start;
+
+        if (read_count != 2 * iterations) {
+            printf("Lost %d callbacks\n", 2 * iterations - read_count);
+            return -1;
+        }
+
+        printf("%10d %14.1f %14.1f\n", n, (double) char_ns / iterations,
+               (double) desc_ns / iterations);
+    }
+
+    return 0;
+}
+
+/* Cost of delivering notifications of many characteristics to their own
+ * handlers */
+static int bench_notify(int iterations) {
+    uint8_t address[6], value[20];
+    int i, conn_id;
+    uint64_t start, elapsed;
+
+    conn_id = connect_gatt_device(0, NOTIFY_CHARS, address);
+    if (conn_id < 0)
+        return -1;
+
+    for (i = 0; i < NOTIFY_CHARS; i++)
+        ble_gatt_set_char_notification_handler(conn_id, i, notify_handler);
+
+    memset(value, 0, sizeof(value));
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        value[0] = i % NOTIFY_CHARS;
+        fakehal_notify(address, 0, value[0], value, sizeof(value), 1);
+    }
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < NOTIFY_CHARS; i++)
+        if (notify_counts[i] != iterations / NOTIFY_CHARS +
+            (i < iterations % NOTIFY_CHARS))
+            misrouted++;
+
+    printf("%d characteristics, %.1f ns/notification, %d misrouted\n",
+           NOTIFY_CHARS, (double) elapsed / iterations, misrouted);
+
+    return misrouted ? -1 : 0;
+}
+
+/* Notifications handed over to the main thread, one at a time */
+static int handed_over;
+
+static void hand_over_handler(int conn_id, int char_id, const uint8_t *value,
+                              uint16_t len, uint8_t is_indication) {
+    pthread_mutex_lock(&finished_lock);
+    handed_over++;
+    pthread_cond_signal(&finished_cond);
+    pthread_mutex_unlock(&finished_lock);
+}
+
+static void count_handler(int conn_id, int char_id, const uint8_t *value,
+                          uint16_t len, uint8_t is_indication) {
+    handed_over++;
+}
+
+/* Notifications reaching the main thread: from callbacks on the stack thread
+ * versus dispatched from the event fd */
+static int bench_dispatch(int iterations) {
+    uint8_t address[6], value[20];
+    int i, conn_id, fd, callback_wakeups = 0, fd_wakeups = 0;
+    uint64_t start, callback_ns, fd_ns;
+    struct pollfd pfd;
+
+    conn_id = connect_gatt_device(0, 1, address);
+    if (conn_id < 0)
+        return -1;
+
+    memset(value, 0, sizeof(value));
+    fakehal_set_inline(0);
+
+    ble_gatt_set_char_notification_handler(conn_id, 0, hand_over_handler);
+    handed_over = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        fakehal_notify(address, 0, 0, value, sizeof(value), 1);
+    pthread_mutex_lock(&finished_lock);
+    while (handed_over < iterations) {
+        pthread_cond_wait(&finished_cond, &finished_lock);
+        callback_wakeups++;
+    }
+    pthread_mutex_unlock(&finished_lock);
+    callback_ns = now_ns() - start;
+
+    fd = ble_get_event_fd();
+    if (fd < 0) {
+        printf("Failed to get the event fd\n");
+        fakehal_set_inline(1);
+        return -1;
+    }
+
+    ble_gatt_set_char_notification_handler(conn_id, 0, count_handler);
+    handed_over = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        fakehal_notify(address, 0, 0, value, sizeof(value), 1);
+    /* Dropped events never reach the handler */
+    while (handed_over + (int) ble_dispatch_drops() < iterations) {
+        if (poll(&pfd, 1, -1) < 0)
+            break;
+        fd_wakeups++;
+        ble_dispatch(0);
+    }
+    fd_ns = now_ns() - start;
+
+    fakehal_set_inline(1);
+
+    if (handed_over != iterations) {
+        printf("Lost %d notifications\n", iterations - handed_over);
+        return -1;
+    }
+
+    printf("%-10s %16s %10s\n", "", "ns/notification", "wakeups");
+    printf("%-10s %16.1f %10d\n", "callback", (double) callback_ns / iterations,
+           callback_wakeups);
+    printf("%-10s %16.1f %10d\n", "event fd", (double) fd_ns / iterations,
+           fd_wakeups);
+
+    return 0;
+}
+
+#define NOTIFY_RING_SIZE 4096
+
+/* Notifications for a consumer spending CONSUMER_NS on each one: handled on
+ * the stack thread, versus queued on the notification ring and consumed by
+ * the libble thread or by polling */
+static int bench_notify_ring(int iterations) {
+    uint8_t address[6], value[20];
+    int i, conn_id;
+    uint64_t start, direct_ns, push_ns, ring_ns, poll_ns, poll_push_ns = 0, t;
+    unsigned long drops, poll_drops;
+
+    conn_id = connect_gatt_device(0, 1, address);
+    if (conn_id < 0)
+        return -1;
+
+    memset(value, 0, sizeof(value));
+
+    ble_gatt_set_char_notification_handler(conn_id, 0, slow_handler);
+    consumed = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        fakehal_notify(address, 0, 0, value, sizeof(value), 1);
+    direct_ns = now_ns() - start;
+
+    if (ble_set_notification_ring(NOTIFY_RING_SIZE, slow_batch_cb) < 0) {
+        printf("Failed to enable the notification ring\n");
+        return -1;
+    }
+
+    /* As fast as the stack can go, whatever doesn't fit is dropped */
+    consumed = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        fakehal_notify(address, 0, 0, value, sizeof(value), 1);
+    push_ns = now_ns() - start;
+    drops = ble_notification_drops();
+    while (consumed + drops < (unsigned long) iterations)
+        usleep(100);
+    ring_ns = now_ns() - start;
+
+    /* Polled every half ring, nothing is dropped */
+    ble_set_notification_ring(NOTIFY_RING_SIZE, NULL);
+    consumed = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        t = now_ns();
+        fakehal_notify(address, 0, 0, value, sizeof(value), 1);
+        poll_push_ns += now_ns() - t;
+        if (i % (NOTIFY_RING_SIZE / 2) == NOTIFY_RING_SIZE / 2 - 1)
+            ble_poll_notifications(slow_batch_cb, NOTIFY_RING_SIZE);
+    }
+    ble_poll_notifications(slow_batch_cb, NOTIFY_RING_SIZE);
+    poll_ns = now_ns() - start;
+    poll_drops = ble_notification_drops();
+
+    ble_set_notification_ring(0, NULL);
+
+    if (consumed != iterations) {
+        printf("Lost %d polled notifications\n", iterations - consumed);
+        return -1;
+    }
+
+    printf("%d ns of work per notification, %d records\n", CONSUMER_NS,
+           NOTIFY_RING_SIZE);
+    printf("%-10s %16s %16s %10s\n", "", "stack ns/notif", "delivered/s",
+           "dropped");
+    printf("%-10s %16.1f %16.0f %10d\n", "handler",
+           (double) direct_ns / iterations, iterations * 1e9 / direct_ns, 0);
+    printf("%-10s %16.1f %16.0f %10lu\n", "ring",
+           (double) push_ns / iterations,
+           (iterations - drops) * 1e9 / ring_ns, drops);
+    printf("%-10s %16.1f %16.0f %10lu\n", "ring poll",
+           (double) poll_push_ns / iterations, iterations * 1e9 / poll_ns,
+           poll_drops);
+
+    return 0;
+}
+
+/* Throughput of reads through the callback thread, each one requested after
+ * the previous answer versus all of them requested at once */
+static int bench_ops(int iterations) {
+    uint8_t address[6];
+    int conn_id, i;
+    uint64_t start, serial_ns, queued_ns;
+
+    conn_id = connect_gatt_device(0, 1, address);
+    if (conn_id < 0)
+        return -1;
+
+    fakehal_set_inline(0);
+    signal_answers = 1;
+
+    read_count = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        ble_gatt_read_char(conn_id, 0, 0);
+        wait_finished();
+    }
+    serial_ns = now_ns() - start;
+
+    if (read_count != iterations) {
+        printf("%d of %d serialized reads failed\n", iterations - read_count,
+               iterations);
+        signal_answers = 0;
+        fakehal_set_inline(1);
+        return -1;
+    }
+
+    read_count = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        if (ble_gatt_read_char(conn_id, 0, 0) < 0)
+            break;
+    pthread_mutex_lock(&finished_lock);
+    while (read_count < i)
+        pthread_cond_wait(&finished_cond, &finished_lock);
+    finished = 0;
+    pthread_mutex_unlock(&finished_lock);
+    queued_ns = now_ns() - start;
+
+    signal_answers = 0;
+    fakehal_set_inline(1);
+
+    if (read_count != iterations) {
+        printf("%d of %d queued reads failed\n", iterations - read_count,
+               iterations);
+        return -1;
+    }
+
+    printf("%-10s %10s\n", "", "ns/read");
+    printf("%-10s %10.1f\n", "serial", (double) serial_ns / iterations);
+    printf("%-10s %10.1f\n", "queued", (double) queued_ns / iterations);
+
+    return 0;
+}
+
+#define CALLERS_LATENCY 100 /* us per read answer */
+
+static void *caller_thread(void *arg) {
+    struct caller *c = arg;
+    int i, n;
+
+    for (i = 0; i < c->reads; i++) {
+        pthread_mutex_lock(&c->lock);
+        n = c->answered;
+        pthread_mutex_unlock(&c->lock);
+
+        if (ble_gatt_read_char(c->conn_id, c->char_id, 0) < 0) {
+            pthread_mutex_lock(&c->lock);
+            c->failed++;
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        while (c->answered == n)
+            pthread_cond_wait(&c->cond, &c->lock);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    return NULL;
+}
+
+/* Runs count callers, each one reading a characteristic of its own, and
+ * returns the reads per second of all of them together */
+static double run_callers(int count, int total, const int *conn_ids,
+                          int shared) {
+    uint64_t start, elapsed;
+    int i, failed = 0;
+
+    for (i = 0; i < count; i++) {
+        struct caller *c = &callers[i];
+
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
+        c->conn_id = shared ? conn_ids[0] : conn_ids[i];
+        c->char_id = shared ? i : 0;
+        c->reads = total / count;
+        c->answered = 0;
+        c->failed = 0;
+    }
+    caller_count = count;
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        pthread_create(&callers[i].thread, NULL, caller_thread, &callers[i]);
+    for (i = 0; i < count; i++) {
+        pthread_join(callers[i].thread, NULL);
+        failed += callers[i].failed;
+    }
+    elapsed = now_ns() - start;
+
+    caller_count = 0;
+    for (i = 0; i < count; i++) {
+        pthread_mutex_destroy(&callers[i].lock);
+        pthread_cond_destroy(&callers[i].cond);
+    }
+
+    if (failed) {
+        printf("%d of %d reads failed\n", failed, total);
+        return -1;
+    }
+
+    return (double) (total / count) * count * 1e9 / elapsed;
+}
+
+/* Throughput of reads issued concurrently from several application threads,
+ * on a device per thread versus all of them on the same device */
+static int bench_threads(int iterations) {
+    static const int counts[] = { 1, 2, 4, 8 };
+    int conn_ids[CALLERS_MAX];
+    uint8_t address[6];
+    double separate[sizeof(counts) / sizeof(counts[0])];
+    double shared[sizeof(counts) / sizeof(counts[0])];
+    int i, status = 0;
+
+    for (i = 0; i < CALLERS_MAX; i++) {
+        conn_ids[i] = connect_gatt_device(i, CALLERS_MAX, address);
+        if (conn_ids[i] < 0)
+            return -1;
+    }
+
+    fakehal_set_inline(0);
+    fakehal_set_latency(CALLERS_LATENCY);
+
+    for (i = 0; i < (int) (sizeof(counts) / sizeof(counts[0])); i++) {
+        separate[i] = run_callers(counts[i], iterations, conn_ids, 0);
+        shared[i] = run_callers(counts[i], iterations, conn_ids, 1);
+        if (separate[i] < 0 || shared[i] < 0) {
+            status = -1;
+            break;
+        }
+    }
+
+    fakehal_set_latency(0);
+    fakehal_flush();
+    fakehal_set_inline(1);
+
+    if (status < 0)
+        return -1;
+
+    printf("%d reads, %d us per answer\n", iterations, CALLERS_LATENCY);
+    printf("%-8s %16s %16s\n", "threads", "reads/s devices", "reads/s shared");
+    for (i = 0; i < (int) (sizeof(counts) / sizeof(counts[0])); i++)
+        printf("%-8d %16.0f %16.0f\n", counts[i], separate[i], shared[i]);
+
+    return 0;
+}
+
+#define POLL_CHARS 16
+
+/* Cost of polling a bank of characteristics through the callback thread, one
+ * read (and callback) per characteristic versus ble_gatt_read_multiple() */
+static int bench_read_multiple(int iterations) {
+    uint8_t address[6], value[4];
+    int conn_id, ids[POLL_CHARS], i, j;
+    uint64_t start, single_ns, multi_ns;
+
+    conn_id = connect_gatt_device(0, POLL_CHARS, address);
+    if (conn_id < 0)
+        return -1;
+
+    memset(value, 0, sizeof(value));
+    for (j = 0; j < POLL_CHARS; j++) {
+        value[0] = j;
+        fakehal_set_char_value(address, 0, j, value, sizeof(value));
+        ids[j] = j;
+    }
+
+    fakehal_set_inline(0);
+
+    read_count = 0;
+    signal_answers = 1;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < POLL_CHARS; j++)
+            ble_gatt_read_char(conn_id, ids[j], 0);
+
+        pthread_mutex_lock(&finished_lock);
+        while (read_count < (i + 1) * POLL_CHARS)
+            pthread_cond_wait(&finished_cond, &finished_lock);
+        finished = 0;
+        pthread_mutex_unlock(&finished_lock);
+    }
+    single_ns = now_ns() - start;
+    signal_answers = 0;
+
+    if (read_count != iterations * POLL_CHARS) {
+        printf("Lost %d reads\n", iterations * POLL_CHARS - read_count);
+        fakehal_set_inline(1);
+        return -1;
+    }
+
+    read_count = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (ble_gatt_read_multiple(conn_id, ids, POLL_CHARS, 0,
+                                   read_multiple_cb) < 0)
+            break;
+        wait_finished();
+    }
+    multi_ns = now_ns() - start;
+
+    fakehal_set_inline(1);
+
+    if (read_count != iterations * POLL_CHARS) {
+        printf("Lost %d reads\n", iterations * POLL_CHARS - read_count);
+        return -1;
+    }
+
+    printf("%d characteristics per poll\n", POLL_CHARS);
+    printf("%-14s %10s\n", "", "ns/poll");
+    printf("%-14s %10.1f\n", "read_char", (double) single_ns / iterations);
+    printf("%-14s %10.1f\n", "read_multiple", (double) multi_ns / iterations);
+
+    return 0;
+}
+
+#define LONG_WRITE_LEN 512
+
+/* Time to write a long value through the callback thread, with a write
+ * request versus ble_gatt_write_long_char(). The stack splits both in
+ * prepared writes, the value is read back to check it arrived whole. */
+static int bench_write_long(int iterations) {
+    uint8_t address[6];
+    char value[LONG_WRITE_LEN];
+    int conn_id, i;
+    uint64_t start, req_ns, long_ns;
+
+    conn_id = connect_gatt_device(0, 1, address);
+    if (conn_id < 0)
+        return -1;
+
+    for (i = 0; i < LONG_WRITE_LEN; i++)
+        value[i] = i;
+
+    fakehal_set_inline(0);
+
+    signal_answers = 1;
+    write_status = 0;
+    start = now_ns();
+    for (i = 0; i < iterations && !write_status; i++) {
+        ble_gatt_write_req_char(conn_id, 0, 0, value, LONG_WRITE_LEN);
+        wait_finished();
+    }
+    req_ns = now_ns() - start;
+    signal_answers = 0;
+
+    start = now_ns();
+    for (i = 0; i < iterations && !write_status; i++) {
+        if (ble_gatt_write_long_char(conn_id, 0, 0, value, LONG_WRITE_LEN,
+                                     write_long_cb) < 0)
+            write_status = -1;
+        else
+            wait_finished();
+    }
+    long_ns = now_ns() - start;
+
+    signal_answers = 1;
+    expect_value = value;
+    expect_len = LONG_WRITE_LEN;
+    mismatches = 0;
+    ble_gatt_read_char(conn_id, 0, 0);
+    wait_finished();
+    expect_value = NULL;
+    signal_answers = 0;
+
+    fakehal_set_inline(1);
+
+    if (write_status) {
+        printf("Write failed (%d)\n", write_status);
+        return -1;
+    }
+
+    if (mismatches) {
+        printf("Value read back differs from the one written\n");
+        return -1;
+    }
+
+    printf("%d bytes\n", LONG_WRITE_LEN);
+    printf("%-16s %10s\n", "", "us/write");
+    printf("%-16s %10.1f\n", "write_req_char",
+           req_ns / 1000.0 / iterations);
+    printf("%-16s %10.1f\n", "write_long_char",
+           long_ns / 1000.0 / iterations);
+
+    return 0;
+}
+
+#define STREAM_LATENCY 200 /* us per write answer */
+
+/* Throughput of write commands with a link latency, each one sent after the
+ * previous answer versus ble_gatt_stream_char() with several in flight */
+static int bench_stream(int iterations) {
+    static const int credits[] = { 1, 4, 8, 16 };
+    uint8_t address[6];
+    char *value, name[32];
+    int conn_id, i, len;
+    uint64_t start, serial_ns;
+    uint32_t rates[sizeof(credits) / sizeof(credits[0])];
+
+    conn_id = connect_gatt_device(0, 1, address);
+    if (conn_id < 0)
+        return -1;
+
+    /* iterations is the number of bytes */
+    len = iterations;
+    value = malloc(len);
+    if (!value)
+        return -1;
+    for (i = 0; i < len; i++)
+        value[i] = i;
+
+    fakehal_set_inline(0);
+    fakehal_set_latency(STREAM_LATENCY);
+
+    /* Each write is sent from the answer of the previous one */
+    chain_value = value;
+    chain_len = len;
+    chain_offset = 0;
+    write_status = 0;
+    finished = 0; /* Left set by the discovery */
+    start = now_ns();
+    chain_write(conn_id);
+    wait_finished();
+    serial_ns = now_ns() - start;
+    chain_value = NULL;
+
+    for (i = 0; i < (int) (sizeof(credits) / sizeof(credits[0])) &&
+                !write_status; i++) {
+        if (ble_gatt_stream_char(conn_id, 0, value, len, NULL, credits[i],
+                                 stream_cb) < 0)
+            write_status = -1;
+        else
+            wait_finished();
+        rates[i] = stream_rate;
+    }
+
+    fakehal_set_latency(0);
+    fakehal_set_inline(1);
+    free(value);
+
+    if (write_status) {
+        printf("Write failed (%d)\n", write_status);
+        return -1;
+    }
+
+    printf("%d bytes, %d us per answer\n", len, STREAM_LATENCY);
+    printf("%-16s %10s\n", "", "bytes/s");
+    printf("%-16s %10.0f\n", "write_cmd_char",
+           serial_ns ? len * 1e9 / serial_ns : 0.0);
+    for (i = 0; i < (int) (sizeof(credits) / sizeof(credits[0])); i++) {
+        snprintf(name, sizeof(name), "stream %d", credits[i]);
+        printf("%-16s %10u\n", name, rates[i]);
+    }
+
+    return 0;
+}
+
+#define DISCOVER_SRVCS 10
+#define DISCOVER_CHARS 10 /* Per service, each one with a descriptor */
+
+/* Time to discover a whole device through the callback thread, driving each
+ * stage from the application versus ble_gatt_discover_all() */
+static int bench_discover(int iterations) {
+    uint8_t address[6], uuid[16];
+    int srvc, chr, conn_id, i, j, n, wakeups;
+    int total = DISCOVER_SRVCS * (1 + 2 * DISCOVER_CHARS);
+    uint64_t start, staged_ns, all_ns;
+
+    device_address(0x20000, address);
+    fakehal_add_device(address, -50, NULL, 0);
+
+    memset(uuid, 0, sizeof(uuid));
+    for (i = 0; i < DISCOVER_SRVCS; i++) {
+        uuid[12] = i;
+        srvc = fakehal_add_service(address, uuid, 1);
+        for (j = 0; j < DISCOVER_CHARS; j++) {
+            uuid[0] = 1;
+            uuid[13] = j;
+            chr = fakehal_add_characteristic(address, srvc, uuid, 0x12);
+            uuid[0] = 2;
+            fakehal_add_descriptor(address, srvc, chr, uuid);
+            uuid[0] = 0;
+            uuid[13] = 0;
+        }
+    }
+
+    connected = 0;
+    if (ble_connect(address) < 0 || connected != 1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+    conn_id = last_conn_id;
+
+    /* Callbacks go through the HAL thread, as with a real stack */
+    fakehal_set_inline(0);
+
+    wakeups = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        found_count = 0;
+        ble_gatt_discover_services(conn_id, NULL);
+        wait_finished();
+        wakeups++;
+
+        /* Attribute ids are stable, so the n-th found is id n - 1 */
+        for (j = 0; j < DISCOVER_SRVCS; j++) {
+            ble_gatt_discover_characteristics(conn_id, j);
+            wait_finished();
+            wakeups++;
+        }
+
+        n = found_count - DISCOVER_SRVCS;
+        for (j = 0; j < n; j++) {
+            ble_gatt_discover_descriptors(conn_id, j);
+            wait_finished();
+            wakeups++;
+        }
+    }
+    staged_ns = now_ns() - start;
+
+    if (found_count != total) {
+        printf("Staged discovery found %d of %d attributes\n", found_count,
+               total);
+        fakehal_set_inline(1);
+        return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        discovered = 0;
+        if (ble_gatt_discover_all(conn_id, discovery_cb) < 0)
+            break;
+        wait_finished();
+        if (discovered != total)
+            break;
+    }
+    all_ns = now_ns() - start;
+
+    fakehal_set_inline(1);
+
+    if (i < iterations) {
+        printf("discover_all found %d of %d attributes\n", discovered, total);
+        return -1;
+    }
+
+    printf("%d attributes\n", total);
+    printf("%-14s %12s %10s\n", "", "us/device", "wakeups");
+    printf("%-14s %12.1f %10d\n", "staged", staged_ns / 1000.0 / iterations,
+           wakeups / iterations);
+    printf("%-14s %12.1f %10d\n", "discover_all", all_ns / 1000.0 / iterations,
+           1);
+
+    return 0;
+}
+
+/* Cost of scan report delivery, one callback per report versus batches */
+static int bench_scan(int iterations) {
+    static const int batch_sizes[] = { 0, 16, 64, 256 };
+    uint8_t address[6], adv[BLE_ADV_DATA_LEN];
+    int b, i;
+    uint64_t start, elapsed;
+
+    memset(adv, 0, sizeof(adv));
+    adv[0] = 2;
+    adv[1] = 0x01;
+    adv[2] = 0x06;
+
+    if (ble_start_scan() < 0) {
+        printf("Failed to start scan\n");
+        return -1;
+    }
+
+    printf("%10s %12s %12s\n", "batch", "ns/report", "callbacks");
+
+    for (b = 0; b < (int) (sizeof(batch_sizes) / sizeof(batch_sizes[0])); b++) {
+        if (batch_sizes[b])
+            ble_set_scan_batching(batch_sizes[b], 0, scan_batch_cb);
+
+        /* scan_cb is always called, count only what the consumer gets */
+        scan_reports = 0;
+        scan_calls = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            device_address(i % 1000, address);
+            fakehal_advertise(address, -60, adv, sizeof(adv));
+        }
+        ble_flush_scan_batch();
+        elapsed = now_ns() - start;
+
+        if (batch_sizes[b]) {
+            scan_reports -= iterations;
+            scan_calls -= iterations;
+        }
+
+        if (scan_reports != iterations) {
+            printf("Lost %d reports\n", iterations - scan_reports);
+            return -1;
+        }
+
+        printf("%10d %12.1f %12d\n", batch_sizes[b] ? batch_sizes[b] : 1,
+               (double) elapsed / iterations, scan_calls);
+    }
+
+    ble_set_scan_batching(0, 0, NULL);
+    ble_stop_scan();
+
+    return 0;
+}
+
+#define COALESCE_DEVICES 200
+
+/* Reports delivered out of a crowd of beacons whose RSSI jitters by a few dBm
+ * and whose payload rarely changes, with and without coalescing */
+static int bench_coalesce(int iterations) {
+    static const int thresholds[] = { 0, 1, 6 };
+    uint8_t address[6], adv[COALESCE_DEVICES][BLE_ADV_DATA_LEN];
+    int t, i, dev, changes;
+    uint64_t start, elapsed;
+
+    if (ble_start_scan() < 0) {
+        printf("Failed to start scan\n");
+        return -1;
+    }
+
+    printf("%10s %12s %12s %12s\n", "threshold", "ns/report", "delivered",
+           "changes");
+
+    for (t = 0; t < (int) (sizeof(thresholds) / sizeof(thresholds[0])); t++) {
+        ble_set_scan_coalescing(thresholds[t], 0, 0);
+
+        /* Flags plus manufacturer data holding a counter */
+        memset(adv, 0, sizeof(adv));
+        for (dev = 0; dev < COALESCE_DEVICES; dev++) {
+            memcpy(adv[dev], "\x02\x01\x06\x05\xff\x4c\x00", 7);
+            adv[dev][7] = dev;
+        }
+
+        srand(1);
+        changes = 0;
+        scan_reports = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            dev = i % COALESCE_DEVICES;
+            if (rand() % 1000 == 0) {
+                adv[dev][8]++;
+                changes++;
+            }
+            device_address(dev, address);
+            fakehal_advertise(address, -60 + rand() % 5, adv[dev],
+                              BLE_ADV_DATA_LEN);
+        }
+        elapsed = now_ns() - start;
+
+        printf("%10d %12.1f %12d %12d\n", thresholds[t],
+               (double) elapsed / iterations, scan_reports, changes);
+    }
+
+    ble_set_scan_coalescing(0, 0, 0);
+    ble_stop_scan();
+
+    return 0;
+}
+
+#define FILTER_DEVICES 1000
+
+/* Cost of evaluating scan filters on a crowd where a tenth of the devices are
+ * of interest, half of them found by service UUID and half by manufacturer
+ * data */
+static int bench_filter(int iterations) {
+    static const uint8_t hr_uuid[16] = { 0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00,
+                                         0x00, 0x80, 0x00, 0x10, 0x00, 0x00,
+                                         0x0d, 0x18, 0x00, 0x00 };
+    uint8_t address[6], adv[FILTER_DEVICES][BLE_ADV_DATA_LEN];
+    ble_scan_filter_t filters[2];
+    int f, i, dev;
+    uint64_t start, elapsed;
+
+    /* Flags, a service list and manufacturer data on every device */
+    memset(adv, 0, sizeof(adv));
+    for (dev = 0; dev < FILTER_DEVICES; dev++) {
+        memcpy(adv[dev], "\x02\x01\x06\x05\x03\x0f\x18\x0a\x18"
+               "\x06\xff\x59\x00\x01\x02", 15);
+        if (dev % 20 == 0)
+            adv[dev][7] = 0x0d; /* Heart rate instead of device information */
+        else if (dev % 20 == 10)
+            adv[dev][13] = 0x42; /* The data prefix the filter looks for */
+        adv[dev][14] = dev;
+    }
+
+    memset(filters, 0, sizeof(filters));
+    filters[0].type = BLE_SCAN_FILTER_SERVICE_UUID;
+    memcpy(filters[0].uuid, hr_uuid, sizeof(hr_uuid));
+    filters[1].type = BLE_SCAN_FILTER_MANUFACTURER_DATA;
+    filters[1].company_id = 0x0059;
+    filters[1].data[0] = 0x42;
+    filters[1].data_len = 1;
+
+    if (ble_start_scan() < 0) {
+        printf("Failed to start scan\n");
+        return -1;
+    }
+
+    printf("%10s %12s %12s\n", "filters", "ns/report", "delivered");
+
+    for (f = 0; f <= 2; f++) {
+        if (f)
+            ble_set_scan_filters(filters, f == 1 ? 0 : 2, -100);
+
+        scan_reports = 0;
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            dev = i % FILTER_DEVICES;
+            device_address(dev, address);
+            fakehal_advertise(address, -60, adv[dev], BLE_ADV_DATA_LEN);
+        }
+        elapsed = now_ns() - start;
+
+        printf("%10s %12.1f %12d\n", f == 0 ? "none" : f == 1 ? "rssi" :
+               "uuid+manuf", (double) elapsed / iterations, scan_reports);
+    }
+
+    ble_clear_scan_filters();
+    ble_stop_scan();
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(int iterations);
+    int iterations;
+    const char *desc;
+} benchmarks[] = {
+    { "devices", bench_devices, 200000,
+      "Callback cost versus number of known devices" },
+    { "chars", bench_chars, 200000,
+      "Read response cost versus number of characteristics" },
+    { "scan", bench_scan, 1000000,
+      "Scan report delivery, per report and batched" },
+    { "coalesce", bench_coalesce, 1000000,
+      "Scan reports delivered with and without coalescing" },
+    { "filter", bench_filter, 1000000,
+      "Scan filter evaluation cost" },
+    { "notify", bench_notify, 1000000,
+      "Notification routing to per-characteristic handlers" },
+    { "notifring", bench_notify_ring, 1000000,
+      "Notifications to a slow consumer, on the stack thread versus ring" },
+    { "dispatch", bench_dispatch, 200000,
+      "Notifications reaching the main thread, callbacks versus event fd" },
+    { "ops", bench_ops, 100000,
+      "GATT reads, one at a time versus queued" },
+    { "readmulti", bench_read_multiple, 20000,
+      "Polling many characteristics, one read each versus read_multiple" },
+    { "writelong", bench_write_long, 2000,
+      "Long value writes, write_req_char versus write_long_char" },
+    { "stream", bench_stream, 20000,
+      "Write command throughput, one at a time versus stream_char" },
+    { "discover", bench_discover, 200,
+      "Full discovery, staged by the caller versus in libble" },
+    { "threads", bench_threads, 10000,
+      "Concurrent reads from several threads, per device and shared" },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void usage(const char *prog) {
+    unsigned int i;
+
+    printf("Usage: %s <benchmark> [iterations]\n\nBenchmarks:\n", prog);
+    for (i = 0; i < NBENCHMARKS; i++)
+        printf("  %-12s %s\n", benchmarks[i].name, benchmarks[i].desc);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int i;
+    int status, iterations;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < NBENCHMARKS; i++)
+        if (!strcmp(argv[1], benchmarks[i].name))
+            break;
+
+    if (i == NBENCHMARKS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    iterations = argc > 2 ? atoi(argv[2]) : benchmarks[i].iterations;
+    if (iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Use only devices created by the benchmarks, delivered without latency */
+    fakehal_reset();
+
+    status = ble_enable(ble_cbs);
+    if (status != 0) {
+        printf("Failed to enable libble (%d)\n", status);
+        return 1;
+    }
+    while (!enabled)
+        usleep(1000);
+    fakehal_flush();
+
+    /* Run every callback on the calling thread, so only its cost is timed */
+    fakehal_set_inline(1);
+
+    status = benchmarks[i].run(iterations);
+
+    fakehal_set_inline(0);
+    ble_disable();
+    fakehal_flush();
+
+    return status < 0 ? 1 : 0;
+}
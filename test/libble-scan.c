@@ -68,10 +68,12 @@ static ble_cbs_t ble_cbs = {
 int main (int argc, char *argv[]) {
     int status;
 
+#ifdef __ANDROID__
     if (getuid() != 0) {
         printf("Permission denied\n");
         return 1;
     }
+#endif
 
     enabled = 0;
     printf("Initializing libble... ");